@@ -1103,6 +1103,15 @@ static int start_array(int mdfd,
 					sysfs_free(sra);
 				}
 			}
+#ifndef MDASSEMBLE
+			if (content->reshape_active &&
+			    get_bitmap_pending(fd2devnm(mdfd))) {
+				pr_err("%s: the internal bitmap was removed for this reshape.\n",
+				       mddev);
+				cont_err("Run \"mdadm --grow --continue %s\" to add it back when the reshape completes.\n",
+					 mddev);
+			}
+#endif
 			if (okcnt < (unsigned)content->array.raid_disks) {
 				/* If any devices did not get added
 				 * because the kernel rejected them based
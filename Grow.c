@@ -23,6 +23,7 @@
  */
 #include	"mdadm.h"
 #include	"dlink.h"
+#include	"restripe.h"
 #include	<sys/mman.h>
 #include	<stddef.h>
 #include	<stdint.h>
@@ -507,10 +508,17 @@ int Grow_addbitmap(char *devname, int fd, struct context *c, struct shape *s)
  * device.
  * It if written after the backup is complete.
  * It has the following structure.
+ *
+ * Versions 1 and 2 (one or two sections) use bsb_csum(), which only
+ * ever looked at the first byte, and are still accepted when
+ * restarting.  Versions 3 and 4 use CRC32C for every checksum, and
+ * may carry a CRC32C of each 'data_csum_sectors' of backed up data
+ * in the rest of the 4K before the data, so that a restart can check
+ * the data before restoring it.
  */
 
 static struct mdp_backup_super {
-	char	magic[16];  /* md_backup_data-1 or -2 */
+	char	magic[16];  /* md_backup_data-1 to -4 */
 	__u8	set_uuid[16];
 	__u64	mtime;
 	/* start/sizes in 512byte sectors */
@@ -523,9 +531,42 @@ static struct mdp_backup_super {
 	__u64	arraystart2;
 	__u64	length2;
 	__u32	sb_csum2;	/* csum of preceeding bytes. */
-	__u8 pad[512-68-32];
+	/* from here on only in versions 3 and 4 */
+	__u32	data_csum_sectors;	/* per data csum, 0 if none */
+	__u32	data_csum_sectors2;	/* same for second section */
+	__u32	data_csum_table;	/* csum of bsb_data_csum[] */
+	__u32	sb_csum3;	/* csum of preceeding bytes. */
+	__u8 pad[512-116];
 } __attribute__((aligned(512))) bsb, bsb2;
 
+/* The data checksums of each section, kept on disk just after the
+ * leading copy of the backup-super-block.
+ */
+#define BSB_DATA_CSUMS	((4096 - 512) / 4 / 2)
+static __u32 bsb_data_csum[2][BSB_DATA_CSUMS];
+
+/* On a spare, the trailing copy of the backup-super-block is followed
+ * by an index record.  It says which section was written last and
+ * carries a sequence number, so that when restarting the spares can
+ * all be checked with one read each, at the same time, and only the
+ * one with the newest backup need be examined further.
+ */
+static struct mdp_backup_index {
+	char	magic[16];	/* md_backup_index1 */
+	__u8	set_uuid[16];
+	__u64	seq;		/* increases with every write */
+	__u64	mtime;
+	__u32	newest;		/* section written last, or ~0 if none */
+	__u32	data_csum;	/* csum of its data checksums */
+	/* the newest section, in 512byte sectors */
+	__u64	devstart;
+	__u64	arraystart;
+	__u64	length;
+	__u32	bsb_csum;	/* sb_csum3 of the backup-super-block */
+	__u32	csum;		/* csum of preceeding bytes. */
+	__u8 pad[512-88];
+} __attribute__((aligned(512))) bsi;
+
 static __u32 bsb_csum(char *buf, int len)
 {
 	int i;
@@ -535,6 +576,152 @@ static __u32 bsb_csum(char *buf, int len)
 	return __cpu_to_le32(csum);
 }
 
+/* 1 to 4, or 0 if this is not a backup-super-block */
+static int bsb_version(struct mdp_backup_super *b)
+{
+	if (memcmp(b->magic, "md_backup_data-", 15) != 0 ||
+	    b->magic[15] < '1' || b->magic[15] > '4')
+		return 0;
+	return b->magic[15] - '0';
+}
+
+/* Whether the second section is in use */
+static int bsb_two_sections(struct mdp_backup_super *b)
+{
+	int v = bsb_version(b);
+
+	return v == 2 || v == 4;
+}
+
+static __u32 bsb_csum_of(struct mdp_backup_super *b, void *field)
+{
+	int len = (char*)field - (char*)b;
+
+	if (bsb_version(b) >= 3)
+		return __cpu_to_le32(crc32c(0, b, len));
+	return bsb_csum((char*)b, len);
+}
+
+static void bsb_set_csums(struct mdp_backup_super *b)
+{
+	b->sb_csum = bsb_csum_of(b, &b->sb_csum);
+	if (bsb_two_sections(b))
+		b->sb_csum2 = bsb_csum_of(b, &b->sb_csum2);
+	if (bsb_version(b) >= 3)
+		b->sb_csum3 = bsb_csum_of(b, &b->sb_csum3);
+}
+
+/* Returns 0 if good, else 1 if sb_csum is wrong, 2 for sb_csum2 and
+ * 3 for sb_csum3.
+ */
+static int bsb_check_csums(struct mdp_backup_super *b)
+{
+	if (b->sb_csum != bsb_csum_of(b, &b->sb_csum))
+		return 1;
+	if (bsb_two_sections(b) &&
+	    b->sb_csum2 != bsb_csum_of(b, &b->sb_csum2))
+		return 2;
+	if (bsb_version(b) >= 3 &&
+	    b->sb_csum3 != bsb_csum_of(b, &b->sb_csum3))
+		return 3;
+	return 0;
+}
+
+/* Fill in 'bsi' for 'b', which has just been checksummed.
+ * 'seq' is left alone: the caller bumps it once for each write of
+ * all destinations, so that every copy of one write has the same seq.
+ */
+static void bsi_update(struct mdp_backup_index *i, struct mdp_backup_super *b,
+		       int newest)
+{
+	memcpy(i->magic, "md_backup_index1", 16);
+	memcpy(i->set_uuid, b->set_uuid, 16);
+	i->mtime = b->mtime;
+	i->newest = __cpu_to_le32(newest < 0 ? ~0U : (unsigned)newest);
+	i->data_csum = 0;
+	i->devstart = b->devstart;
+	i->arraystart = 0;
+	i->length = 0;
+	if (newest == 0 && b->length) {
+		i->arraystart = b->arraystart;
+		i->length = b->length;
+	} else if (newest == 1 && b->length2) {
+		i->devstart = __cpu_to_le64(__le64_to_cpu(b->devstart) +
+					    __le64_to_cpu(b->devstart2));
+		i->arraystart = b->arraystart2;
+		i->length = b->length2;
+	}
+	if (newest >= 0 && i->length)
+		i->data_csum = __cpu_to_le32(
+			crc32c(0, bsb_data_csum[newest],
+			       sizeof(bsb_data_csum[newest])));
+	i->bsb_csum = b->sb_csum3;
+	i->csum = __cpu_to_le32(crc32c(0, i, offsetof(struct mdp_backup_index,
+						      csum)));
+}
+
+/* Whether 'i' is a good index for the backup-super-block 'b' */
+static int bsi_valid(struct mdp_backup_index *i, struct mdp_backup_super *b)
+{
+	return memcmp(i->magic, "md_backup_index1", 16) == 0 &&
+		i->csum == __cpu_to_le32(crc32c(0, i,
+			offsetof(struct mdp_backup_index, csum))) &&
+		bsb_version(b) >= 3 && bsb_check_csums(b) == 0 &&
+		i->bsb_csum == b->sb_csum3 &&
+		memcmp(i->set_uuid, b->set_uuid, 16) == 0;
+}
+
+/* Checksum 'len' bytes of backed up data in 'buf' into 'csums',
+ * choosing a whole number of sectors per checksum so that they fit.
+ * Returns the number of sectors per checksum.
+ */
+static __u32 bsb_data_csum_fill(__u32 *csums, char *buf,
+				unsigned long long len)
+{
+	unsigned long long sectors = len / 512;
+	unsigned long long per, off;
+	int i;
+
+	per = (sectors + BSB_DATA_CSUMS - 1) / BSB_DATA_CSUMS;
+	per = (per + 7) & ~7ULL;
+	if (per == 0)
+		per = 8;
+	for (i = 0, off = 0; i < BSB_DATA_CSUMS; i++, off += per * 512) {
+		unsigned long long n = 0;
+
+		if (off < len)
+			n = min(per * 512, len - off);
+		csums[i] = __cpu_to_le32(n ? crc32c(0, buf + off, n) : 0);
+	}
+	return per;
+}
+
+/* Read 'sectors' of backup at 'offset' in 'fd' into 'buf', checking
+ * each 'per' sectors against 'csums' as it arrives.  'per' must not
+ * be zero.
+ * Returns 0 if all is well, 1 on a mismatch, -1 on a read error.
+ */
+static int bsb_data_csum_read(int fd, unsigned long long offset,
+			      unsigned long long sectors, __u32 per,
+			      __u32 *csums, char *buf)
+{
+	unsigned long long len = sectors * 512;
+	unsigned long long off;
+	int i;
+
+	for (i = 0, off = 0; off < len; i++, off += (unsigned long long)per * 512) {
+		size_t n = min((unsigned long long)per * 512, len - off);
+
+		if (i >= BSB_DATA_CSUMS)
+			return 1;
+		if (pread64(fd, buf + off, n, offset + off) != (ssize_t)n)
+			return -1;
+		if (__cpu_to_le32(crc32c(0, buf + off, n)) != csums[i])
+			return 1;
+	}
+	return 0;
+}
+
 static int check_idle(struct supertype *st)
 {
 	/* Check that all member arrays for this container, or the
@@ -628,18 +815,71 @@ static void unfreeze(struct supertype *st)
 	}
 }
 
-static void wait_reshape(struct mdinfo *sra)
+static unsigned long long usec_since(struct timeval *start)
 {
-	int fd = sysfs_get_fd(sra, NULL, "sync_action");
-	char action[20];
+	struct timeval now;
 
-	if (fd < 0)
-		return;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL
+		+ now.tv_usec - start->tv_usec;
+}
 
-	while (sysfs_fd_get_str(fd, action, 20) > 0 &&
-	       strncmp(action, "reshape", 7) == 0)
-		sysfs_wait(fd, NULL);
-	close(fd);
+struct reshape_tuner;
+static struct reshape_tuner *reshape_tuner_init(struct mdinfo *sra, int disks);
+static void reshape_tuner_step(struct reshape_tuner *t);
+static void reshape_tuner_finish(struct reshape_tuner *t);
+
+struct wait_reshape_arg {
+	struct reshape_stats *stats;
+	struct reshape_tuner *tuner;
+};
+
+static int wait_reshape_progress(struct reshape_progress *p, void *arg)
+{
+	struct wait_reshape_arg *a = arg;
+
+	if (a->stats && p->position != MaxSector)
+		reshape_stats_progress(a->stats, p->position);
+	reshape_tuner_step(a->tuner);
+	return 0;
+}
+
+/* Wait for the reshape to finish, recording progress in 'stats' and
+ * tuning it with 'tuner' if they are given.
+ */
+static void wait_reshape(struct mdinfo *sra, struct reshape_stats *stats,
+			 struct reshape_tuner *tuner)
+{
+	struct reshape_watch *w = reshape_watch_open(sra);
+	struct wait_reshape_arg arg = { stats, tuner };
+	struct timeval start;
+	int rv = -1;
+	int fd;
+
+	gettimeofday(&start, NULL);
+	if (w) {
+		rv = reshape_watch_run(w, stats || tuner ?
+				       wait_reshape_progress : NULL, &arg);
+		reshape_watch_close(w);
+	}
+	if (rv < 0) {
+		/* The watcher cannot follow this array, but the caller
+		 * must still not go on before the reshape has finished,
+		 * so just wait for sync_action to change.
+		 */
+		fd = sysfs_get_fd(sra, NULL, "sync_action");
+		if (fd >= 0) {
+			char action[20];
+
+			while (sysfs_fd_get_str(fd, action, 20) > 0 &&
+			       strncmp(action, "reshape", 7) == 0) {
+				sysfs_wait(fd, NULL);
+				reshape_tuner_step(tuner);
+			}
+			close(fd);
+		}
+	}
+	reshape_stats_phase(stats, RESHAPE_PHASE_WAIT, usec_since(&start));
 }
 
 static int reshape_super(struct supertype *st, unsigned long long size,
@@ -2212,8 +2452,11 @@ static int set_new_data_offset(struct mdinfo *sra, struct supertype *st,
 			       char *devname, int delta_disks,
 			       unsigned long long data_offset,
 			       unsigned long long min,
-			       int can_fallback)
+			       int can_fallback, int bitmap_space)
 {
+	/* If 'bitmap_space' the space used by an internal bitmap is
+	 * counted as free: the caller will remove the bitmap.
+	 */
 	struct mdinfo *sd;
 	int dir = 0;
 	int err = 0;
@@ -2257,6 +2500,10 @@ static int set_new_data_offset(struct mdinfo *sra, struct supertype *st,
 			/* Metadata doesn't support data_offset changes */
 			return 1;
 		}
+		if (bitmap_space) {
+			info2.space_before += info2.bitmap_space_before;
+			info2.space_after += info2.bitmap_space_after;
+		}
 		if (before > info2.space_before)
 			before = info2.space_before;
 		if (after > info2.space_after)
@@ -2423,6 +2670,178 @@ fallback:
 	return 1;
 }
 
+static int readd_bitmap(char *devname, int fd, int bitmap_chunk, int verbose)
+{
+	/* Add back the internal bitmap removed by make_data_offset_space(),
+	 * and forget that it was removed.
+	 */
+	struct context c;
+	struct shape s;
+	int rv;
+
+	memset(&c, 0, sizeof(c));
+	memset(&s, 0, sizeof(s));
+	c.verbose = verbose;
+	c.delay = DEFAULT_BITMAP_DELAY;
+	s.bitmap_file = "internal";
+	s.bitmap_chunk = bitmap_chunk;
+	rv = Grow_addbitmap(devname, fd, &c, &s);
+	if (rv && bitmap_chunk != UnSet) {
+		/* The old chunk size may not fit at the new data_offset */
+		s.bitmap_chunk = UnSet;
+		rv = Grow_addbitmap(devname, fd, &c, &s);
+	}
+	if (rv) {
+		pr_err("%s: could not restore the internal bitmap!\n",
+		       devname);
+		cont_err("Add it back with \"mdadm --grow --bitmap=internal %s\"\n",
+			 devname);
+	}
+	clear_bitmap_pending(fd2devnm(fd));
+	return rv;
+}
+
+static int make_data_offset_space(int fd, struct mdinfo *sra,
+				  struct supertype *st, char *devname,
+				  struct mdinfo *info, struct reshape *reshape,
+				  unsigned long long array_sectors,
+				  int verbose, int *bitmap_chunk)
+{
+	/* set_new_data_offset() found too little room to move
+	 * data_offset, so we would need a backup file.  Often we can
+	 * make the room without touching any data:
+	 *  - when only the layout or chunk size changes, the part of each
+	 *    device beyond the exported array_size is not visible to any
+	 *    filesystem, so component_size can be reduced to give
+	 *    space after the data.
+	 *  - an internal bitmap between the metadata and the data can be
+	 *    removed.  The caller adds it back when the reshape finishes,
+	 *    or if it fails to start.
+	 * If set_new_data_offset() still fails, a trimmed component_size
+	 * is restored and a removed bitmap added back.  md won't move
+	 * data_offset into the space of an active bitmap, so the bitmap
+	 * has to go first.
+	 * Returns as set_new_data_offset(), and sets *bitmap_chunk to the
+	 * chunk size (bytes) of the bitmap if that was removed.
+	 */
+	struct mdinfo *sd;
+	mdu_array_info_t array;
+	unsigned long long before = UINT64_MAX, after = UINT64_MAX;
+	unsigned long long bm_before = UINT64_MAX, bm_after = UINT64_MAX;
+	unsigned long long min = reshape->min_offset_change;
+	unsigned long long chunk_size = 0;
+	int delta_disks = reshape->after.data_disks - reshape->before.data_disks;
+	int rv;
+
+	if (delta_disks < 0)
+		/* set_new_data_offset() doesn't need space for these */
+		return 1;
+
+	for (sd = sra->devs; sd; sd = sd->next) {
+		char *dn;
+		int dfd;
+		struct supertype *st2;
+		struct mdinfo info2;
+
+		if (sd->disk.state & (1<<MD_DISK_FAULTY))
+			continue;
+		dn = map_dev(sd->disk.major, sd->disk.minor, 0);
+		dfd = dev_open(dn, O_RDONLY);
+		if (dfd < 0)
+			return 1;
+		st2 = dup_super(st);
+		rv = st2->ss->load_super(st2, dfd, NULL);
+		close(dfd);
+		if (rv) {
+			free(st2);
+			return 1;
+		}
+		st2->ss->getinfo_super(st2, &info2, NULL);
+		st2->ss->free_super(st2);
+		free(st2);
+		if (info2.space_before == 0 && info2.space_after == 0)
+			return 1;
+		before = min(before, info2.space_before);
+		after = min(after, info2.space_after);
+		bm_before = min(bm_before,
+				info2.space_before + info2.bitmap_space_before);
+		bm_after = min(bm_after,
+			       info2.space_after + info2.bitmap_space_after);
+	}
+	if (before == UINT64_MAX)
+		return 1;
+
+	if (delta_disks == 0 && after < min &&
+	    array_sectors < sra->component_size * reshape->before.data_disks) {
+		unsigned long long chunk, need, trim;
+		unsigned long long old_size = sra->component_size;
+
+		chunk = max(info->array.chunk_size, info->new_chunk) / 512;
+		need = (array_sectors + reshape->before.data_disks - 1) /
+			reshape->before.data_disks;
+		need = ROUND_UP(need, chunk);
+		trim = ROUND_UP(min - after, chunk);
+		if (need + trim <= old_size &&
+		    sysfs_set_num(sra, NULL, "component_size",
+				  (old_size - trim)/2) == 0) {
+			sra->component_size = old_size - trim;
+			rv = set_new_data_offset(sra, st, devname, delta_disks,
+						 INVALID_SECTORS, min, 1, 0);
+			if (rv == 0) {
+				if (verbose > 0)
+					pr_err("%s: reduced component size by %lluK to make room for the reshape\n",
+					       devname, trim/2);
+				return 0;
+			}
+			if (sysfs_set_num(sra, NULL, "component_size",
+					  old_size/2) == 0)
+				sra->component_size = old_size;
+			else
+				pr_err("%s: could not restore component size to %lluK\n",
+				       devname, old_size/2);
+			if (rv < 0)
+				return rv;
+		}
+	}
+
+	if (bm_before < min && (delta_disks > 0 || bm_after < min))
+		return 1;
+	if (before == bm_before && after == bm_after)
+		/* no internal bitmap in the way */
+		return 1;
+	if (ioctl(fd, GET_ARRAY_INFO, &array) != 0 ||
+	    !(array.state & (1<<MD_SB_BITMAP_PRESENT)))
+		return 1;
+	if (sysfs_get_ll(sra, NULL, "bitmap/chunksize", &chunk_size) < 0 ||
+	    chunk_size == 0)
+		chunk_size = UnSet;
+	array.state &= ~(1<<MD_SB_BITMAP_PRESENT);
+	if (ioctl(fd, SET_ARRAY_INFO, &array) != 0)
+		return 1;
+	rv = set_new_data_offset(sra, st, devname, delta_disks,
+				 INVALID_SECTORS, min, 1, 1);
+	if (rv) {
+		/* put the offsets and the bitmap back */
+		for (sd = sra->devs; sd; sd = sd->next)
+			if (!(sd->disk.state & (1<<MD_DISK_FAULTY)))
+				sysfs_set_num(sra, sd, "new_offset",
+					      sd->data_offset);
+		readd_bitmap(devname, fd, chunk_size, verbose);
+		return rv;
+	}
+	*bitmap_chunk = chunk_size;
+	set_bitmap_pending(sra->sys_name, chunk_size);
+	pr_err("%s: removed the internal bitmap to make room for the reshape,\n",
+	       devname);
+	cont_err("it will be added back when the reshape completes.\n");
+	cont_err("If mdadm is interrupted before then, \"mdadm --grow --continue %s\"\n",
+		 devname);
+	cont_err("will add it back, or use \"mdadm --grow --bitmap=internal %s\"\n",
+		 devname);
+	cont_err("once the reshape has finished.\n");
+	return 0;
+}
+
 static int raid10_reshape(char *container, int fd, char *devname,
 			  struct supertype *st, struct mdinfo *info,
 			  struct reshape *reshape,
@@ -2477,7 +2896,7 @@ static int raid10_reshape(char *container, int fd, char *devname,
 		}
 	}
 	err = set_new_data_offset(sra, st, devname, info->delta_disks, data_offset,
-				  min, 0);
+				  min, 0, 0);
 	if (err == 1) {
 		pr_err("Cannot set new_data_offset: RAID10 reshape not\n");
 		cont_err("supported on this kernel\n");
@@ -2798,6 +3217,33 @@ static int continue_via_systemd(char *devnm)
 	return 0;
 }
 
+/* Wait for a reshape that needs no backup to finish, then set the final
+ * level and add back a bitmap removed by make_data_offset_space().
+ * 'fd' is closed, and 'stats' destroyed.
+ */
+static void finish_offset_reshape(struct mdinfo *sra, int fd, char *devname,
+				  int new_level, int level, int bitmap_chunk,
+				  struct reshape_stats *stats,
+				  struct reshape_tuner *tuner, int verbose)
+{
+	close(fd);
+	wait_reshape(sra, stats, tuner);
+	reshape_tuner_finish(tuner);
+	reshape_stats_destroy(stats);
+	fd = open_dev(sra->sys_name);
+	if (fd < 0) {
+		if (bitmap_chunk)
+			pr_err("%s: cannot reopen to restore the internal bitmap, add it back with \"mdadm --grow --bitmap=internal %s\"\n",
+			       devname, devname);
+		return;
+	}
+	if (new_level != UnSet && new_level != level)
+		impose_level(fd, new_level, devname, verbose);
+	if (bitmap_chunk)
+		readd_bitmap(devname, fd, bitmap_chunk, verbose);
+	close(fd);
+}
+
 static int reshape_array(char *container, int fd, char *devname,
 			 struct supertype *st, struct mdinfo *info,
 			 int force, struct mddev_dev *devlist,
@@ -2810,6 +3256,11 @@ static int reshape_array(char *container, int fd, char *devname,
 	char *msg;
 	int orig_level = UnSet;
 	int odisks;
+	int offset_rv = 1;
+	int tune = 0;
+	struct reshape_tuner *tuner = NULL;
+	struct reshape_stats *stats = NULL;
+	int bitmap_chunk = 0;
 	int delayed;
 
 	struct mdu_array_info_s array;
@@ -2891,10 +3342,40 @@ static int reshape_array(char *container, int fd, char *devname,
 	}
 	if (restart) {
 		/* reshape already started. just skip to monitoring the reshape */
-		if (reshape.backup_blocks == 0)
-			return 0;
-		if (restart & RESHAPE_NO_BACKUP)
+		if (reshape.backup_blocks == 0 ||
+		    (restart & RESHAPE_NO_BACKUP)) {
+			/* Nothing to monitor, unless the bitmap was removed
+			 * to make room for the reshape and must go back.
+			 */
+			bitmap_chunk = get_bitmap_pending(fd2devnm(fd));
+			if (!bitmap_chunk)
+				return 0;
+			sra = sysfs_read(fd, NULL, GET_VERSION);
+			if (!sra) {
+				pr_err("%s: Cannot get array details from sysfs\n",
+				       devname);
+				goto release;
+			}
+			stats = reshape_stats_create(sra->sys_name);
+			switch(forked ? 0 : fork()) {
+			case -1:
+				break;
+			default: /* parent */
+				reshape_stats_detach(stats);
+				sysfs_free(sra);
+				return 0;
+			case 0:
+				if (!forked)
+					map_fork();
+				reshape_stats_claim(stats);
+				break;
+			}
+			finish_offset_reshape(sra, fd, devname, UnSet,
+					      reshape.level, bitmap_chunk,
+					      stats, NULL, verbose);
+			sysfs_free(sra);
 			return 0;
+		}
 
 		/* Need 'sra' down at 'started:' */
 		sra = sysfs_read(fd, NULL,
@@ -3128,11 +3609,22 @@ static int reshape_array(char *container, int fd, char *devname,
 		goto release;
 	}
 
+	if (!backup_file) {
+		offset_rv = set_new_data_offset(sra, st, devname,
+						reshape.after.data_disks - reshape.before.data_disks,
+						data_offset,
+						reshape.min_offset_change, 1, 0);
+		/* See if we can make room rather than use a backup */
+		if (offset_rv == 1 && data_offset == INVALID_SECTORS &&
+		    !restart && !check_env("MDADM_GROW_NO_SPACE_PLAN"))
+			offset_rv = make_data_offset_space(fd, sra, st, devname,
+							   info, &reshape,
+							   array_size/512,
+							   verbose,
+							   &bitmap_chunk);
+	}
 	if (!backup_file)
-		switch(set_new_data_offset(sra, st, devname,
-					   reshape.after.data_disks - reshape.before.data_disks,
-					   data_offset,
-					   reshape.min_offset_change, 1)) {
+		switch(offset_rv) {
 	case -1:
 		goto release;
 	case 0:
@@ -3147,29 +3639,49 @@ static int reshape_array(char *container, int fd, char *devname,
 		sync_metadata(st);
 
 		if (impose_reshape(sra, info, st, fd, restart,
-				   devname, container, &reshape) < 0)
+				   devname, container, &reshape) < 0) {
+			if (bitmap_chunk)
+				readd_bitmap(devname, fd, bitmap_chunk, verbose);
 			goto release;
+		}
 		if (sysfs_set_str(sra, NULL, "sync_action", "reshape") < 0) {
 			pr_err("Failed to initiate reshape!\n");
+			if (bitmap_chunk)
+				readd_bitmap(devname, fd, bitmap_chunk, verbose);
 			goto release;
 		}
-		if (info->new_level == reshape.level)
+		tune = getenv("MDADM_GROW_CACHE_MAX") &&
+			*getenv("MDADM_GROW_CACHE_MAX");
+		stats = reshape_stats_create(sra->sys_name);
+		if (info->new_level == reshape.level && !bitmap_chunk &&
+		    !tune && !stats)
 			return 0;
-		/* need to adjust level when reshape completes */
+		/* need to adjust level, or restore the bitmap,
+		 * when reshape completes, or tune it or keep
+		 * statistics as it goes */
 		switch(fork()) {
 		case -1: /* ignore error, but don't wait */
-			return 0;
+			if (!bitmap_chunk) {
+				reshape_stats_destroy(stats);
+				return 0;
+			}
+			/* unless the bitmap must be put back */
+			break;
 		default: /* parent */
+			reshape_stats_detach(stats);
 			return 0;
 		case 0:
 			map_fork();
+			reshape_stats_claim(stats);
+			tuner = reshape_tuner_init(sra,
+						   max(reshape.before.data_disks,
+						       reshape.after.data_disks)
+						   + reshape.parity);
 			break;
 		}
-		close(fd);
-		wait_reshape(sra);
-		fd = open_dev(sra->sys_name);
-		if (fd >= 0)
-			impose_level(fd, info->new_level, devname, verbose);
+		finish_offset_reshape(sra, fd, devname, info->new_level,
+				      reshape.level, bitmap_chunk, stats,
+				      tuner, verbose);
 		return 0;
 	case 1: /* Couldn't set data_offset, try the old way */
 		if (data_offset != INVALID_SECTORS) {
@@ -3307,6 +3819,7 @@ started:
 		map_fork();
 		break;
 	}
+	reshape.stats = reshape_stats_create(sra->sys_name);
 
 	/* If another array on the same devices is busy, the
 	 * reshape will wait for them.  This would mean that
@@ -3395,10 +3908,11 @@ started:
 		/* no need to wait for the reshape to finish as
 		 * there is nothing more to do.
 		 */
+		reshape_stats_destroy(reshape.stats);
 		sysfs_free(sra);
 		exit(0);
 	}
-	wait_reshape(sra);
+	wait_reshape(sra, reshape.stats, NULL);
 
 	if (st->ss->external) {
 		/* Re-load the metadata as much could have changed */
@@ -3428,6 +3942,7 @@ started:
 			st->update_tail = NULL;
 	}
 out:
+	reshape_stats_destroy(reshape.stats);
 	sysfs_free(sra);
 	if (forked)
 		return 0;
@@ -3635,7 +4150,8 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		     unsigned long long backup_point,
 		     unsigned long long wait_point,
 		     unsigned long long *suspend_point,
-		     unsigned long long *reshape_completed, int *frozen)
+		     unsigned long long *reshape_completed, int *frozen,
+		     struct reshape_watch *w)
 {
 	/* This function is called repeatedly by the reshape manager.
 	 * It determines how much progress can safely be made and allows
@@ -3675,6 +4191,9 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	 *   should copy this into ->reshape_progress when it has reason to
 	 *   believe that the metadata knows this, and any backup outside this
 	 *   has been erased.
+	 * - 'w' watches the array for progress.  The caller keeps it open
+	 *   for the whole reshape so that its timer stays calibrated to
+	 *   the rate of progress.  If it is NULL we can't wait.
 	 *
 	 * Return value is:
 	 *   1 if more data from backup_point - but only as far as suspend_point,
@@ -3695,7 +4214,7 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	unsigned long long max_progress, target, completed;
 	unsigned long long array_size = (info->component_size
 					 * reshape->before.data_disks);
-	int fd;
+	struct reshape_progress p;
 	char buf[20];
 
 	/* First, we unsuspend any region that is now known to be safe.
@@ -3857,25 +4376,21 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 
 	/* Now wait.  If we have already reached the point that we were
 	 * asked to wait to, don't wait at all, else wait for any change.
-	 * We need to select on 'sync_completed' as that is the place that
-	 * notifications happen, but we are really interested in
-	 * 'reshape_position'
+	 * Notifications happen on 'sync_completed', but we are really
+	 * interested in 'reshape_position'; the watcher follows both.
 	 */
-	fd = sysfs_get_fd(info, NULL, "sync_completed");
-	if (fd < 0)
+	if (!w)
 		goto check_progress;
 
-	if (sysfs_fd_get_ll(fd, &completed) < 0)
+	if (reshape_watch_read(w, &p) < 0 || !p.completed_valid)
 		goto check_progress;
+	completed = p.completed;
 
 	while (completed < max_progress && completed < wait_point) {
 		/* Check that sync_action is still 'reshape' to avoid
 		 * waiting forever on a dead array
 		 */
-		char action[20];
-		if (sysfs_get_str(info, NULL, "sync_action",
-				  action, 20) <= 0 ||
-		    strncmp(action, "reshape", 7) != 0)
+		if (!p.reshaping)
 			break;
 		/* Some kernels reset 'sync_completed' to zero
 		 * before setting 'sync_action' to 'idle'.
@@ -3888,9 +4403,10 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		    && info->reshape_progress < (info->component_size
 						 * reshape->after.data_disks))
 			break;
-		sysfs_wait(fd, NULL);
-		if (sysfs_fd_get_ll(fd, &completed) < 0)
+		reshape_watch_wait(w, NULL);
+		if (reshape_watch_read(w, &p) < 0 || !p.completed_valid)
 			goto check_progress;
+		completed = p.completed;
 	}
 	/* Some kernels reset 'sync_completed' to zero,
 	 * we need to have real point we are in md
@@ -3909,8 +4425,6 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 	}
 	*reshape_completed = completed;
 
-	close(fd);
-
 	/* We return the need_backup flag.  Caller will decide
 	 * how much - a multiple of ->backup_blocks up to *suspend_point
 	 */
@@ -3931,16 +4445,20 @@ check_progress:
 	if (sysfs_get_str(info, NULL, "reshape_position", buf, sizeof(buf)) < 0
 	    || strncmp(buf, "none", 4) != 0) {
 		/* The abort might only be temporary.  Wait up to 10
-		 * seconds for fd to contain a valid number again.
+		 * seconds for sync_completed to contain a valid number again.
 		 */
 		int wait = 10000;
 		int rv = -2;
 		unsigned long long new_sync_max;
-		while (fd >= 0 && rv < 0 && wait > 0) {
-			if (sysfs_wait(fd, &wait) != 1)
+		while (w && rv < 0 && wait > 0) {
+			if (reshape_watch_wait(w, &wait) < 0 &&
+			    errno != EINTR)
 				break;
-			switch (sysfs_fd_get_ll(fd, &completed)) {
+			switch (reshape_watch_read(w, &p)) {
 			case 0:
+			case 1:
+				if (!p.completed_valid)
+					break;
 				/* all good again */
 				rv = 1;
 				/* If "sync_max" is no longer max_progress
@@ -3949,18 +4467,14 @@ check_progress:
 				sysfs_get_ll(info, NULL, "sync_max", &new_sync_max);
 				*frozen = (new_sync_max != max_progress);
 				break;
-			case -2: /* read error - abort */
+			case -1: /* read error - abort */
 				wait = 0;
 				break;
 			}
 		}
-		if (fd >= 0)
-			close(fd);
 		return rv; /* abort */
 	} else {
 		/* Maybe racing with array shutdown - check state */
-		if (fd >= 0)
-			close(fd);
 		if (sysfs_get_str(info, NULL, "array_state", buf, sizeof(buf)) < 0
 		    || strncmp(buf, "inactive", 8) == 0
 		    || strncmp(buf, "clear",5) == 0)
@@ -3969,25 +4483,184 @@ check_progress:
 	}
 }
 
-/* FIXME return status is never checked */
-static int grow_backup(struct mdinfo *sra,
+/* Record the outcome of 'b' for each backup destination in 'status':
+ * 0 while all of its requests have succeeded, else the errno of the
+ * first to fail, which is reported as it happens.  A destination
+ * which has failed keeps that error.
+ */
+static void backup_status(struct stripe_io_batch *b, int dests, int *destfd,
+			  int *status)
+{
+	int i, j;
+
+	if (!status)
+		return;
+	for (i = 0; i < b->nreqs; i++) {
+		if (b->reqs[i].err == 0)
+			continue;
+		for (j = 0; j < dests; j++)
+			if (destfd[j] == b->reqs[i].fd && status[j] == 0) {
+				status[j] = b->reqs[i].err;
+				pr_err("backup to destination %d failed: %s\n",
+				       j, strerror(status[j]));
+			}
+	}
+}
+
+/* The highest seq in a valid index record left on any destination by an
+ * earlier run of this reshape, or 0.  A new run must carry on from there:
+ * restart_scan_index() trusts the highest seq, and a spare that missed
+ * the new run's writes would still hold the old one.
+ */
+static unsigned long long bsi_disk_seq(int dests, int *destfd,
+				       unsigned long long *destoffsets,
+				       unsigned long long devstart2,
+				       __u8 *uuid)
+{
+	char *bufs;
+	struct stripe_io_req *reqs;
+	struct stripe_io_batch b;
+	struct stripe_io *sio;
+	unsigned long long seq = 0;
+	int i;
+
+	if (dests == 0 || posix_memalign((void**)&bufs, 4096, dests * 1024))
+		return 0;
+	reqs = xcalloc(dests, sizeof(*reqs));
+	b.reqs = reqs;
+	b.nreqs = 0;
+	for (i = 0; i < dests; i++) {
+		struct stripe_io_req *req;
+
+		if (destoffsets[i] <= 4096)
+			/* no trailing copy, see write_backup_super() */
+			continue;
+		req = &reqs[b.nreqs++];
+		req->fd = destfd[i];
+		req->op = STRIPE_IO_READ;
+		req->buf = bufs + i * 1024;
+		req->len = 1024;
+		req->offset = destoffsets[i] + devstart2 * 512;
+	}
+	if (b.nreqs) {
+		sio = stripe_io_create(b.nreqs);
+		stripe_io_submit(sio, &b);
+		stripe_io_wait(sio, &b);
+		stripe_io_destroy(sio);
+	}
+	for (i = 0; i < b.nreqs; i++) {
+		struct mdp_backup_super *sb = (void*)reqs[i].buf;
+		struct mdp_backup_index *ix = (void*)(reqs[i].buf + 512);
+
+		if (reqs[i].err || !bsi_valid(ix, sb) ||
+		    memcmp(sb->set_uuid, uuid, 16) != 0)
+			continue;
+		if (__le64_to_cpu(ix->seq) > seq)
+			seq = __le64_to_cpu(ix->seq);
+	}
+	free(reqs);
+	free(bufs);
+	return seq;
+}
+
+/* Write the backup superblock and data checksums to every destination
+ * 4K before its data, and on spares the superblock and index record
+ * again just after the 'devstart2' sectors set aside for the data,
+ * where Grow_restart() looks for them.  Then fsync.
+ * 'newest' is the section written last, or -1 if none is in use.
+ * All destinations are written at once, then once every write has
+ * completed all of them are fsynced at once, so this takes as long as
+ * the slowest device rather than the sum of them.
+ * Returns 0 if every destination was written and synced, else -1.
+ * If 'status' is not NULL, failures are also recorded there for each
+ * destination, see backup_status().
+ */
+static int write_backup_super(int dests, int *destfd,
+			      unsigned long long *destoffsets,
+			      int newest, int *status)
+{
+	char *hdrs;
+	struct stripe_io_req *reqs;
+	struct stripe_io_batch b;
+	struct stripe_io *sio;
+	int i, rv;
+
+	if (dests == 0)
+		return 0;
+	if (posix_memalign((void**)&hdrs, 4096, dests * 8192))
+		return -1;
+	reqs = xcalloc(dests * 2, sizeof(*reqs));
+	b.reqs = reqs;
+	b.nreqs = 0;
+	/* One seq for this write, whichever destination it lands on */
+	bsi.seq = __cpu_to_le64(__le64_to_cpu(bsi.seq) + 1);
+	for (i = 0; i < dests; i++) {
+		struct stripe_io_req *req;
+		char *hdr = hdrs + i * 8192;
+
+		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
+		bsb_set_csums(&bsb);
+		bsi_update(&bsi, &bsb, newest);
+		memcpy(hdr, &bsb, 512);
+		memcpy(hdr + 512, bsb_data_csum, sizeof(bsb_data_csum));
+		memcpy(hdr + 4096, &bsb, 512);
+		memcpy(hdr + 4096 + 512, &bsi, 512);
+
+		req = &reqs[b.nreqs++];
+		req->fd = destfd[i];
+		req->op = STRIPE_IO_WRITE;
+		req->buf = hdr;
+		req->len = 4096;
+		req->offset = destoffsets[i] - 4096;
+		if (destoffsets[i] > 4096) {
+			req = &reqs[b.nreqs++];
+			req->fd = destfd[i];
+			req->op = STRIPE_IO_WRITE;
+			req->buf = hdr + 4096;
+			req->len = 1024;
+			req->offset = destoffsets[i] +
+				__le64_to_cpu(bsb.devstart2)*512;
+		}
+	}
+
+	sio = stripe_io_create(dests);
+	stripe_io_submit(sio, &b);
+	rv = stripe_io_wait(sio, &b) ? -1 : 0;
+	backup_status(&b, dests, destfd, status);
+
+	/* A linked fsync only waits for the one request before it, and
+	 * there are two writes per device, so sync in a second batch.
+	 */
+	memset(reqs, 0, dests * sizeof(*reqs));
+	b.nreqs = 0;
+	for (i = 0; i < dests; i++) {
+		struct stripe_io_req *req = &reqs[b.nreqs++];
+
+		req->fd = destfd[i];
+		req->op = STRIPE_IO_FSYNC;
+	}
+	stripe_io_submit(sio, &b);
+	if (stripe_io_wait(sio, &b))
+		rv = -1;
+	stripe_io_destroy(sio);
+	backup_status(&b, dests, destfd, status);
+	free(reqs);
+	free(hdrs);
+	return rv;
+}
+
+static int grow_backup_read(struct mdinfo *sra,
 		unsigned long long offset, /* per device */
 		unsigned long stripes, /* per device, in old chunks */
 		int *sources, unsigned long long *offsets,
 		int disks, int chunk, int level, int layout,
-		int dests, int *destfd, unsigned long long *destoffsets,
-		int part, int *degraded,
-		char *buf)
+		int *degraded, char *buf)
 {
-	/* Backup 'blocks' sectors at 'offset' on each device of the array,
-	 * to storage 'destfd' (offset 'destoffsets'), after first
-	 * suspending IO.  Then allow resync to continue
-	 * over the suspended section.
-	 * Use part 'part' of the backup-super-block.
+	/* Read the 'stripes' old stripes at 'offset' on each device of
+	 * the array into 'buf', ready for grow_backup_write().
+	 * The region must already be suspended.
 	 */
 	int odata = disks;
-	int rv = 0;
-	int i;
 	unsigned long long ll;
 	int new_degraded;
 	//printf("offset %llu\n", offset);
@@ -4023,56 +4696,101 @@ static int grow_backup(struct mdinfo *sra,
 		}
 		*degraded = new_degraded;
 	}
+
+	return save_stripes(sources, offsets,
+			    disks, chunk, level, layout,
+			    0, NULL,
+			    offset*512*odata, stripes * chunk * odata,
+			    buf);
+}
+
+static int grow_backup_write(unsigned long long offset, /* per device */
+			     unsigned long stripes, /* per device, in old chunks */
+			     int odata, int chunk,
+			     int dests, int *destfd,
+			     unsigned long long *destoffsets,
+			     int part, char *buf, int *status)
+{
+	/* Write the data read by grow_backup_read() to part 'part' of
+	 * every backup destination at once, then the backup-super-block
+	 * and data checksums describing it.
+	 * The super-block is not written if any data write failed.
+	 * 'status' is as for write_backup_super().
+	 */
+	unsigned long long len = (unsigned long long)stripes * chunk * odata;
+	struct stripe_io_req *reqs;
+	struct stripe_io_batch b;
+	struct stripe_io *sio;
+	int i, rv;
+
+	__u32 per = 0;
+
+	if (!check_env("MDADM_GROW_NO_DATA_CSUM"))
+		per = bsb_data_csum_fill(bsb_data_csum[part], buf, len);
 	if (part) {
 		bsb.arraystart2 = __cpu_to_le64(offset * odata);
 		bsb.length2 = __cpu_to_le64(stripes * (chunk/512) * odata);
+		bsb.data_csum_sectors2 = __cpu_to_le32(per);
 	} else {
 		bsb.arraystart = __cpu_to_le64(offset * odata);
 		bsb.length = __cpu_to_le64(stripes * (chunk/512) * odata);
+		bsb.data_csum_sectors = __cpu_to_le32(per);
 	}
+	bsb.data_csum_table = __cpu_to_le32(crc32c(0, bsb_data_csum,
+						   sizeof(bsb_data_csum)));
 	if (part)
-		bsb.magic[15] = '2';
-	for (i = 0; i < dests; i++)
-		if (part)
-			lseek64(destfd[i], destoffsets[i] + __le64_to_cpu(bsb.devstart2)*512, 0);
-		else
-			lseek64(destfd[i], destoffsets[i], 0);
+		bsb.magic[15] = '4';
 
-	rv = save_stripes(sources, offsets,
-			  disks, chunk, level, layout,
-			  dests, destfd,
-			  offset*512*odata, stripes * chunk * odata,
-			  buf);
+	reqs = xcalloc(dests, sizeof(*reqs));
+	b.reqs = reqs;
+	b.nreqs = dests;
+	for (i = 0; i < dests; i++) {
+		reqs[i].fd = destfd[i];
+		reqs[i].op = STRIPE_IO_WRITE;
+		reqs[i].buf = buf;
+		reqs[i].len = len;
+		reqs[i].offset = destoffsets[i];
+		if (part)
+			reqs[i].offset += __le64_to_cpu(bsb.devstart2)*512;
+	}
+	sio = stripe_io_create(dests);
+	stripe_io_submit(sio, &b);
+	rv = stripe_io_wait(sio, &b) ? -1 : 0;
+	stripe_io_destroy(sio);
+	backup_status(&b, dests, destfd, status);
+	free(reqs);
 
 	if (rv)
 		return rv;
 	bsb.mtime = __cpu_to_le64(time(0));
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
-
-		bsb.sb_csum = bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
+	return write_backup_super(dests, destfd, destoffsets, part, status);
+}
 
-		rv = -1;
-		if ((unsigned long long)lseek64(destfd[i], destoffsets[i] - 4096, 0)
-		    != destoffsets[i] - 4096)
-			break;
-		if (write(destfd[i], &bsb, 512) != 512)
-			break;
-		if (destoffsets[i] > 4096) {
-			if ((unsigned long long)lseek64(destfd[i], destoffsets[i]+stripes*chunk*odata, 0) !=
-			    destoffsets[i]+stripes*chunk*odata)
-				break;
-			if (write(destfd[i], &bsb, 512) != 512)
-				break;
-		}
-		fsync(destfd[i]);
-		rv = 0;
-	}
+static int grow_backup(struct mdinfo *sra,
+		unsigned long long offset, /* per device */
+		unsigned long stripes, /* per device, in old chunks */
+		int *sources, unsigned long long *offsets,
+		int disks, int chunk, int level, int layout,
+		int dests, int *destfd, unsigned long long *destoffsets,
+		int part, int *degraded,
+		char *buf, int *status)
+{
+	/* Backup 'blocks' sectors at 'offset' on each device of the array,
+	 * to storage 'destfd' (offset 'destoffsets'), after first
+	 * suspending IO.  Then allow resync to continue
+	 * over the suspended section.
+	 * Use part 'part' of the backup-super-block.
+	 * 'buf' must hold the whole of the data being backed up.
+	 */
+	int odata = disks - (level >= 4) - (level == 6);
+	int rv;
 
-	return rv;
+	rv = grow_backup_read(sra, offset, stripes, sources, offsets,
+			      disks, chunk, level, layout, degraded, buf);
+	if (rv)
+		return rv;
+	return grow_backup_write(offset, stripes, odata, chunk,
+				 dests, destfd, destoffsets, part, buf, status);
 }
 
 /* in 2.6.30, the value reported by sync_completed can be
@@ -4088,37 +4806,34 @@ static int grow_backup(struct mdinfo *sra,
 /* FIXME return value is often ignored */
 static int forget_backup(int dests, int *destfd,
 			 unsigned long long *destoffsets,
-			 int part)
+			 int part, int *status, struct reshape_stats *stats)
 {
 	/*
-	 * Erase backup 'part' (which is 0 or 1)
+	 * Erase backup 'part' (which is 0 or 1) on every destination
+	 * at once.  'status' is as for write_backup_super().
 	 */
-	int i;
+	int newest = -1;
+	struct timeval start;
 	int rv;
 
 	if (part) {
 		bsb.arraystart2 = __cpu_to_le64(0);
 		bsb.length2 = __cpu_to_le64(0);
+		bsb.data_csum_sectors2 = __cpu_to_le32(0);
 	} else {
 		bsb.arraystart = __cpu_to_le64(0);
 		bsb.length = __cpu_to_le64(0);
+		bsb.data_csum_sectors = __cpu_to_le32(0);
 	}
 	bsb.mtime = __cpu_to_le64(time(0));
-	rv = 0;
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
-		bsb.sb_csum = bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
-		if ((unsigned long long)lseek64(destfd[i], destoffsets[i]-4096, 0) !=
-		    destoffsets[i]-4096)
-			rv = -1;
-		if (rv == 0 &&
-		    write(destfd[i], &bsb, 512) != 512)
-			rv = -1;
-		fsync(destfd[i]);
-	}
+	/* the other section may still be in use */
+	if (__le32_to_cpu(bsi.newest) == (unsigned)part)
+		newest = (part ? bsb.length : bsb.length2) ? !part : -1;
+	else if (__le32_to_cpu(bsi.newest) == (unsigned)!part)
+		newest = !part;
+	gettimeofday(&start, NULL);
+	rv = write_backup_super(dests, destfd, destoffsets, newest, status);
+	reshape_stats_phase(stats, RESHAPE_PHASE_FORGET, usec_since(&start));
 	return rv;
 }
 
@@ -4143,15 +4858,13 @@ static void validate(int afd, int bfd, unsigned long long offset)
 	lseek64(bfd, offset - 4096, 0);
 	if (read(bfd, &bsb2, 512) != 512)
 		fail("cannot read bsb");
-	if (bsb2.sb_csum != bsb_csum((char*)&bsb2,
-				     ((char*)&bsb2.sb_csum)-((char*)&bsb2)))
-		fail("first csum bad");
-	if (memcmp(bsb2.magic, "md_backup_data", 14) != 0)
+	if (bsb_version(&bsb2) == 0)
 		fail("magic is bad");
-	if (memcmp(bsb2.magic, "md_backup_data-2", 16) == 0 &&
-	    bsb2.sb_csum2 != bsb_csum((char*)&bsb2,
-				      ((char*)&bsb2.sb_csum2)-((char*)&bsb2)))
-		fail("second csum bad");
+	switch (bsb_check_csums(&bsb2)) {
+	case 1: fail("first csum bad");
+	case 2: fail("second csum bad");
+	case 3: fail("third csum bad");
+	}
 
 	if (__le64_to_cpu(bsb2.devstart)*512 != offset)
 		fail("devstart is wrong");
@@ -4215,6 +4928,246 @@ static void validate(int afd, int bfd, unsigned long long offset)
 	}
 }
 
+/* When the data disks don't change, the whole array is backed up one
+ * window at a time.  Large windows stop the kernel catching up with
+ * the backup and waiting for it; small ones keep the suspended region,
+ * and so the stall seen by users of the array, short.
+ * After each backup the window is doubled if the kernel had caught up,
+ * or if writing the backup took longer than the kernel needs to
+ * reshape a window at the current sync_speed.  It is halved if the
+ * backup was much quicker than that.
+ * 'window', 'unit' and 'max' are in stripes, 'speed' is in K/sec.
+ */
+static unsigned long adapt_backup_window(unsigned long window,
+					 unsigned long unit,
+					 unsigned long max, int chunk,
+					 int stalled,
+					 unsigned long long write_usec,
+					 unsigned long long speed)
+{
+	unsigned long long reshape_usec = 0;
+
+	if (speed)
+		reshape_usec = (unsigned long long)window * (chunk/1024)
+			* 1000000 / speed;
+	if (stalled || (speed && write_usec > reshape_usec))
+		window *= 2;
+	else if (speed && write_usec * 4 < reshape_usec)
+		window /= 2;
+	if (window > max)
+		window = max;
+	window -= window % unit;
+	if (window < unit)
+		window = unit;
+	return window;
+}
+
+/* Closed-loop tuning of a native reshape, done by child_monitor() when
+ * MDADM_GROW_CACHE_MAX gives the most memory, in K, that the stripe
+ * cache may use.  A reshape that moves data_offset instead of using a
+ * backup is tuned by a child of reshape_array() while it waits.
+ * Every TUNE_MSEC it compares the average latency of foreground I/O
+ * to the array, from its 'stat' file, against a target.  This is
+ * MDADM_GROW_LATENCY_TARGET msec if set, else four times the lowest
+ * latency seen.
+ * - While foreground I/O is slower than that, sync_speed_max is cut
+ *   to 3/4 of the current reshape rate and sync_speed_min dropped to
+ *   TUNE_MIN_SPEED, so that the reshape yields.
+ * - Otherwise sync_speed_max is raised by half again until it is back
+ *   where it started, and sync_speed_min is put back too.
+ * - stripe_cache_size is doubled, within the cap, for as long as that
+ *   speeds up the reshape by more than 1/16, and put back to the size
+ *   before the last step once it does not.
+ * reshape_tuner_finish() restores the speed limits.
+ */
+#define TUNE_MSEC	2000
+#define TUNE_MIN_SPEED	1000	/* K/sec */
+#define TUNE_CACHE_MAX	32768	/* pages, the most md allows */
+
+struct reshape_tuner {
+	struct mdinfo *sra;
+	int disks;
+	unsigned long long cache;	/* stripe_cache_size, pages */
+	unsigned long long cache_max;
+	unsigned long long prev_cache;	/* before the last doubling, or 0 */
+	unsigned long long prev_rate;	/* K/sec before the last doubling */
+	int cache_done;			/* doubling stopped helping */
+	unsigned long long target_usec;	/* 0 to calibrate from min_usec */
+	unsigned long long min_usec;
+	unsigned long long ios, ticks;	/* from 'stat' at 'last' */
+	struct timeval last;
+	unsigned long long orig_max;	/* K/sec */
+	unsigned long long speed_max;	/* as set, or 0 if still orig_max */
+	int throttled;
+	char orig_min_str[40], orig_max_str[40];
+};
+
+static int reshape_tuner_stat(struct reshape_tuner *t,
+			      unsigned long long *ios,
+			      unsigned long long *ticks)
+{
+	/* Completed foreground requests, and the msec spent on them */
+	char path[80], buf[1024];
+	unsigned long long f[8];
+
+	sprintf(path, "/sys/block/%s/stat", t->sra->sys_name);
+	if (load_sys(path, buf) < 0 ||
+	    sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu %llu",
+		   &f[0], &f[1], &f[2], &f[3],
+		   &f[4], &f[5], &f[6], &f[7]) != 8)
+		return -1;
+	*ios = f[0] + f[4];
+	*ticks = f[3] + f[7];
+	return 0;
+}
+
+/* Restore a sync_speed_* value as read from sysfs, e.g. "200000 (system)" */
+static void reshape_tuner_restore(struct mdinfo *sra, char *name, char *val)
+{
+	if (!val[0])
+		return;
+	if (strstr(val, "system"))
+		sysfs_set_str(sra, NULL, name, "system");
+	else
+		sysfs_set_num(sra, NULL, name, strtoull(val, NULL, 10));
+}
+
+static struct reshape_tuner *reshape_tuner_init(struct mdinfo *sra, int disks)
+{
+	struct reshape_tuner *t;
+	char *env = getenv("MDADM_GROW_CACHE_MAX");
+	unsigned long long cap;
+	char *nl;
+
+	if (!env || !*env)
+		return NULL;
+	cap = strtoull(env, NULL, 10);
+	t = xcalloc(1, sizeof(*t));
+	t->sra = sra;
+	t->disks = disks;
+	if (sysfs_get_ll(sra, NULL, "stripe_cache_size", &t->cache) < 0)
+		t->cache = 0;
+	t->cache_max = cap / (4096/1024) / disks;
+	if (t->cache_max > TUNE_CACHE_MAX)
+		t->cache_max = TUNE_CACHE_MAX;
+	if (t->cache == 0 || t->cache >= t->cache_max)
+		t->cache_done = 1;
+	env = getenv("MDADM_GROW_LATENCY_TARGET");
+	if (env && *env)
+		t->target_usec = strtoull(env, NULL, 10) * 1000;
+	if (sysfs_get_str(sra, NULL, "sync_speed_min", t->orig_min_str,
+			  sizeof(t->orig_min_str)) < 0)
+		t->orig_min_str[0] = 0;
+	if (sysfs_get_str(sra, NULL, "sync_speed_max", t->orig_max_str,
+			  sizeof(t->orig_max_str)) < 0)
+		t->orig_max_str[0] = 0;
+	if ((nl = strchr(t->orig_min_str, '\n')) != NULL)
+		*nl = 0;
+	if ((nl = strchr(t->orig_max_str, '\n')) != NULL)
+		*nl = 0;
+	t->orig_max = strtoull(t->orig_max_str, NULL, 10);
+	if (reshape_tuner_stat(t, &t->ios, &t->ticks) < 0)
+		t->ios = t->ticks = 0;
+	gettimeofday(&t->last, NULL);
+	dprintf("reshape tuner: stripe cache %llu of at most %llu pages\n",
+		t->cache, t->cache_max);
+	return t;
+}
+
+static void reshape_tuner_step(struct reshape_tuner *t)
+{
+	unsigned long long ios, ticks, rate, usec = 0, target;
+
+	if (!t || usec_since(&t->last) < TUNE_MSEC * 1000ULL)
+		return;
+	gettimeofday(&t->last, NULL);
+	if (sysfs_get_ll(t->sra, NULL, "sync_speed", &rate) < 0)
+		rate = 0;
+	if (reshape_tuner_stat(t, &ios, &ticks) == 0) {
+		if (ios > t->ios)
+			usec = (ticks - t->ticks) * 1000 / (ios - t->ios);
+		t->ios = ios;
+		t->ticks = ticks;
+	}
+	if (usec && (t->min_usec == 0 || usec < t->min_usec))
+		t->min_usec = usec;
+	target = t->target_usec ? t->target_usec : t->min_usec * 4;
+
+	if (usec && target && usec > target && rate) {
+		/* foreground I/O is suffering, back off */
+		t->speed_max = max(rate * 3 / 4,
+				   (unsigned long long)TUNE_MIN_SPEED);
+		sysfs_set_num(t->sra, NULL, "sync_speed_max", t->speed_max);
+		if (!t->throttled)
+			sysfs_set_num(t->sra, NULL, "sync_speed_min",
+				      TUNE_MIN_SPEED);
+		t->throttled = 1;
+		/* the rate says nothing about the cache now */
+		t->prev_cache = 0;
+		dprintf("reshape tuner: %lluus > %lluus, speed max %lluK/sec\n",
+			usec, target, t->speed_max);
+		return;
+	}
+	if (t->throttled) {
+		reshape_tuner_restore(t->sra, "sync_speed_min",
+				      t->orig_min_str);
+		t->throttled = 0;
+	}
+	if (t->speed_max) {
+		t->speed_max += t->speed_max / 2;
+		if (t->orig_max == 0 || t->speed_max >= t->orig_max) {
+			reshape_tuner_restore(t->sra, "sync_speed_max",
+					      t->orig_max_str);
+			t->speed_max = 0;
+		} else
+			sysfs_set_num(t->sra, NULL, "sync_speed_max",
+				      t->speed_max);
+		/* still ramping up, so don't judge the cache yet */
+		return;
+	}
+
+	if (t->cache_done || rate == 0)
+		return;
+	if (t->prev_cache) {
+		if (rate <= t->prev_rate + t->prev_rate / 16) {
+			/* that didn't help, go back */
+			t->cache = t->prev_cache;
+			sysfs_set_num(t->sra, NULL, "stripe_cache_size",
+				      t->cache);
+			t->prev_cache = 0;
+			t->cache_done = 1;
+			dprintf("reshape tuner: stripe cache stays at %llu\n",
+				t->cache);
+			return;
+		}
+	}
+	if (t->cache * 2 > t->cache_max) {
+		t->cache_done = 1;
+		return;
+	}
+	t->prev_cache = t->cache;
+	t->prev_rate = rate;
+	t->cache *= 2;
+	if (sysfs_set_num(t->sra, NULL, "stripe_cache_size", t->cache) < 0) {
+		t->cache = t->prev_cache;
+		t->prev_cache = 0;
+		t->cache_done = 1;
+	}
+}
+
+static void reshape_tuner_finish(struct reshape_tuner *t)
+{
+	if (!t)
+		return;
+	if (t->throttled)
+		reshape_tuner_restore(t->sra, "sync_speed_min",
+				      t->orig_min_str);
+	if (t->speed_max)
+		reshape_tuner_restore(t->sra, "sync_speed_max",
+				      t->orig_max_str);
+	free(t);
+}
+
 int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		  struct supertype *st, unsigned long blocks,
 		  int *fds, unsigned long long *offsets,
@@ -4223,8 +5176,37 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	/* Monitor a reshape where backup is being performed using
 	 * 'native' mechanism - either to a backup file, or
 	 * to some space in a spare.
+	 *
+	 * Unless MDADM_GROW_NO_PIPELINE is set, the backup is pipelined:
+	 * while the kernel reshapes the windows already backed up, the
+	 * next window (which is already suspended) is read into the
+	 * spare buffer, so that when a part of the backup area is
+	 * released only the write to the backup remains to be done.
+	 *
+	 * The amount backed up at a time adapts to how fast the reshape
+	 * and the backup are going, see adapt_backup_window(), within the
+	 * space available for each part of the backup.  It can be fixed
+	 * by setting MDADM_GROW_BACKUP_WINDOW to a size in K of array
+	 * data.  The size in use is kept in reshape->backup_window.
+	 *
+	 * If MDADM_GROW_CACHE_MAX is set, the stripe cache and the speed
+	 * limits are tuned as the reshape goes, see reshape_tuner_step().
 	 */
-	char *buf;
+	char *bufs[2] = { NULL, NULL };
+	int *dest_status;	/* see backup_status() */
+	struct reshape_tuner *tuner;
+	struct reshape_watch *watch;
+	struct timeval waited, spell;
+	int suspended = 0;
+	int cur = 0;		/* buffer for the next backup */
+	int pipeline = !check_env("MDADM_GROW_NO_PIPELINE");
+	int prefetched = 0;	/* bufs[!cur] holds the window at pf_offset */
+	unsigned long long pf_offset = 0;
+	unsigned long pf_stripes = 0;
+	unsigned long long buflen;
+	unsigned long unit, window;	/* in stripes */
+	int adaptive = 1;
+	char *env;
 	int degraded = -1;
 	unsigned long long speed;
 	unsigned long long suspend_point, array_size;
@@ -4269,22 +5251,61 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	}
 
 	memset(&bsb, 0, 512);
-	memcpy(bsb.magic, "md_backup_data-1", 16);
+	memcpy(bsb.magic, "md_backup_data-3", 16);
+	memset(bsb_data_csum, 0, sizeof(bsb_data_csum));
+	memset(&bsi, 0, sizeof(bsi));
 	st->ss->uuid_from_super(st, uuid);
 	memcpy(bsb.set_uuid, uuid, 16);
 	bsb.mtime = __cpu_to_le64(time(0));
 	bsb.devstart2 = blocks;
+	bsi.seq = __cpu_to_le64(bsi_disk_seq(dests, destfd, destoffsets,
+					     blocks, bsb.set_uuid));
 
 	stripes = blocks / (sra->array.chunk_size/512) /
 		reshape->before.data_disks;
 
-	if (posix_memalign((void**)&buf, 4096, disks * chunk))
+	/* The window is always a whole number of backup units, which
+	 * are whole numbers of both old and new stripes.
+	 */
+	unit = reshape->backup_blocks / (chunk/512) / data;
+	if (unit == 0 || unit > stripes)
+		unit = stripes;
+	window = stripes;
+	env = getenv("MDADM_GROW_BACKUP_WINDOW");
+	if (env && *env) {
+		unsigned long long kb = strtoull(env, NULL, 10);
+
+		window = kb * 2 / (chunk/512) / data;
+		window -= window % unit;
+		if (window < unit)
+			window = unit;
+		if (window > stripes)
+			window = stripes;
+		adaptive = 0;
+	}
+	reshape->backup_window = (unsigned long long)window * (chunk/512) * data;
+
+	/* Each buffer holds a whole backup window */
+	buflen = (unsigned long long)stripes * chunk * data;
+	if (buflen < (unsigned long long)disks * chunk)
+		buflen = (unsigned long long)disks * chunk;
+	if (posix_memalign((void**)&bufs[0], 4096, buflen))
 		/* Don't start the 'reshape' */
 		return 0;
+	if (pipeline && posix_memalign((void**)&bufs[1], 4096, buflen)) {
+		bufs[1] = NULL;
+		pipeline = 0;
+	}
+	dest_status = xcalloc(dests ? dests : 1, sizeof(*dest_status));
 	if (reshape->before.data_disks == reshape->after.data_disks) {
 		sysfs_get_ll(sra, NULL, "sync_speed_min", &speed);
 		sysfs_set_num(sra, NULL, "sync_speed_min", 200000);
 	}
+	/* each page of stripe cache is needed on every device */
+	tuner = reshape_tuner_init(sra, max(reshape->before.data_disks,
+					    reshape->after.data_disks)
+				   + reshape->parity);
+	watch = reshape_watch_open(sra);
 
 	if (increasing) {
 		array_size = sra->component_size * reshape->after.data_disks;
@@ -4321,12 +5342,29 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		}
 
 		reshape_completed = sra->reshape_progress;
+		gettimeofday(&waited, NULL);
 		rv = progress_reshape(sra, reshape,
 				      backup_point, wait_point,
 				      &suspend_point, &reshape_completed,
-				      &frozen);
+				      &frozen, watch);
+		reshape_stats_phase(reshape->stats, RESHAPE_PHASE_WAIT,
+				    usec_since(&waited));
 		/* external metadata would need to ping_monitor here */
 		sra->reshape_progress = reshape_completed;
+		reshape_stats_progress(reshape->stats, reshape_completed);
+		reshape_tuner_step(tuner);
+
+		/* Count the time since we last looked as suspended if
+		 * a region was suspended then.
+		 */
+		if (suspended)
+			reshape_stats_phase(reshape->stats,
+					    RESHAPE_PHASE_SUSPEND,
+					    usec_since(&spell));
+		gettimeofday(&spell, NULL);
+		suspended = increasing ?
+			suspend_point > sra->reshape_progress :
+			suspend_point < sra->reshape_progress;
 
 		/* Clear any backup region that is before 'here' */
 		if (increasing) {
@@ -4334,21 +5372,25 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			    reshape_completed >= (__le64_to_cpu(bsb.arraystart) +
 						  __le64_to_cpu(bsb.length)))
 				forget_backup(dests, destfd,
-					      destoffsets, 0);
+					      destoffsets, 0, dest_status,
+					      reshape->stats);
 			if (__le64_to_cpu(bsb.length2) > 0 &&
 			    reshape_completed >= (__le64_to_cpu(bsb.arraystart2) +
 						  __le64_to_cpu(bsb.length2)))
 				forget_backup(dests, destfd,
-					      destoffsets, 1);
+					      destoffsets, 1, dest_status,
+					      reshape->stats);
 		} else {
 			if (__le64_to_cpu(bsb.length) > 0 &&
 			    reshape_completed <= (__le64_to_cpu(bsb.arraystart)))
 				forget_backup(dests, destfd,
-					      destoffsets, 0);
+					      destoffsets, 0, dest_status,
+					      reshape->stats);
 			if (__le64_to_cpu(bsb.length2) > 0 &&
 			    reshape_completed <= (__le64_to_cpu(bsb.arraystart2)))
 				forget_backup(dests, destfd,
-					      destoffsets, 1);
+					      destoffsets, 1, dest_status,
+					      reshape->stats);
 		}
 		if (sigterm)
 			rv = -2;
@@ -4367,19 +5409,23 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		while (rv) {
 			unsigned long long offset;
 			unsigned long actual_stripes;
+			struct timeval start;
+			int part_busy;
+			int stalled;
+			int brv;
+			unsigned long long backup_usec;
 			/* Need to backup some data.
 			 * If 'part' is not used and the desired
 			 * backup size is suspended, do a backup,
 			 * then consider the next part.
 			 */
-			/* Check that 'part' is unused */
-			if (part == 0 && __le64_to_cpu(bsb.length) != 0)
+			/* Check whether 'part' is unused */
+			part_busy = ((part == 0 && __le64_to_cpu(bsb.length) != 0) ||
+				     (part == 1 && __le64_to_cpu(bsb.length2) != 0));
+			if (part_busy && (!pipeline || prefetched))
 				break;
-			if (part == 1 && __le64_to_cpu(bsb.length2) != 0)
-				break;
-
 			offset = backup_point / data;
-			actual_stripes = stripes;
+			actual_stripes = window;
 			if (increasing) {
 				if (offset + actual_stripes * (chunk/512) >
 				    sra->component_size)
@@ -4397,11 +5443,72 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			}
 			if (actual_stripes == 0)
 				break;
-			grow_backup(sra, offset, actual_stripes,
-				    fds, offsets,
-				    disks, chunk, level, layout,
-				    dests, destfd, destoffsets,
-				    part, &degraded, buf);
+			if (part_busy) {
+				/* The kernel hasn't finished with 'part'
+				 * yet, but the next window is suspended and
+				 * beyond where the kernel may go, so read
+				 * it now.
+				 */
+				if (grow_backup_read(sra, offset, actual_stripes,
+						     fds, offsets,
+						     disks, chunk, level, layout,
+						     &degraded, bufs[!cur]) == 0) {
+					prefetched = 1;
+					pf_offset = offset;
+					pf_stripes = actual_stripes;
+				}
+				break;
+			}
+			/* If the kernel has reached backup_point, it is
+			 * waiting for this backup
+			 */
+			stalled = increasing ?
+				sra->reshape_progress >= backup_point :
+				sra->reshape_progress <= backup_point;
+			gettimeofday(&start, NULL);
+			if (prefetched && pf_offset == offset &&
+			    pf_stripes == actual_stripes) {
+				/* Already read, just write it out */
+				cur = !cur;
+				brv = grow_backup_write(offset, actual_stripes,
+							data, chunk,
+							dests, destfd,
+							destoffsets, part,
+							bufs[cur], dest_status);
+			} else
+				brv = grow_backup(sra, offset, actual_stripes,
+						  fds, offsets,
+						  disks, chunk, level, layout,
+						  dests, destfd, destoffsets,
+						  part, &degraded, bufs[cur],
+						  dest_status);
+			backup_usec = usec_since(&start);
+			reshape_stats_phase(reshape->stats,
+					    RESHAPE_PHASE_BACKUP, backup_usec);
+			if (adaptive) {
+				unsigned long long speed = 0;
+				unsigned long new_window;
+
+				if (sysfs_get_ll(sra, NULL, "sync_speed",
+						 &speed) < 0)
+					speed = 0;
+				new_window = adapt_backup_window(
+					window, unit, stripes, chunk, stalled,
+					backup_usec, speed);
+				if (new_window != window) {
+					window = new_window;
+					reshape->backup_window =
+						(unsigned long long)window *
+						(chunk/512) * data;
+					dprintf("backup window now %lluK\n",
+						reshape->backup_window / 2);
+				}
+			}
+			if (brv == 0)
+				reshape_stats_backup(reshape->stats,
+					(unsigned long long)actual_stripes *
+					chunk * data, reshape->backup_window);
+			prefetched = 0;
 			validate(afd, destfd[0], destoffsets[0]);
 			/* record where 'part' is up to */
 			part = !part;
@@ -4419,12 +5526,83 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	sysfs_set_num(sra, NULL, "suspend_lo", 0);
 	sysfs_set_num(sra, NULL, "sync_min", 0);
 
+	if (suspended)
+		reshape_stats_phase(reshape->stats, RESHAPE_PHASE_SUSPEND,
+				    usec_since(&spell));
+	reshape_tuner_finish(tuner);
+	reshape_watch_close(watch);
 	if (reshape->before.data_disks == reshape->after.data_disks)
 		sysfs_set_num(sra, NULL, "sync_speed_min", speed);
-	free(buf);
+	free(bufs[0]);
+	free(bufs[1]);
+	free(dest_status);
 	return done;
 }
 
+/* Read the trailing backup-super-block and index record from each of
+ * the spares 'first' to 'cnt'-1 at once.  Returns the spare whose index
+ * shows the newest backup, or -1 if none has a usable index, and sets
+ * 'stale' for the spares whose index shows an older one: a write to
+ * them must have failed, so their backup cannot be trusted.
+ */
+static int restart_scan_index(struct supertype *st, struct mdinfo *info,
+			      int *fdlist, int first, int cnt, char *stale)
+{
+	char *bufs;
+	unsigned long long *seqs;
+	struct stripe_io_req *reqs;
+	struct stripe_io_batch b;
+	struct stripe_io *sio;
+	int n = cnt - first;
+	int i, j, best = -1;
+
+	if (n <= 0 || posix_memalign((void**)&bufs, 4096, n * 1024))
+		return -1;
+	reqs = xcalloc(n, sizeof(*reqs));
+	seqs = xcalloc(n, sizeof(*seqs));
+	b.reqs = reqs;
+	b.nreqs = 0;
+	for (i = first; i < cnt; i++) {
+		struct mdinfo dinfo;
+		struct stripe_io_req *req;
+
+		if (fdlist[i] < 0 || st->ss->load_super(st, fdlist[i], NULL))
+			continue;
+		st->ss->getinfo_super(st, &dinfo, NULL);
+		st->ss->free_super(st);
+		req = &reqs[b.nreqs++];
+		req->fd = fdlist[i];
+		req->op = STRIPE_IO_READ;
+		req->buf = bufs + (i - first) * 1024;
+		req->len = 1024;
+		req->offset = (dinfo.data_offset + dinfo.component_size - 8) << 9;
+	}
+	if (b.nreqs) {
+		sio = stripe_io_create(b.nreqs);
+		stripe_io_submit(sio, &b);
+		stripe_io_wait(sio, &b);
+		stripe_io_destroy(sio);
+	}
+	for (j = 0; j < b.nreqs; j++) {
+		struct mdp_backup_super *sb = (void*)reqs[j].buf;
+		struct mdp_backup_index *ix = (void*)(reqs[j].buf + 512);
+
+		i = (reqs[j].buf - bufs) / 1024;
+		if (reqs[j].err || !bsi_valid(ix, sb) ||
+		    memcmp(sb->set_uuid, info->uuid, 16) != 0)
+			continue;
+		seqs[i] = __le64_to_cpu(ix->seq);
+		if (best < 0 || seqs[i] > seqs[best])
+			best = i;
+	}
+	for (i = 0; i < n; i++)
+		stale[first + i] = best >= 0 && seqs[i] && seqs[i] < seqs[best];
+	free(seqs);
+	free(reqs);
+	free(bufs);
+	return best < 0 ? -1 : first + best;
+}
+
 /*
  * If any spare contains md_back_data-1 which is recent wrt mtime,
  * write that data into the array and update the super blocks with
@@ -4433,7 +5611,9 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt,
 		 char *backup_file, int verbose)
 {
-	int i, j;
+	int i, j, k;
+	int best;
+	char *stale;
 	int old_disks;
 	unsigned long long *offsets;
 	unsigned long long  nstripe, ostripe;
@@ -4451,12 +5631,20 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 		 * been used
 		 */
 		old_disks = cnt;
-	for (i=old_disks-(backup_file?1:0); i<cnt; i++) {
+
+	/* Try the backup file first, then the spare with the newest
+	 * index record, then any others that are not known to be stale.
+	 */
+	stale = xcalloc(cnt + 1, 1);
+	best = restart_scan_index(st, info, fdlist, old_disks, cnt, stale);
+	for (k=old_disks-(backup_file?1:0); k<cnt; k++) {
 		struct mdinfo dinfo;
 		int fd;
 		int bsbsize;
 		char *devname, namebuf[20];
 		unsigned long long lo, hi;
+		char *data[2];
+		int part;
 
 		/* This was a spare and may have some saved data on it.
 		 * Load the superblock, find and load the
@@ -4465,6 +5653,18 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 		 * If the backup contains no new info, just return
 		 * else restore data and update all superblocks
 		 */
+		i = k;
+		if (best >= 0 && k >= old_disks) {
+			if (k == old_disks)
+				i = best;
+			else if (k <= best)
+				i = k - 1;
+		}
+		if (i >= old_disks && stale[i]) {
+			if (verbose)
+				pr_err("backup on device-%d is out of date\n", i);
+			continue;
+		}
 		if (i == old_disks-1) {
 			fd = open(backup_file, O_RDONLY);
 			if (fd<0) {
@@ -4497,22 +5697,24 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 				pr_err("Cannot read from %s\n", devname);
 			continue; /* Cannot read */
 		}
-		if (memcmp(bsb.magic, "md_backup_data-1", 16) != 0 &&
-		    memcmp(bsb.magic, "md_backup_data-2", 16) != 0) {
+		if (bsb_version(&bsb) == 0) {
 			if (verbose)
 				pr_err("No backup metadata on %s\n", devname);
 			continue;
 		}
-		if (bsb.sb_csum != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb))) {
+		switch (bsb_check_csums(&bsb)) {
+		case 1:
 			if (verbose)
 				pr_err("Bad backup-metadata checksum on %s\n", devname);
 			continue; /* bad checksum */
-		}
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0 &&
-		    bsb.sb_csum2 != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum2)-((char*)&bsb))) {
+		case 2:
 			if (verbose)
 				pr_err("Bad backup-metadata checksum2 on %s\n", devname);
 			continue; /* Bad second checksum */
+		case 3:
+			if (verbose)
+				pr_err("Bad backup-metadata checksum3 on %s\n", devname);
+			continue; /* Bad third checksum */
 		}
 		if (memcmp(bsb.set_uuid,info->uuid, 16) != 0) {
 			if (verbose)
@@ -4538,7 +5740,7 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 			}
 		}
 
-		if (bsb.magic[15] == '1') {
+		if (!bsb_two_sections(&bsb)) {
 			if (bsb.length == 0)
 				continue;
 			if (info->delta_disks >= 0) {
@@ -4590,13 +5792,71 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 		if (lseek64(fd, -4096, 1) < 0 ||
 		    read(fd, &bsb2, sizeof(bsb2)) != sizeof(bsb2))
 			goto second_fail; /* Cannot find leading superblock */
-		if (bsb.magic[15] == '1')
+		if (bsb_version(&bsb) == 1)
 			bsbsize = offsetof(struct mdp_backup_super, pad1);
 		else
 			bsbsize = offsetof(struct mdp_backup_super, pad);
 		if (memcmp(&bsb2, &bsb, bsbsize) != 0)
 			goto second_fail; /* Cannot find leading superblock */
 
+		/* The data checksums follow the leading superblock.
+		 * Check each section against them as it is read, so
+		 * that a damaged backup is passed over in favour of
+		 * another copy rather than being restored.
+		 */
+		data[0] = data[1] = NULL;
+		if (bsb_version(&bsb) >= 3) {
+			if (read(fd, bsb_data_csum, sizeof(bsb_data_csum)) !=
+			    sizeof(bsb_data_csum) ||
+			    __cpu_to_le32(crc32c(0, bsb_data_csum,
+						 sizeof(bsb_data_csum))) !=
+			    bsb.data_csum_table) {
+				if (verbose)
+					pr_err("Bad backup data checksums on %s\n",
+					       devname);
+				continue;
+			}
+			for (part = 0; part < 2; part++) {
+				unsigned long long start, len;
+				__u32 per;
+				int err;
+
+				start = __le64_to_cpu(bsb.devstart)*512;
+				if (part) {
+					start += __le64_to_cpu(bsb.devstart2)*512;
+					len = __le64_to_cpu(bsb.length2);
+					per = __le32_to_cpu(bsb.data_csum_sectors2);
+				} else {
+					len = __le64_to_cpu(bsb.length);
+					per = __le32_to_cpu(bsb.data_csum_sectors);
+				}
+				if (len == 0 || per == 0)
+					continue;
+				if (posix_memalign((void**)&data[part], 4096,
+						   len*512)) {
+					/* restore unchecked from the backup */
+					data[part] = NULL;
+					continue;
+				}
+				err = bsb_data_csum_read(fd, start, len, per,
+							 bsb_data_csum[part],
+							 data[part]);
+				if (err) {
+					if (verbose)
+						pr_err("%s backup data on %s\n",
+						       err < 0 ? "Cannot read"
+						       : "Bad checksum on",
+						       devname);
+					break;
+				}
+			}
+			if (part < 2) {
+				free(data[0]);
+				free(data[1]);
+				continue;
+			}
+		}
+
 		/* Now need the data offsets for all devices. */
 		offsets = xmalloc(sizeof(*offsets)*info->array.raid_disks);
 		for(j=0; j<info->array.raid_disks; j++) {
@@ -4616,36 +5876,46 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 				    info->new_chunk,
 				    info->new_level,
 				    info->new_layout,
-				    fd, __le64_to_cpu(bsb.devstart)*512,
+				    fd, data[0] ? 0 :
+				    __le64_to_cpu(bsb.devstart)*512,
 				    __le64_to_cpu(bsb.arraystart)*512,
-				    __le64_to_cpu(bsb.length)*512, NULL)) {
+				    __le64_to_cpu(bsb.length)*512, data[0])) {
 			/* didn't succeed, so giveup */
 			if (verbose)
 				pr_err("Error restoring backup from %s\n",
 					devname);
 			free(offsets);
+			free(data[0]);
+			free(data[1]);
+			free(stale);
 			return 1;
 		}
 
-		if (bsb.magic[15] == '2' &&
+		if (bsb_two_sections(&bsb) &&
 		    restore_stripes(fdlist, offsets,
 				    info->array.raid_disks,
 				    info->new_chunk,
 				    info->new_level,
 				    info->new_layout,
-				    fd, __le64_to_cpu(bsb.devstart)*512 +
+				    fd, data[1] ? 0 :
+				    __le64_to_cpu(bsb.devstart)*512 +
 				    __le64_to_cpu(bsb.devstart2)*512,
 				    __le64_to_cpu(bsb.arraystart2)*512,
-				    __le64_to_cpu(bsb.length2)*512, NULL)) {
+				    __le64_to_cpu(bsb.length2)*512, data[1])) {
 			/* didn't succeed, so giveup */
 			if (verbose)
 				pr_err("Error restoring second backup from %s\n",
 					devname);
 			free(offsets);
+			free(data[0]);
+			free(data[1]);
+			free(stale);
 			return 1;
 		}
 
 		free(offsets);
+		free(data[0]);
+		free(data[1]);
 
 		/* Ok, so the data is restored. Let's update those superblocks. */
 
@@ -4654,7 +5924,7 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 			lo = __le64_to_cpu(bsb.arraystart);
 			hi = lo + __le64_to_cpu(bsb.length);
 		}
-		if (bsb.magic[15] == '2' && bsb.length2) {
+		if (bsb_two_sections(&bsb) && bsb.length2) {
 			unsigned long long lo1, hi1;
 			lo1 = __le64_to_cpu(bsb.arraystart2);
 			hi1 = lo1 + __le64_to_cpu(bsb.length2);
@@ -4673,7 +5943,7 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 		else if (info->delta_disks >= 0) {
 			info->reshape_progress = __le64_to_cpu(bsb.arraystart) +
 				__le64_to_cpu(bsb.length);
-			if (bsb.magic[15] == '2') {
+			if (bsb_two_sections(&bsb)) {
 				unsigned long long p2 = __le64_to_cpu(bsb.arraystart2) +
 					__le64_to_cpu(bsb.length2);
 				if (p2 > info->reshape_progress)
@@ -4681,7 +5951,7 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 			}
 		} else {
 			info->reshape_progress = __le64_to_cpu(bsb.arraystart);
-			if (bsb.magic[15] == '2') {
+			if (bsb_two_sections(&bsb)) {
 				unsigned long long p2 = __le64_to_cpu(bsb.arraystart2);
 				if (p2 < info->reshape_progress)
 					info->reshape_progress = p2;
@@ -4700,8 +5970,10 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 			st->ss->store_super(st, fdlist[j]);
 			st->ss->free_super(st);
 		}
+		free(stale);
 		return 0;
 	}
+	free(stale);
 	/* Didn't find any backup data, try to see if any
 	 * was needed.
 	 */
@@ -4996,3 +6268,58 @@ char *locate_backup(char *name)
 	free(fl);
 	return NULL;
 }
+
+/* While a reshape runs without the internal bitmap that was removed
+ * to make room for it, MAP_DIR/bitmap-<devnm> holds the chunk size of
+ * that bitmap, so that it can still be added back if the process
+ * waiting for the reshape goes away.
+ */
+static char *bitmap_pending_file(char *devnm)
+{
+	char *base = "bitmap-";
+	char *fname = xmalloc(strlen(MAP_DIR) + 1 + strlen(base) +
+			      strlen(devnm) + 1);
+
+	sprintf(fname, "%s/%s%s", MAP_DIR, base, devnm);
+	return fname;
+}
+
+void set_bitmap_pending(char *devnm, int bitmap_chunk)
+{
+	char *fname = bitmap_pending_file(devnm);
+	FILE *f;
+
+	mkdir(MAP_DIR, 0755);
+	f = fopen(fname, "w");
+	if (f) {
+		fprintf(f, "%d\n", bitmap_chunk);
+		fclose(f);
+	}
+	free(fname);
+}
+
+/* Returns the chunk size to add the bitmap back with, or 0 if none
+ * was removed.
+ */
+int get_bitmap_pending(char *devnm)
+{
+	char *fname = bitmap_pending_file(devnm);
+	FILE *f = fopen(fname, "r");
+	int bitmap_chunk = 0;
+
+	if (f) {
+		if (fscanf(f, "%d", &bitmap_chunk) != 1 || bitmap_chunk == 0)
+			bitmap_chunk = UnSet;
+		fclose(f);
+	}
+	free(fname);
+	return bitmap_chunk;
+}
+
+void clear_bitmap_pending(char *devnm)
+{
+	char *fname = bitmap_pending_file(devnm);
+
+	unlink(fname);
+	free(fname);
+}
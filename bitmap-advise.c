@@ -0,0 +1,408 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Choosing a bitmap chunk size from a recorded workload.
+ *
+ * bitmap_advise() replays a trace of writes against a model of the
+ * kernel's write-intent bitmap for each candidate chunk size:
+ *  - a write to a chunk whose bit is clear must first set the bit,
+ *    which costs a synchronous update of that bitmap page.  Bits set
+ *    by one request in the same page share an update.
+ *  - the bitmap daemon runs every 'daemon_sleep' seconds, and clears
+ *    a bit on its second pass after the last write to the chunk.
+ *    Each page with bits cleared in a pass costs one (lazy) update.
+ *  - after a crash every set bit must be resynced.
+ * The bitmap counts device sectors, so each write is first split into
+ * the RAID chunks it covers and each of those mapped to the devices.
+ * The bits still set at the end of the trace are cleared as the daemon
+ * would, and those updates are counted against the length of the trace.
+ * Small chunks mean less to resync but more bitmap updates, so the
+ * advice is the smallest chunk whose update rate is acceptable.
+ *
+ * The trace is either 'blkparse' output for the md device, of which
+ * the queued ('Q') writes are used:
+ *	8,0  3  1  0.000000000  697  Q  W 223490 + 8 [kjournald]
+ * or lines of "seconds sector sectors [R|W]".  Lines starting with
+ * '#' are ignored.
+ */
+
+#include "mdadm.h"
+#include <ctype.h>
+
+#define BITMAP_PAGE_BITS	(4096 * 8)
+
+struct trace_write {
+	double time;
+	unsigned long long sector;
+	unsigned long long sectors;
+};
+
+static int parse_trace_line(char *line, struct trace_write *w)
+{
+	char *f[12];
+	int n = 0;
+	char *cp;
+
+	for (cp = strtok(line, " \t\n"); cp && n < 12;
+	     cp = strtok(NULL, " \t\n"))
+		f[n++] = cp;
+	if (n == 0 || f[0][0] == '#')
+		return 0;
+	if (n >= 10 && strcmp(f[8], "+") == 0) {
+		/* blkparse: dev cpu seq time pid action rwbs sector + len */
+		if (strcmp(f[5], "Q") != 0 || !strchr(f[6], 'W'))
+			return 0;
+		w->time = strtod(f[3], NULL);
+		w->sector = strtoull(f[7], NULL, 10);
+		w->sectors = strtoull(f[9], NULL, 10);
+	} else if (n >= 3) {
+		if (n >= 4 && toupper(f[3][0]) != 'W')
+			return 0;
+		w->time = strtod(f[0], NULL);
+		w->sector = strtoull(f[1], NULL, 10);
+		w->sectors = strtoull(f[2], NULL, 10);
+	} else
+		return 0;
+	return w->sectors > 0;
+}
+
+static int cmp_write(const void *av, const void *bv)
+{
+	const struct trace_write *a = av, *b = bv;
+
+	if (a->time < b->time)
+		return -1;
+	return a->time > b->time;
+}
+
+static int read_trace(char *tracefile, struct trace_write **wp)
+{
+	FILE *f = fopen(tracefile, "r");
+	struct trace_write *w = NULL;
+	int n = 0, max = 0;
+	char line[1024];
+
+	if (!f) {
+		pr_err("cannot open trace %s: %s\n",
+		       tracefile, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (n == max) {
+			max = max ? max * 2 : 4096;
+			w = xrealloc(w, max * sizeof(*w));
+		}
+		n += parse_trace_line(line, &w[n]);
+	}
+	fclose(f);
+	/* blkparse merges per-cpu streams, so sort by time */
+	if (n)
+		qsort(w, n, sizeof(*w), cmp_write);
+	*wp = w;
+	return n;
+}
+
+/* The set bits, with the daemon tick of the last write to each.
+ * 'chunk' is kept in a list for scanning at each tick, and found
+ * through an open-addressed hash which is rebuilt after each scan.
+ */
+struct dirty_set {
+	unsigned long long *chunk;
+	unsigned long long *tick;
+	int nr, max;
+	int *hash;		/* index into chunk[], or -1 */
+	unsigned int hash_size;	/* power of 2, > 2 * max */
+};
+
+static unsigned int dirty_slot(struct dirty_set *ds, unsigned long long chunk)
+{
+	unsigned long long h = chunk * 0x9e3779b97f4a7c15ULL;
+	unsigned int i = (h >> 32) & (ds->hash_size - 1);
+
+	while (ds->hash[i] >= 0 && ds->chunk[ds->hash[i]] != chunk)
+		i = (i + 1) & (ds->hash_size - 1);
+	return i;
+}
+
+static void dirty_rehash(struct dirty_set *ds)
+{
+	int i;
+
+	if (ds->nr * 2 >= (int)ds->hash_size) {
+		while (ds->nr * 2 >= (int)ds->hash_size)
+			ds->hash_size *= 2;
+		ds->hash = xrealloc(ds->hash, ds->hash_size * sizeof(int));
+	}
+	memset(ds->hash, 0xff, ds->hash_size * sizeof(int));
+	for (i = 0; i < ds->nr; i++)
+		ds->hash[dirty_slot(ds, ds->chunk[i])] = i;
+}
+
+/* Returns 1 if the bit was clear */
+static int dirty_mark(struct dirty_set *ds, unsigned long long chunk,
+		      unsigned long long tick)
+{
+	unsigned int slot = dirty_slot(ds, chunk);
+
+	if (ds->hash[slot] >= 0) {
+		ds->tick[ds->hash[slot]] = tick;
+		return 0;
+	}
+	if (ds->nr == ds->max) {
+		ds->max = ds->max ? ds->max * 2 : 1024;
+		ds->chunk = xrealloc(ds->chunk, ds->max * sizeof(ds->chunk[0]));
+		ds->tick = xrealloc(ds->tick, ds->max * sizeof(ds->tick[0]));
+	}
+	ds->chunk[ds->nr] = chunk;
+	ds->tick[ds->nr] = tick;
+	ds->hash[slot] = ds->nr++;
+	if (ds->nr * 2 >= (int)ds->hash_size)
+		dirty_rehash(ds);
+	return 1;
+}
+
+static int cmp_ull(const void *av, const void *bv)
+{
+	const unsigned long long *a = av, *b = bv;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+/* Count the distinct bitmap pages among 'n' chunks, reordering them */
+static unsigned long long count_pages(unsigned long long *chunks, int n)
+{
+	unsigned long long pages = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		chunks[i] /= BITMAP_PAGE_BITS;
+	qsort(chunks, n, sizeof(chunks[0]), cmp_ull);
+	for (i = 0; i < n; i++)
+		if (i == 0 || chunks[i] != chunks[i-1])
+			pages++;
+	return pages;
+}
+
+/* The daemon pass at 'tick': clear bits last written two or more
+ * ticks ago.  Returns the number of page updates.
+ */
+static unsigned long long dirty_clear(struct dirty_set *ds,
+				      unsigned long long tick,
+				      unsigned long long *cleared)
+{
+	int i, kept = 0, n = 0;
+
+	for (i = 0; i < ds->nr; i++) {
+		if (ds->tick[i] + 2 <= tick) {
+			cleared[n++] = ds->chunk[i];
+			continue;
+		}
+		ds->chunk[kept] = ds->chunk[i];
+		ds->tick[kept] = ds->tick[i];
+		kept++;
+	}
+	if (!n)
+		return 0;
+	ds->nr = kept;
+	dirty_rehash(ds);
+	return count_pages(cleared, n);
+}
+
+static void simulate(struct trace_write *w, int nw, int data_disks,
+		     unsigned long long raid_chunk, int daemon_sleep,
+		     struct bitmap_advice *adv)
+{
+	/* 'raid_chunk' is the chunk, in sectors, that the array stripes
+	 * data over 'data_disks' in, or 0 if it isn't striped.
+	 */
+	unsigned long long chunk_sectors = adv->chunksize >> 9;
+	struct dirty_set ds;
+	unsigned long long *scratch = NULL;
+	int scratch_size = 0;
+	unsigned long long tick = 0;
+	double integral = 0, last = w[0].time;
+	int i;
+
+	memset(&ds, 0, sizeof(ds));
+	ds.hash_size = 1024;
+	ds.hash = xmalloc(ds.hash_size * sizeof(int));
+	memset(ds.hash, 0xff, ds.hash_size * sizeof(int));
+
+	for (i = 0; i < nw; i++) {
+		unsigned long long now = (unsigned long long)
+			((w[i].time - w[0].time) / daemon_sleep);
+		unsigned long long a = w[i].sector;
+		unsigned long long a_end = w[i].sector + w[i].sectors;
+		int n = 0;
+
+		integral += ds.nr * (w[i].time - last);
+		last = w[i].time;
+
+		if (scratch_size < ds.max) {
+			scratch_size = ds.max;
+			scratch = xrealloc(scratch,
+					   scratch_size * sizeof(scratch[0]));
+		}
+		if (ds.nr == 0)
+			tick = now;
+		while (tick < now && ds.nr)
+			adv->clear_writes += dirty_clear(&ds, ++tick, scratch);
+		tick = now;
+
+		while (a < a_end) {
+			/* the part of the write in one RAID chunk, and
+			 * where that is on the devices
+			 */
+			unsigned long long dstart, dend, c;
+
+			if (raid_chunk) {
+				unsigned long long off = a % raid_chunk;
+				unsigned long long len = min(raid_chunk - off,
+							     a_end - a);
+
+				dstart = a / raid_chunk / data_disks *
+					raid_chunk + off;
+				dend = dstart + len;
+				a += len;
+			} else {
+				dstart = a / data_disks;
+				dend = (a_end - 1) / data_disks + 1;
+				a = a_end;
+			}
+			for (c = dstart / chunk_sectors;
+			     c <= (dend - 1) / chunk_sectors; c++) {
+				if (!dirty_mark(&ds, c, now))
+					continue;
+				if (n == scratch_size) {
+					scratch_size = scratch_size ? scratch_size * 2 : 1024;
+					scratch = xrealloc(scratch,
+							   scratch_size * sizeof(scratch[0]));
+				}
+				scratch[n++] = c;
+			}
+		}
+		if (n)
+			adv->set_writes += count_pages(scratch, n);
+		if ((unsigned long long)ds.nr * chunk_sectors > adv->max_resync)
+			adv->max_resync = ds.nr * chunk_sectors;
+	}
+
+	/* Once the writes stop the daemon still clears what is left,
+	 * which is part of the cost of the workload.
+	 */
+	if (scratch_size < ds.max) {
+		scratch_size = ds.max;
+		scratch = xrealloc(scratch, scratch_size * sizeof(scratch[0]));
+	}
+	while (ds.nr)
+		adv->clear_writes += dirty_clear(&ds, ++tick, scratch);
+
+	if (last > w[0].time) {
+		double secs = last - w[0].time;
+
+		adv->mean_resync = integral / secs * chunk_sectors;
+		adv->update_rate = (adv->set_writes + adv->clear_writes) / secs;
+	} else
+		adv->update_rate = adv->set_writes + adv->clear_writes;
+	free(scratch);
+	free(ds.chunk);
+	free(ds.tick);
+	free(ds.hash);
+}
+
+int bitmap_advise(char *tracefile, unsigned long long size, int level,
+		  int data_disks, int raid_chunk, int daemon_sleep,
+		  double max_rate, struct bitmap_advice *adv, int nadv)
+{
+	/*
+	 * Replay the writes in 'tracefile' against a bitmap covering
+	 * 'size' sectors of each device for each adv[].chunksize (bytes).
+	 * The array's 'level', 'data_disks' and 'raid_chunk' (bytes) say
+	 * where each write lands on the devices: levels that stripe put
+	 * each RAID chunk of a write at its own place.  If adv[0].chunksize is 0,
+	 * try DEFAULT_BITMAP_CHUNK and successive doublings.
+	 * Returns the index of the smallest chunk size whose update rate
+	 * is no more than 'max_rate' per second (BITMAP_ADVISE_RATE if
+	 * 0), or of the largest if none are, or -1 on error.
+	 */
+	struct trace_write *w;
+	unsigned long long stripe_chunk = 0;
+	int nw;
+	int i;
+	int best = -1;
+
+	if (nadv <= 0 || data_disks <= 0)
+		return -1;
+	switch (level) {
+	case 0:
+	case 4:
+	case 5:
+	case 6:
+	case 10:
+		if (raid_chunk < 512) {
+			pr_err("invalid RAID chunk size %d\n", raid_chunk);
+			return -1;
+		}
+		stripe_chunk = raid_chunk / 512;
+		break;
+	}
+	if (daemon_sleep <= 0)
+		daemon_sleep = DEFAULT_BITMAP_DELAY;
+	if (max_rate <= 0)
+		max_rate = BITMAP_ADVISE_RATE;
+	if (adv[0].chunksize == 0)
+		for (i = 0; i < nadv; i++)
+			adv[i].chunksize = (unsigned long)DEFAULT_BITMAP_CHUNK << i;
+
+	nw = read_trace(tracefile, &w);
+	if (nw < 0)
+		return -1;
+	if (nw == 0) {
+		pr_err("no writes found in %s\n", tracefile);
+		free(w);
+		return -1;
+	}
+
+	for (i = 0; i < nadv; i++) {
+		unsigned long chunksize = adv[i].chunksize;
+
+		memset(&adv[i], 0, sizeof(adv[i]));
+		adv[i].chunksize = chunksize;
+		if (chunksize < 512 || (chunksize & (chunksize - 1))) {
+			pr_err("invalid bitmap chunk size %lu\n", chunksize);
+			free(w);
+			return -1;
+		}
+		adv[i].bitmap_bytes = ((size * 512 + chunksize - 1) / chunksize
+				 + 7) / 8;
+		simulate(w, nw, data_disks, stripe_chunk, daemon_sleep,
+			 &adv[i]);
+		if (adv[i].update_rate <= max_rate &&
+		    (best < 0 || chunksize < adv[best].chunksize))
+			best = i;
+	}
+	if (best < 0)
+		for (i = 0; i < nadv; i++)
+			if (best < 0 || adv[i].chunksize > adv[best].chunksize)
+				best = i;
+	free(w);
+	return best;
+}
@@ -19,8 +19,10 @@
  */
 
 #include "mdadm.h"
+#include <stdint.h>
+#include <sys/mman.h>
 
-inline void sb_le_to_cpu(bitmap_super_t *sb)
+static inline void sb_le_to_cpu(bitmap_super_t *sb)
 {
 	sb->magic = __le32_to_cpu(sb->magic);
 	sb->version = __le32_to_cpu(sb->version);
@@ -34,7 +36,7 @@ inline void sb_le_to_cpu(bitmap_super_t *sb)
 	sb->write_behind = __le32_to_cpu(sb->write_behind);
 }
 
-inline void sb_cpu_to_le(bitmap_super_t *sb)
+static inline void sb_cpu_to_le(bitmap_super_t *sb)
 {
 	sb_le_to_cpu(sb); /* these are really the same thing */
 }
@@ -73,36 +75,101 @@ typedef struct bitmap_info_s {
 	unsigned long long dirty_bits;
 } bitmap_info_t;
 
-/* count the dirty bits in the first num_bits of byte */
-inline int count_dirty_bits_byte(char byte, int num_bits)
+/* Count the set bits in 'len' bytes.  The bitmap is scanned a word
+ * at a time; the cpu's popcnt instruction is used when it has one,
+ * and AVX-512 VPOPCNTDQ for 64 bytes at a time when available.
+ */
+static unsigned long long popcount_bytes_sw(const unsigned char *p,
+					    size_t len)
+{
+	unsigned long long num = 0;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		num += __builtin_popcountll(v);
+	}
+	while (len--)
+		num += __builtin_popcount(*p++);
+	return num;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static unsigned long long popcount_bytes_popcnt(const unsigned char *p,
+						size_t len)
 {
-	int num = 0;
-
-	switch (num_bits) { /* fall through... */
-		case 8:	if (byte & 128) num++;
-		case 7:	if (byte &  64) num++;
-		case 6:	if (byte &  32) num++;
-		case 5:	if (byte &  16) num++;
-		case 4:	if (byte &   8) num++;
-		case 3: if (byte &   4) num++;
-		case 2:	if (byte &   2) num++;
-		case 1:	if (byte &   1) num++;
-		default: break;
+	unsigned long long num = 0;
+
+	for (; len >= 32; p += 32, len -= 32) {
+		uint64_t v[4];
+
+		memcpy(v, p, 32);
+		num += __builtin_popcountll(v[0]) + __builtin_popcountll(v[1]) +
+			__builtin_popcountll(v[2]) + __builtin_popcountll(v[3]);
 	}
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
 
+		memcpy(&v, p, 8);
+		num += __builtin_popcountll(v);
+	}
+	while (len--)
+		num += __builtin_popcount(*p++);
 	return num;
 }
 
-int count_dirty_bits(char *buf, int num_bits)
+__attribute__((target("popcnt,avx512f,avx512bw,avx512vpopcntdq")))
+static unsigned long long popcount_bytes_avx512(const unsigned char *p,
+						size_t len)
 {
-	int i, num = 0;
+	__m512i sum = _mm512_setzero_si512();
 
-	for (i = 0; i < num_bits / 8; i++)
-		num += count_dirty_bits_byte(buf[i], 8);
+	for (; len >= 64; p += 64, len -= 64)
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(
+					       _mm512_loadu_si512(p)));
+	if (len) {
+		/* masked load of the tail, the rest reads as zero */
+		__mmask64 m = (1ULL << len) - 1;
+		__m512i v = _mm512_maskz_loadu_epi8(m, p);
 
-	if (num_bits % 8) /* not an even byte boundary */
-		num += count_dirty_bits_byte(buf[i], num_bits % 8);
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+	}
+	return _mm512_reduce_add_epi64(sum);
+}
+#endif
+
+static unsigned long long (*popcount_bytes)(const unsigned char *p,
+					    size_t len) = popcount_bytes_sw;
+
+__attribute__((constructor))
+static void popcount_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vpopcntdq") &&
+	    __builtin_cpu_supports("avx512bw"))
+		popcount_bytes = popcount_bytes_avx512;
+	else if (__builtin_cpu_supports("popcnt"))
+		popcount_bytes = popcount_bytes_popcnt;
+#endif
+}
 
+/* count the dirty bits in the first num_bits of buf.  Bits are in
+ * little-endian order, so a partial last byte uses its low bits.
+ */
+int count_dirty_bits(char *buf, int num_bits)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	int num;
+
+	num = popcount_bytes(p, num_bits / 8);
+	if (num_bits % 8) /* not an even byte boundary */
+		num += __builtin_popcount(p[num_bits / 8] &
+					  ((1 << (num_bits % 8)) - 1));
 	return num;
 }
 
@@ -121,7 +188,229 @@ unsigned long bitmap_sectors(struct bitmap_super_s *bsb)
 	return (bits + bits_per_sector - 1) / bits_per_sector;
 }
 
-bitmap_info_t *bitmap_fd_read(int fd, int brief)
+/* Extra work done while bitmap_fd_scan() passes over the bits */
+struct bitmap_scan {
+	/* runs of dirty bits, in bits until bitmap_dirty_extents()
+	 * converts them to sectors
+	 */
+	int want_extents;
+	struct bitmap_extent *ext;
+	int nr_ext, max_ext;
+	int in_run;
+	unsigned long long run_start;
+	unsigned long long run_end;	/* end of the last dirty run */
+	/* longest runs, in bits */
+	unsigned long long max_clean, max_dirty;
+	/* dirty bits per bucket for bitmap_heat_map(), or NULL */
+	struct bitmap_heat *heat;
+};
+
+static void scan_toggle(struct bitmap_scan *sc, unsigned long long bit)
+{
+	if (!sc->in_run) {
+		if (bit - sc->run_end > sc->max_clean)
+			sc->max_clean = bit - sc->run_end;
+		sc->run_start = bit;
+		sc->in_run = 1;
+		return;
+	}
+	if (bit - sc->run_start > sc->max_dirty)
+		sc->max_dirty = bit - sc->run_start;
+	sc->run_end = bit;
+	sc->in_run = 0;
+	if (!sc->want_extents)
+		return;
+	if (sc->nr_ext == sc->max_ext) {
+		sc->max_ext = sc->max_ext ? sc->max_ext * 2 : 64;
+		sc->ext = xrealloc(sc->ext, sc->max_ext * sizeof(sc->ext[0]));
+	}
+	sc->ext[sc->nr_ext].start = sc->run_start;
+	sc->ext[sc->nr_ext].sectors = bit - sc->run_start;
+	sc->nr_ext++;
+}
+
+/* Find the runs of dirty bits in 'nbits' bits at 'p', which are bits
+ * 'base' onwards of the bitmap.  A word at a time: each step finds the
+ * next bit that differs from the current state, so clean or dirty
+ * stretches cost one test per 64 bits, and clean stretches are
+ * skipped 512 bits at a time.
+ */
+static void scan_runs(struct bitmap_scan *sc, const unsigned char *p,
+		      unsigned long long base, unsigned long long nbits)
+{
+	unsigned long long i = 0;
+
+	while (i < nbits) {
+		uint64_t w = 0, mask = ~0ULL;
+		unsigned int n = 64;
+		unsigned int b = 0;
+
+		if (!sc->in_run && nbits - i >= 512) {
+			uint64_t v[8];
+
+			memcpy(v, p + i/8, sizeof(v));
+			if ((v[0] | v[1] | v[2] | v[3] |
+			     v[4] | v[5] | v[6] | v[7]) == 0) {
+				i += 512;
+				continue;
+			}
+		}
+		if (nbits - i < 64) {
+			n = nbits - i;
+			mask = (1ULL << n) - 1;
+			memcpy(&w, p + i/8, (n + 7) / 8);
+		} else
+			memcpy(&w, p + i/8, 8);
+		w = __le64_to_cpu(w);
+
+		while (b < n) {
+			uint64_t x = (sc->in_run ? ~w : w) & mask & (~0ULL << b);
+
+			if (!x)
+				break;
+			b = __builtin_ctzll(x);
+			scan_toggle(sc, base + i + b);
+		}
+		i += n;
+	}
+}
+
+/* Count the dirty bits in 'nbits' bits at 'buf', which are bits 'base'
+ * onwards of the bitmap, feeding them to 'sc' if given.
+ */
+static unsigned long long scan_bits(struct bitmap_scan *sc, char *buf,
+				    unsigned long long base,
+				    unsigned long long nbits)
+{
+	struct bitmap_heat *heat;
+	unsigned long long done, dirty = 0;
+
+	if (!sc)
+		return count_dirty_bits(buf, nbits);
+	scan_runs(sc, (unsigned char *)buf, base, nbits);
+	heat = sc->heat;
+	if (!heat)
+		return count_dirty_bits(buf, nbits);
+
+	/* Buckets are a whole number of bytes, so each piece starts
+	 * on a byte boundary.
+	 */
+	for (done = 0; done < nbits; ) {
+		unsigned long long b = (base + done) / heat->bucket_bits;
+		unsigned long long n = (b + 1) * heat->bucket_bits - (base + done);
+		unsigned long long d;
+
+		if (n > nbits - done)
+			n = nbits - done;
+		d = count_dirty_bits(buf + done / 8, n);
+		heat->dirty[b] += d;
+		dirty += d;
+		done += n;
+	}
+	return dirty;
+}
+
+/* Called once the bitmap size is known */
+static void scan_start(struct bitmap_scan *sc, unsigned long long total_bits)
+{
+	struct bitmap_heat *heat = sc->heat;
+
+	if (!heat)
+		return;
+	heat->bucket_bits = (total_bits + BITMAP_HEAT_BUCKETS - 1) /
+		BITMAP_HEAT_BUCKETS;
+	heat->bucket_bits = ROUND_UP(heat->bucket_bits, 8ULL) ?: 8;
+	heat->buckets = (total_bits + heat->bucket_bits - 1) /
+		heat->bucket_bits;
+}
+
+/* Called once every bit has been seen */
+static void scan_finish(struct bitmap_scan *sc, unsigned long long read_bits,
+			unsigned long long total_bits)
+{
+	/* Anything we couldn't read must be treated as dirty */
+	if (read_bits < total_bits && !sc->in_run)
+		scan_toggle(sc, read_bits);
+	if (sc->in_run)
+		scan_toggle(sc, total_bits);
+	if (total_bits - sc->run_end > sc->max_clean)
+		sc->max_clean = total_bits - sc->run_end;
+}
+
+/* Transfer size for reading or writing 'len' bytes of bitmap: at least
+ * BITMAP_IO_MIN, in whole multiples of the device's optimal I/O size
+ * (or of the block size for a file), but no more than is needed.
+ * Always a multiple of 4096 so it suits O_DIRECT.
+ */
+#define BITMAP_IO_MIN	(1024*1024)
+#define BITMAP_IO_MAX	(16*1024*1024)
+
+size_t bitmap_io_size(int fd, unsigned long long len)
+{
+	struct stat stb;
+	unsigned int opt = 0;
+	size_t size;
+
+	if (fstat(fd, &stb) == 0) {
+		if (S_ISBLK(stb.st_mode)) {
+			if (ioctl(fd, BLKIOOPT, &opt) != 0)
+				opt = 0;
+		} else
+			opt = stb.st_blksize;
+	}
+	if (opt < 4096 || (opt & 4095) || opt > BITMAP_IO_MAX)
+		opt = 4096;
+	size = (BITMAP_IO_MIN + opt - 1) / opt * opt;
+	len = ROUND_UP(len, 4096);
+	if (len < size)
+		size = len ?: 4096;
+	return size;
+}
+
+/* Count the dirty bits of a bitmap file by mapping it, starting at
+ * byte 'offset'.  Returns the number of bits available, or -1 if the
+ * file cannot be mapped.
+ */
+static long long bitmap_map_count(int fd, off_t offset, off_t file_size,
+				  unsigned long long total_bits,
+				  unsigned long long *dirty_bits,
+				  struct bitmap_scan *sc)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t base = offset & ~(off_t)(pagesize - 1);
+	unsigned long long bytes, bits, done;
+	unsigned char *map;
+	size_t maplen;
+
+	if (offset >= file_size)
+		return 0;
+	bytes = file_size - offset;
+	if (bytes > (total_bits + 7) / 8)
+		bytes = (total_bits + 7) / 8;
+	maplen = offset - base + bytes;
+	map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, base);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, maplen, MADV_SEQUENTIAL);
+
+	bits = bytes * 8;
+	if (bits > total_bits)
+		bits = total_bits;
+	for (done = 0; done < bits; ) {
+		int n = 1 << 30;
+
+		if (bits - done < (unsigned long long)n)
+			n = bits - done;
+		*dirty_bits += scan_bits(sc, (char *)map + (offset - base) +
+					 done / 8, done, n);
+		done += n;
+	}
+	munmap(map, maplen);
+	return bits;
+}
+
+static bitmap_info_t *bitmap_fd_scan(int fd, int brief,
+				     struct bitmap_scan *sc)
 {
 	/* Note: fd might be open O_DIRECT, so we must be
 	 * careful to align reads properly
@@ -129,7 +418,10 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	unsigned long long total_bits = 0, read_bits = 0, dirty_bits = 0;
 	bitmap_info_t *info;
 	void *buf;
+	size_t bufsize = 8192;
 	unsigned int n, skip;
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	struct stat stb;
 
 	if (posix_memalign(&buf, 4096, 8192) != 0) {
 		pr_err("failed to allocate 8192 bytes\n");
@@ -162,12 +454,37 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	 *    data in the file
 	 */
 	total_bits = bitmap_bits(info->sb.sync_size, info->sb.chunksize);
+	if (sc)
+		scan_start(sc, total_bits);
+
+	if (start >= 0 && fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode)) {
+		/* A bitmap file: map it rather than read it */
+		long long bits = bitmap_map_count(fd, start + skip,
+						  stb.st_size, total_bits,
+						  &dirty_bits, sc);
+		if (bits >= 0) {
+			read_bits = bits;
+			goto check;
+		}
+	}
 
 	while(read_bits < total_bits) {
 		unsigned long long remaining = total_bits - read_bits;
 
 		if (n == 0) {
-			n = read(fd, buf, 8192);
+			if (bufsize == 8192) {
+				/* Read the rest in large transfers */
+				size_t size = bitmap_io_size(fd, (remaining + 7) / 8);
+				void *big;
+
+				if (size > bufsize &&
+				    posix_memalign(&big, 4096, size) == 0) {
+					free(buf);
+					buf = big;
+					bufsize = size;
+				}
+			}
+			n = read(fd, buf, bufsize);
 			skip = 0;
 			if (n <= 0)
 				break;
@@ -175,12 +492,15 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 		if (remaining > (n-skip) * 8) /* we want the full buffer */
 			remaining = (n-skip) * 8;
 
-		dirty_bits += count_dirty_bits(buf+skip, remaining);
+		dirty_bits += scan_bits(sc, buf+skip, read_bits, remaining);
 
 		read_bits += remaining;
 		n = 0;
 	}
 
+check:
+	if (sc)
+		scan_finish(sc, read_bits, total_bits);
 	if (read_bits < total_bits) { /* file truncated... */
 		pr_err("WARNING: bitmap file is not large "
 			"enough for array size %llu!\n\n",
@@ -194,6 +514,11 @@ out:
 	return info;
 }
 
+bitmap_info_t *bitmap_fd_read(int fd, int brief)
+{
+	return bitmap_fd_scan(fd, brief, NULL);
+}
+
 int bitmap_file_open(char *filename, struct supertype **stp)
 {
 	int fd;
@@ -339,6 +664,96 @@ free_info:
 	return rv;
 }
 
+int bitmap_dirty_extents(char *filename, struct supertype *st,
+			 struct bitmap_extent **extents)
+{
+	/*
+	 * Read the bitmap and return the regions it marks dirty, in
+	 * sectors of the space the bitmap covers - the units of the
+	 * array's sync_min and sync_max - in increasing order.
+	 * Returns the number of extents, or -1 on error.
+	 */
+	struct bitmap_scan sc;
+	bitmap_info_t *info;
+	unsigned long long chunk_sectors, size;
+	int fd;
+	int i;
+
+	*extents = NULL;
+	fd = bitmap_file_open(filename, &st);
+	if (fd < 0)
+		return -1;
+	memset(&sc, 0, sizeof(sc));
+	sc.want_extents = 1;
+	info = bitmap_fd_scan(fd, 0, &sc);
+	close(fd);
+	if (!info)
+		return -1;
+	if (info->sb.magic != BITMAP_MAGIC ||
+	    info->sb.chunksize < 512) {
+		pr_err("%s does not hold a valid bitmap\n", filename);
+		free(info);
+		free(sc.ext);
+		return -1;
+	}
+	chunk_sectors = info->sb.chunksize >> 9;
+	size = info->sb.sync_size;
+	free(info);
+
+	for (i = 0; i < sc.nr_ext; i++) {
+		struct bitmap_extent *e = &sc.ext[i];
+		unsigned long long end = (e->start + e->sectors) * chunk_sectors;
+
+		e->start *= chunk_sectors;
+		if (end > size)
+			end = size;
+		e->sectors = end - e->start;
+	}
+	*extents = sc.ext;
+	return sc.nr_ext;
+}
+
+int bitmap_heat_map(char *filename, struct supertype *st,
+		    struct bitmap_heat *heat)
+{
+	/*
+	 * Read the bitmap and report how the dirty bits are spread
+	 * over the space it covers, in one pass.
+	 * Returns 0, or -1 on error.
+	 */
+	struct bitmap_scan sc;
+	bitmap_info_t *info;
+	unsigned long long chunk_sectors;
+	int fd;
+
+	memset(heat, 0, sizeof(*heat));
+	fd = bitmap_file_open(filename, &st);
+	if (fd < 0)
+		return -1;
+	memset(&sc, 0, sizeof(sc));
+	sc.heat = heat;
+	info = bitmap_fd_scan(fd, 0, &sc);
+	close(fd);
+	if (!info)
+		return -1;
+	if (info->sb.magic != BITMAP_MAGIC ||
+	    info->sb.chunksize < 512) {
+		pr_err("%s does not hold a valid bitmap\n", filename);
+		free(info);
+		return -1;
+	}
+	chunk_sectors = info->sb.chunksize >> 9;
+	heat->chunk_sectors = chunk_sectors;
+	heat->total_bits = info->total_bits;
+	heat->dirty_bits = info->dirty_bits;
+	heat->max_clean = min(sc.max_clean * chunk_sectors,
+			      (unsigned long long)info->sb.sync_size);
+	heat->max_dirty = min(sc.max_dirty * chunk_sectors,
+			      (unsigned long long)info->sb.sync_size);
+	free(info);
+	return 0;
+}
+
 int CreateBitmap(char *filename, int force, char uuid[16],
 		 unsigned long chunksize, unsigned long daemon_sleep,
 		 unsigned long write_behind,
@@ -0,0 +1,138 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* CRC32C (Castagnoli), as used by iSCSI, btrfs and ext4 metadata.
+ * This checksums the reshape backup, see Grow.c.
+ * The cpu's crc32 instruction is used when it has SSE4.2, otherwise
+ * a slice-by-8 table walk.  The tables are generated at build time
+ * by mktables.c.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+extern const uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = crc32c_table;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+			t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+			t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#if defined(__x86_64__)
+	{
+		uint64_t c = crc;
+
+		while (len >= 8) {
+			uint64_t v;
+
+			memcpy(&v, p, 8);
+			c = _mm_crc32_u64(c, v);
+			p += 8;
+			len -= 8;
+		}
+		crc = (uint32_t)c;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+		p += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p,
+			     size_t len) = crc32c_sw;
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_fn = crc32c_sse42;
+#endif
+}
+
+int crc32c_select(const char *name)
+{
+	/* Use the "sw" or "sse4.2" implementation from now on, for
+	 * testing.  Returns -1 if it is unknown or this cpu can't run it.
+	 */
+	if (strcmp(name, "sw") == 0) {
+		crc32c_fn = crc32c_sw;
+		return 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+		crc32c_fn = crc32c_sse42;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+	return ~crc32c_fn(~crc, buf, len);
+}
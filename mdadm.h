@@ -34,6 +34,7 @@ extern __off64_t lseek64 __P ((int __fd, __off64_t __offset, int __whence));
 #endif
 
 #include	<sys/types.h>
+#include	<sys/sysmacros.h>
 #include	<sys/stat.h>
 #include	<stdlib.h>
 #include	<time.h>
@@ -62,6 +63,9 @@ extern __off64_t lseek64 __P ((int __fd, __off64_t __offset, int __whence));
 #ifndef BLKGETSIZE64
 #define BLKGETSIZE64 _IOR(0x12,114,size_t) /* return device size in bytes (u64 *arg) */
 #endif
+#ifndef BLKIOOPT
+#define BLKIOOPT _IO(0x12,121) /* optimal I/O size in bytes (unsigned int *arg) */
+#endif
 
 #define DEFAULT_CHUNK 512
 #define DEFAULT_BITMAP_CHUNK 4096
@@ -213,8 +217,11 @@ struct mdinfo {
 	 * over-writing still-valid data.  We need to know if there is space.
 	 * So getinfo_super will fill in space_before and space_after in sectors.
 	 * data_offset can be increased or decreased by this amount.
+	 * bitmap_space_before/after is how much more there would be if
+	 * the internal bitmap were removed.
 	 */
 	unsigned long long	space_before, space_after;
+	unsigned long long	bitmap_space_before, bitmap_space_after;
 	union {
 		unsigned long long resync_start; /* per-array resync position */
 		unsigned long long recovery_start; /* per-device rebuild position */
@@ -502,6 +509,27 @@ extern int sysfs_disk_to_scsi_id(int fd, __u32 *id);
 extern int sysfs_unique_holder(char *devnm, long rdev);
 extern int sysfs_freeze_array(struct mdinfo *sra);
 extern int sysfs_wait(int fd, int *msec);
+
+/* Reshape progress, see reshape-watch.c */
+struct reshape_progress {
+	unsigned long long completed;	/* sync_completed, per device */
+	unsigned long long total;	/* ... out of this many */
+	int completed_valid;		/* 0 if sync_completed is "none" */
+	unsigned long long position;	/* reshape_position or MaxSector */
+	char action[20];		/* sync_action */
+	int reshaping;			/* sync_action is "reshape" */
+};
+struct reshape_watch;
+extern struct reshape_watch *reshape_watch_open(struct mdinfo *sra);
+extern void reshape_watch_close(struct reshape_watch *w);
+extern int reshape_watch_fd(struct reshape_watch *w);
+extern int reshape_watch_timeout(struct reshape_watch *w);
+extern int reshape_watch_wait(struct reshape_watch *w, int *msec);
+extern int reshape_watch_read(struct reshape_watch *w,
+			      struct reshape_progress *p);
+extern int reshape_watch_run(struct reshape_watch *w,
+			     int (*cb)(struct reshape_progress *p, void *arg),
+			     void *arg);
 extern int load_sys(char *path, char *buf);
 extern int reshape_prepare_fdlist(char *devname,
 				  struct mdinfo *sra,
@@ -526,6 +554,9 @@ extern unsigned long compute_backup_blocks(int nchunk, int ochunk,
 					   unsigned int ndata, unsigned int odata);
 extern char *locate_backup(char *name);
 extern char *make_backup(char *name);
+extern void set_bitmap_pending(char *devnm, int bitmap_chunk);
+extern int get_bitmap_pending(char *devnm);
+extern void clear_bitmap_pending(char *devnm);
 
 extern int save_stripes(int *source, unsigned long long *offsets,
 			int raid_disks, int chunk_size, int level, int layout,
@@ -538,6 +569,33 @@ extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   unsigned long long start, unsigned long long length,
 			   char *src_buf);
 
+/* One problem found by scrub_stripes() */
+struct scrub_mismatch {
+	unsigned long long stripe;	/* first stripe affected */
+	int disk;			/* member at fault, -1 if unknown */
+	unsigned long long offset;	/* bytes on each member, from its offset */
+	unsigned int len;		/* bytes */
+	int err;			/* errno if 'disk' could not be read */
+};
+
+struct scrub_report {
+	unsigned long long stripes;	/* stripes examined */
+	unsigned long long unreadable;	/* stripes skipped after read errors */
+	int nmismatches;
+	int alloc;
+	struct scrub_mismatch *mismatches;
+};
+
+extern int scrub_stripes(int *source, unsigned long long *offsets,
+			 int raid_disks, int chunk_size, int level, int layout,
+			 unsigned long long start, unsigned long long length,
+			 struct scrub_report *report);
+extern void free_scrub_report(struct scrub_report *report);
+extern int rebuild_members(int *source, unsigned long long *offsets,
+			   int raid_disks, int chunk_size, int level, int layout,
+			   unsigned long long start, unsigned long long length,
+			   int *dest);
+
 #ifndef Sendmail
 #define Sendmail "/usr/lib/sendmail -t"
 #endif
@@ -585,8 +643,66 @@ struct reshape {
 	unsigned long long min_offset_change;
 	unsigned long long stripes; /* number of old stripes that comprise 'blocks'*/
 	unsigned long long new_size; /* New size of array in sectors */
+	unsigned long long backup_window; /* sectors of array data currently
+					   * backed up at a time by
+					   * child_monitor() */
+	struct reshape_stats *stats;	/* filled in as the reshape runs, or NULL */
+};
+
+/* Statistics about a running reshape, see reshape-stats.c.
+ * Each phase has a histogram of how long it took: hist[0] counts
+ * times under 1 usec, hist[b] those from 2^(b-1) up to 2^b usec, and
+ * the last bucket everything longer.
+ */
+enum {
+	RESHAPE_PHASE_BACKUP,	/* reading and writing one backup */
+	RESHAPE_PHASE_FORGET,	/* erasing a backup, with its fsync */
+	RESHAPE_PHASE_SUSPEND,	/* a spell with a region suspended */
+	RESHAPE_PHASE_WAIT,	/* waiting for the kernel to make progress */
+	RESHAPE_PHASES,
+};
+#define RESHAPE_STATS_BUCKETS	32
+#define RESHAPE_STATS_VERSION	2
+
+struct reshape_phase_stats {
+	unsigned long long count;
+	unsigned long long total_usec;
+	unsigned long long max_usec;
+	unsigned long long hist[RESHAPE_STATS_BUCKETS];
 };
 
+struct reshape_stats {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int seq;		/* odd while being updated */
+	int pid;			/* of the process doing the reshape */
+	char devnm[32];
+	unsigned long long start_usec;	/* gettimeofday() time */
+	unsigned long long updated_usec;
+	unsigned long long bytes_backed_up;
+	unsigned long long backup_window;	/* sectors, see struct reshape */
+	unsigned long long suspended_usec;
+	unsigned long long progress;	/* array sector reached */
+	unsigned long long progress_usec;	/* when it was reached */
+	int direction;			/* of progress: 1, -1, or 0 until seen */
+	unsigned long long sectors_reshaped;	/* since start_usec */
+	double mb_per_sec;		/* recent rate of reshape */
+	struct reshape_phase_stats phase[RESHAPE_PHASES];
+};
+
+extern struct reshape_stats *reshape_stats_create(char *devnm);
+extern void reshape_stats_destroy(struct reshape_stats *s);
+extern void reshape_stats_detach(struct reshape_stats *s);
+extern void reshape_stats_claim(struct reshape_stats *s);
+extern void reshape_stats_phase(struct reshape_stats *s, int phase,
+				unsigned long long usec);
+extern void reshape_stats_backup(struct reshape_stats *s,
+				 unsigned long long bytes,
+				 unsigned long long window);
+extern void reshape_stats_progress(struct reshape_stats *s,
+				   unsigned long long progress);
+extern int reshape_stats_read(char *devnm, struct reshape_stats *out);
+
 /* A superswitch provides entry point the a metadata handler.
  *
  * The superswitch primarily operates on some "metadata" that
@@ -1191,9 +1307,45 @@ extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long long array_size,
 			int major);
 extern int ExamineBitmap(char *filename, int brief, struct supertype *st);
+/* A dirty region reported by bitmap_dirty_extents() */
+struct bitmap_extent {
+	unsigned long long start;	/* sectors */
+	unsigned long long sectors;
+};
+extern int bitmap_dirty_extents(char *filename, struct supertype *st,
+				struct bitmap_extent **extents);
+/* How the dirty bits of a bitmap are spread, see bitmap_heat_map() */
+#define BITMAP_HEAT_BUCKETS 1024
+struct bitmap_heat {
+	unsigned long long total_bits, dirty_bits;
+	unsigned long long chunk_sectors;	/* sectors per bit */
+	unsigned long long bucket_bits;		/* bits per bucket, the last may have fewer */
+	int buckets;
+	unsigned long long dirty[BITMAP_HEAT_BUCKETS];	/* dirty bits in each bucket */
+	unsigned long long max_clean, max_dirty;	/* longest runs, in sectors */
+};
+extern int bitmap_heat_map(char *filename, struct supertype *st,
+			   struct bitmap_heat *heat);
+/* Bitmap cost of a recorded workload, see bitmap-advise.c */
+#define BITMAP_ADVISE_RATE 20	/* default acceptable updates per second */
+struct bitmap_advice {
+	unsigned long chunksize;		/* bytes */
+	unsigned long long bitmap_bytes;
+	unsigned long long set_writes;		/* synchronous, before a write */
+	unsigned long long clear_writes;	/* lazy, by the bitmap daemon */
+	double update_rate;			/* both, per second of trace */
+	unsigned long long max_resync;		/* sectors dirty at worst */
+	unsigned long long mean_resync;		/* sectors dirty on average */
+};
+extern int bitmap_advise(char *tracefile, unsigned long long size,
+			 int level, int data_disks, int raid_chunk,
+			 int daemon_sleep, double max_rate,
+			 struct bitmap_advice *adv, int nadv);
 extern int Write_rules(char *rule_name);
 extern int bitmap_update_uuid(int fd, int *uuid, int swap);
 extern unsigned long bitmap_sectors(struct bitmap_super_s *bsb);
+extern int count_dirty_bits(char *buf, int num_bits);
+extern size_t bitmap_io_size(int fd, unsigned long long len);
 extern int Dump_metadata(char *dev, char *dir, struct context *c,
 			 struct supertype *st);
 extern int Restore_metadata(char *dev, char *dir, struct context *c,
@@ -1402,6 +1554,12 @@ void *xrealloc(void *ptr, size_t len);
 void *xcalloc(size_t num, size_t size);
 char *xstrdup(const char *str);
 
+/* CRC32C (Castagnoli), see crc32c.c.  Pass 0 to start, or a previous
+ * result to continue over more data.
+ */
+extern unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+extern int crc32c_select(const char *name);
+
 #define	LEVEL_MULTIPATH		(-4)
 #define	LEVEL_LINEAR		(-1)
 #define	LEVEL_FAULTY		(-5)
@@ -0,0 +1,172 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Build-time generator for the GF(2^8) tables used by restripe.c,
+ * and the CRC32C tables used by crc32c.c.
+ * The following was taken from linux/drivers/md/mktables.c.  It is
+ * run by the build and its output compiled into the library, so the
+ * tables are const data shared by every process rather than being
+ * filled in on first use.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+static uint8_t gfmul(uint8_t a, uint8_t b)
+{
+	uint8_t v = 0;
+
+	while (b) {
+		if (b & 1)
+			v ^= a;
+		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
+		b >>= 1;
+	}
+
+	return v;
+}
+
+static uint8_t gfpow(uint8_t a, int b)
+{
+	uint8_t v = 1;
+
+	b %= 255;
+	if (b < 0)
+		b += 255;
+
+	while (b) {
+		if (b & 1)
+			v = gfmul(v, a);
+		a = gfmul(a, a);
+		b >>= 1;
+	}
+
+	return v;
+}
+
+static void print_table(const char *name, const uint8_t *t)
+{
+	int i, j;
+
+	printf("\nconst uint8_t %s[256] =\n{\n", name);
+	for (i = 0; i < 256; i += 8) {
+		printf("\t");
+		for (j = 0; j < 8; j++)
+			printf("0x%02x,%c", t[i + j], (j == 7) ? '\n' : ' ');
+	}
+	printf("};\n");
+}
+
+/* Slice-by-8 tables for the CRC32C (Castagnoli) polynomial, reflected */
+static void print_crc32c_tables(void)
+{
+	uint32_t t[8][256];
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+		t[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			t[j][i] = (t[j-1][i] >> 8) ^ t[0][t[j-1][i] & 0xff];
+
+	printf("\nconst uint32_t crc32c_table[8][256] =\n{\n");
+	for (i = 0; i < 8; i++) {
+		printf("\t{\n");
+		for (j = 0; j < 256; j += 4)
+			printf("\t\t0x%08x, 0x%08x, 0x%08x, 0x%08x,\n",
+			       t[i][j], t[i][j+1], t[i][j+2], t[i][j+3]);
+		printf("\t},\n");
+	}
+	printf("};\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, k;
+	uint8_t v;
+	uint32_t b, log;
+	uint8_t exp[256], inv[256], exi[256], lg[256], ilog[256];
+
+	printf("/* Generated by mktables.c -- do not edit */\n\n");
+	printf("#include <stdint.h>\n");
+
+	/* Compute multiplication table */
+	printf("\nconst uint8_t __attribute__((aligned(256)))\n"
+	       "raid6_gfmul[256][256] =\n{\n");
+	for (i = 0; i < 256; i++) {
+		printf("\t{\n");
+		for (j = 0; j < 256; j += 8) {
+			printf("\t\t");
+			for (k = 0; k < 8; k++)
+				printf("0x%02x,%c", gfmul(i, j + k),
+				       (k == 7) ? '\n' : ' ');
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+
+	/* Compute power-of-2 table (exponent) */
+	v = 1;
+	for (i = 0; i < 256; i++) {
+		exp[i] = v;
+		v = gfmul(v, 2);
+		if (v == 1)
+			v = 0;	/* For entry 255, not a real entry */
+	}
+	print_table("raid6_gfexp", exp);
+
+	/* Compute inverse table x^-1 == x^254 */
+	for (i = 0; i < 256; i++)
+		inv[i] = gfpow(i, 254);
+	print_table("raid6_gfinv", inv);
+
+	/* Compute inv(2^x + 1) (exponent-xor-inverse) table */
+	for (i = 0; i < 256; i++)
+		exi[i] = inv[exp[i] ^ 1];
+	print_table("raid6_gfexi", exi);
+
+	/* Compute log and inverse log */
+	/* Modified code from:
+	 *    http://web.eecs.utk.edu/~plank/plank/papers/CS-96-332.html
+	 */
+	b = 1;
+	lg[0] = 0;
+	ilog[255] = 0;
+
+	for (log = 0; log < 255; log++) {
+		lg[b] = (uint8_t) log;
+		ilog[log] = (uint8_t) b;
+		b = b << 1;
+		if (b & 256) b = b ^ 0435;
+	}
+	print_table("raid6_gflog", lg);
+	print_table("raid6_gfilog", ilog);
+
+	print_crc32c_tables();
+
+	return 0;
+}
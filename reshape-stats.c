@@ -0,0 +1,234 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Statistics about a running reshape.
+ *
+ * The reshape is driven by a forked child (see reshape_array() in
+ * Grow.c), so the statistics live in a small file in MAP_DIR which
+ * that process maps shared and updates in place.  Anyone can call
+ * reshape_stats_read() to get a consistent copy while the reshape
+ * runs: the writer makes 'seq' odd while it updates, and readers
+ * retry until they see the same even value before and after copying.
+ * If the file cannot be created the statistics are still kept, just
+ * not published, so the reshape code never needs to check.
+ */
+
+#include "mdadm.h"
+#include <sys/mman.h>
+
+#define RESHAPE_STATS_MAGIC	0x6d645253	/* "mdRS" */
+
+static void stats_path(char *buf, char *devnm)
+{
+	sprintf(buf, "%s/%s.reshape-stats", MAP_DIR, devnm);
+}
+
+static unsigned long long now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+struct reshape_stats *reshape_stats_create(char *devnm)
+{
+	struct reshape_stats *s = MAP_FAILED;
+	char path[100];
+	int fd;
+
+	(void)mkdir(MAP_DIR, 0755);
+	stats_path(path, devnm);
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, sizeof(*s)) == 0)
+			s = mmap(NULL, sizeof(*s), PROT_READ|PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		close(fd);
+		if (s == MAP_FAILED)
+			unlink(path);
+	}
+	if (s == MAP_FAILED)
+		s = mmap(NULL, sizeof(*s), PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	s->version = RESHAPE_STATS_VERSION;
+	s->pid = getpid();
+	strncpy(s->devnm, devnm, sizeof(s->devnm) - 1);
+	s->start_usec = s->updated_usec = now_usec();
+	__atomic_store_n(&s->magic, RESHAPE_STATS_MAGIC, __ATOMIC_RELEASE);
+	return s;
+}
+
+void reshape_stats_destroy(struct reshape_stats *s)
+{
+	char path[100];
+
+	if (!s)
+		return;
+	stats_path(path, s->devnm);
+	unlink(path);
+	munmap(s, sizeof(*s));
+}
+
+void reshape_stats_detach(struct reshape_stats *s)
+{
+	/* Leave 's' to a child that has taken over the reshape */
+	if (s)
+		munmap(s, sizeof(*s));
+}
+
+static void stats_begin(struct reshape_stats *s)
+{
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+static void stats_end(struct reshape_stats *s)
+{
+	s->updated_usec = now_usec();
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+void reshape_stats_claim(struct reshape_stats *s)
+{
+	/* This process, forked after 's' was created, now does the reshape */
+	if (!s)
+		return;
+	stats_begin(s);
+	s->pid = getpid();
+	stats_end(s);
+}
+
+void reshape_stats_phase(struct reshape_stats *s, int phase,
+			 unsigned long long usec)
+{
+	struct reshape_phase_stats *p;
+	int b = 0;
+
+	if (!s || phase < 0 || phase >= RESHAPE_PHASES)
+		return;
+	p = &s->phase[phase];
+	while (b < RESHAPE_STATS_BUCKETS - 1 && (usec >> b) > 0)
+		b++;
+	stats_begin(s);
+	p->count++;
+	p->total_usec += usec;
+	if (usec > p->max_usec)
+		p->max_usec = usec;
+	p->hist[b]++;
+	if (phase == RESHAPE_PHASE_SUSPEND)
+		s->suspended_usec += usec;
+	stats_end(s);
+}
+
+void reshape_stats_backup(struct reshape_stats *s, unsigned long long bytes,
+			  unsigned long long window)
+{
+	if (!s)
+		return;
+	stats_begin(s);
+	s->bytes_backed_up += bytes;
+	s->backup_window = window;
+	stats_end(s);
+}
+
+void reshape_stats_progress(struct reshape_stats *s,
+			    unsigned long long progress)
+{
+	/* 'progress' is the array sector the reshape has reached.
+	 * The rate is smoothed over roughly the last few seconds.
+	 * A reshape moves one way, set by the first change seen.  A move
+	 * the other way, e.g. when sync_completed is reset, only sets
+	 * the new starting point.
+	 */
+	unsigned long long now = now_usec();
+	unsigned long long moved = 0, dt;
+
+	if (!s)
+		return;
+	stats_begin(s);
+	if (s->progress_usec) {
+		if (s->direction == 0 && progress != s->progress)
+			s->direction = progress > s->progress ? 1 : -1;
+		if (s->direction > 0 && progress > s->progress)
+			moved = progress - s->progress;
+		else if (s->direction < 0 && progress < s->progress)
+			moved = s->progress - progress;
+		dt = now - s->progress_usec;
+		s->sectors_reshaped += moved;
+		if (dt) {
+			double rate = moved * 512.0 / dt;	/* MB/s */
+
+			if (dt >= 4000000 || s->mb_per_sec == 0)
+				s->mb_per_sec = rate;
+			else
+				s->mb_per_sec += (rate - s->mb_per_sec) *
+					dt / 4000000.0;
+		}
+	}
+	s->progress = progress;
+	s->progress_usec = now;
+	stats_end(s);
+}
+
+int reshape_stats_read(char *devnm, struct reshape_stats *out)
+{
+	/* Copy the statistics for the reshape of 'devnm' into 'out'.
+	 * Returns 0 on success, -1 if there is no reshape being
+	 * tracked for it.
+	 */
+	struct reshape_stats *s;
+	struct stat stb;
+	char path[100];
+	unsigned int seq;
+	int fd, tries;
+
+	stats_path(path, devnm);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &stb) < 0 || stb.st_size < (off_t)sizeof(*s)) {
+		close(fd);
+		return -1;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return -1;
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			usleep(10);
+			continue;
+		}
+		memcpy(out, s, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq)
+			break;
+	}
+	munmap(s, sizeof(*s));
+	if (tries == 1000 || out->magic != RESHAPE_STATS_MAGIC ||
+	    out->version != RESHAPE_STATS_VERSION)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Watch the progress of a reshape without polling sysfs.
+ *
+ * The md attributes which matter - sync_completed, sync_action and
+ * reshape_position - are held open and put in an epoll set, waiting
+ * for the exceptional condition which sysfs_notify() raises.  Not
+ * every change is notified (reshape_position never is, and
+ * sync_completed only at checkpoints), so there is also a fallback
+ * timer.  It is calibrated from how often the progress is seen to
+ * change: if notifications keep arriving first it stays long, if
+ * changes are only ever found when it fires it tracks the rate of
+ * change, and while nothing changes it backs off.
+ *
+ * Callers can either hand a callback to reshape_watch_run(), or put
+ * reshape_watch_fd() in their own poll set, waiting at most
+ * reshape_watch_timeout(), and call reshape_watch_read() when it
+ * wakes.  The latter lets one process follow many reshapes at once.
+ */
+
+#include "mdadm.h"
+#include <sys/epoll.h>
+
+#define WATCH_MIN_MSEC	20
+#define WATCH_MAX_MSEC	5000
+
+struct reshape_watch {
+	int epfd;
+	int completed_fd;
+	int action_fd;
+	int position_fd;	/* -1 if the kernel has no reshape_position */
+	int timeout;		/* msec to wait before reading anyway */
+	int interval;		/* smoothed msec between changes, 0 if unknown */
+	int timed_out;		/* the last wait ended on the timer */
+	struct timeval last_change;
+	struct reshape_progress last;
+	int have_last;
+};
+
+static int msec_since(struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000 +
+		(now.tv_usec - tv->tv_usec) / 1000;
+}
+
+static int watch_add(struct reshape_watch *w, int fd)
+{
+	struct epoll_event ev;
+
+	if (fd < 0)
+		return 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI | EPOLLERR;
+	ev.data.fd = fd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EPERM)
+		return -1;
+	/* EPERM: cannot be polled, the timer will have to do */
+	return 0;
+}
+
+struct reshape_watch *reshape_watch_open(struct mdinfo *sra)
+{
+	struct reshape_watch *w = xcalloc(1, sizeof(*w));
+
+	w->completed_fd = sysfs_get_fd(sra, NULL, "sync_completed");
+	w->action_fd = sysfs_get_fd(sra, NULL, "sync_action");
+	w->position_fd = sysfs_get_fd(sra, NULL, "reshape_position");
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	w->timeout = WATCH_MIN_MSEC;
+	if (w->completed_fd < 0 || w->action_fd < 0 || w->epfd < 0 ||
+	    watch_add(w, w->completed_fd) ||
+	    watch_add(w, w->action_fd) ||
+	    watch_add(w, w->position_fd)) {
+		reshape_watch_close(w);
+		return NULL;
+	}
+	return w;
+}
+
+void reshape_watch_close(struct reshape_watch *w)
+{
+	if (!w)
+		return;
+	if (w->epfd >= 0)
+		close(w->epfd);
+	if (w->completed_fd >= 0)
+		close(w->completed_fd);
+	if (w->action_fd >= 0)
+		close(w->action_fd);
+	if (w->position_fd >= 0)
+		close(w->position_fd);
+	free(w);
+}
+
+int reshape_watch_fd(struct reshape_watch *w)
+{
+	return w->epfd;
+}
+
+int reshape_watch_timeout(struct reshape_watch *w)
+{
+	return w->timeout;
+}
+
+int reshape_watch_wait(struct reshape_watch *w, int *msec)
+{
+	/* Wait for a notification, or until the fallback timer or
+	 * '*msec' runs out, whichever is first.  As with sysfs_wait()
+	 * '*msec' is reduced by the time spent.
+	 * Returns 1 if notified, 0 on timeout, -1 on error.
+	 */
+	struct epoll_event ev[3];
+	struct timeval start;
+	int t = w->timeout;
+	int n;
+
+	if (msec) {
+		if (*msec <= 0)
+			return 0;
+		if (*msec < t)
+			t = *msec;
+	}
+	gettimeofday(&start, NULL);
+	n = epoll_wait(w->epfd, ev, 3, t);
+	if (msec)
+		*msec -= msec_since(&start) + 1;
+	w->timed_out = (n == 0);
+	if (n < 0)
+		return -1;
+	return n > 0;
+}
+
+int reshape_watch_read(struct reshape_watch *w, struct reshape_progress *p)
+{
+	/* Read the current progress into 'p'.  This also re-arms the
+	 * notifications, so it should be called after every wait.
+	 * Returns 1 if anything changed since the last call, 0 if not,
+	 * or -1 if sync_completed could not be read at all.
+	 */
+	char *nl;
+	int changed;
+	int dt;
+
+	memset(p, 0, sizeof(*p));
+	switch (sysfs_fd_get_two(w->completed_fd, &p->completed, &p->total)) {
+	case -2:
+		return -1;
+	case -1:
+		/* "none" */
+		break;
+	default:
+		p->completed_valid = 1;
+	}
+	if (sysfs_fd_get_str(w->action_fd, p->action, sizeof(p->action)) > 0) {
+		nl = strchr(p->action, '\n');
+		if (nl)
+			*nl = 0;
+	}
+	p->reshaping = strcmp(p->action, "reshape") == 0;
+	p->position = MaxSector;
+	if (w->position_fd >= 0 &&
+	    sysfs_fd_get_ll(w->position_fd, &p->position) < 0)
+		p->position = MaxSector;
+
+	changed = !w->have_last ||
+		p->completed_valid != w->last.completed_valid ||
+		p->completed != w->last.completed ||
+		p->position != w->last.position ||
+		strcmp(p->action, w->last.action) != 0;
+	if (!w->have_last) {
+		gettimeofday(&w->last_change, NULL);
+	} else if (changed) {
+		dt = msec_since(&w->last_change);
+		gettimeofday(&w->last_change, NULL);
+		w->interval = w->interval ? (w->interval * 3 + dt) / 4 : dt;
+		if (w->timed_out)
+			/* only the timer noticed, so keep pace with it */
+			w->timeout = w->interval;
+		else
+			/* notifications are working, the timer is a backstop */
+			w->timeout = w->interval * 4;
+	} else if (w->timed_out)
+		w->timeout *= 2;
+	if (w->timeout < WATCH_MIN_MSEC)
+		w->timeout = WATCH_MIN_MSEC;
+	if (w->timeout > WATCH_MAX_MSEC)
+		w->timeout = WATCH_MAX_MSEC;
+	w->timed_out = 0;
+	w->last = *p;
+	w->have_last = 1;
+	return changed;
+}
+
+int reshape_watch_run(struct reshape_watch *w,
+		      int (*cb)(struct reshape_progress *p, void *arg),
+		      void *arg)
+{
+	/* Call 'cb' with the first reading and then after each change,
+	 * until it returns non-zero, which is then returned, or the
+	 * reshape stops, when 0 is returned.
+	 * -1 is returned if progress could not be read.
+	 */
+	struct reshape_progress p;
+	int rv;
+
+	while (1) {
+		rv = reshape_watch_read(w, &p);
+		if (rv < 0)
+			return -1;
+		if (rv && cb && (rv = cb(&p, arg)) != 0)
+			return rv;
+		if (!p.reshaping)
+			return 0;
+		reshape_watch_wait(w, NULL);
+	}
+}
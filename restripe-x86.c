@@ -0,0 +1,627 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* SSE2, AVX2 and AVX-512 versions of the restripe.c parity kernels.
+ * Each function is compiled for its own target so the rest of the
+ * library still runs on any x86 cpu; restripe.c only calls these
+ * once the matching 'valid' routine has said the cpu can.
+ * Buffers need not be aligned, and any length which is not a
+ * multiple of the vector width is finished a byte at a time.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "restripe.h"
+#include <immintrin.h>
+
+static void xor_blocks_tail(char *target, char **sources, int disks,
+			    int start, int size)
+{
+	int i, j;
+
+	for (i = start; i < size; i++) {
+		char c = 0;
+		for (j = 0; j < disks; j++)
+			c ^= sources[j][i];
+		target[i] = c;
+	}
+}
+
+static void qsyndrome_tail(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int start, int size)
+{
+	int d, z;
+	uint8_t wq, wp, wd;
+
+	for (d = start; d < size; d++) {
+		wq = wp = sources[disks-1][d];
+		for (z = disks-2; z >= 0; z--) {
+			wd = sources[z][d];
+			wp ^= wd;
+			wq = (wq << 1) ^ ((wq & 0x80) ? 0x1d : 0) ^ wd;
+		}
+		p[d] = wp;
+		q[d] = wq;
+	}
+}
+
+/* Split a GF(2^8) multiply by the constant 'c' into two 16 entry
+ * tables, one for each nibble of the other operand:
+ *   c * x == tbl[x & 0xf] ^ tbl[16 + (x >> 4)]
+ * so that a byte shuffle can do 16, 32 or 64 lookups at once
+ * instead of indexing the 64K raid6_gfmul table a byte at a time.
+ */
+static void gf_nibble_tables(uint8_t c, uint8_t tbl[32])
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		tbl[i] = raid6_gfmul[c][i];
+		tbl[16 + i] = raid6_gfmul[c][i << 4];
+	}
+}
+
+static int sse2_valid(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int ssse3_valid(void)
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int avx2_valid(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_valid(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+
+/* Each pass of the outer loop handles four vectors from every source,
+ * so that the loads of one source overlap with the xors of the last.
+ */
+__attribute__((target("sse2")))
+static void xor_blocks_sse2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		__m128i x0 = _mm_setzero_si128();
+		__m128i x1 = _mm_setzero_si128();
+		__m128i x2 = _mm_setzero_si128();
+		__m128i x3 = _mm_setzero_si128();
+
+		for (j = 0; j < disks; j++) {
+			char *s = sources[j] + i;
+			x0 = _mm_xor_si128(x0, _mm_loadu_si128((__m128i *)s));
+			x1 = _mm_xor_si128(x1, _mm_loadu_si128((__m128i *)(s+16)));
+			x2 = _mm_xor_si128(x2, _mm_loadu_si128((__m128i *)(s+32)));
+			x3 = _mm_xor_si128(x3, _mm_loadu_si128((__m128i *)(s+48)));
+		}
+		_mm_storeu_si128((__m128i *)(target + i), x0);
+		_mm_storeu_si128((__m128i *)(target + i + 16), x1);
+		_mm_storeu_si128((__m128i *)(target + i + 32), x2);
+		_mm_storeu_si128((__m128i *)(target + i + 48), x3);
+	}
+	xor_blocks_tail(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx2")))
+static void xor_blocks_avx2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 128 <= size; i += 128) {
+		__m256i x0 = _mm256_setzero_si256();
+		__m256i x1 = _mm256_setzero_si256();
+		__m256i x2 = _mm256_setzero_si256();
+		__m256i x3 = _mm256_setzero_si256();
+
+		for (j = 0; j < disks; j++) {
+			char *s = sources[j] + i;
+			x0 = _mm256_xor_si256(x0, _mm256_loadu_si256((__m256i *)s));
+			x1 = _mm256_xor_si256(x1, _mm256_loadu_si256((__m256i *)(s+32)));
+			x2 = _mm256_xor_si256(x2, _mm256_loadu_si256((__m256i *)(s+64)));
+			x3 = _mm256_xor_si256(x3, _mm256_loadu_si256((__m256i *)(s+96)));
+		}
+		_mm256_storeu_si256((__m256i *)(target + i), x0);
+		_mm256_storeu_si256((__m256i *)(target + i + 32), x1);
+		_mm256_storeu_si256((__m256i *)(target + i + 64), x2);
+		_mm256_storeu_si256((__m256i *)(target + i + 96), x3);
+	}
+	xor_blocks_tail(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void xor_blocks_avx512(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 256 <= size; i += 256) {
+		__m512i x0 = _mm512_setzero_si512();
+		__m512i x1 = _mm512_setzero_si512();
+		__m512i x2 = _mm512_setzero_si512();
+		__m512i x3 = _mm512_setzero_si512();
+
+		for (j = 0; j < disks; j++) {
+			char *s = sources[j] + i;
+			x0 = _mm512_xor_si512(x0, _mm512_loadu_si512(s));
+			x1 = _mm512_xor_si512(x1, _mm512_loadu_si512(s+64));
+			x2 = _mm512_xor_si512(x2, _mm512_loadu_si512(s+128));
+			x3 = _mm512_xor_si512(x3, _mm512_loadu_si512(s+192));
+		}
+		_mm512_storeu_si512(target + i, x0);
+		_mm512_storeu_si512(target + i + 64, x1);
+		_mm512_storeu_si512(target + i + 128, x2);
+		_mm512_storeu_si512(target + i + 192, x3);
+	}
+	xor_blocks_tail(target, sources, disks, i, size);
+}
+
+/* The Q syndrome is evaluated by Horner's rule exactly as in
+ * qsyndrome_scalar() and linux/lib/raid6/sse2.c: for each data block
+ * from the last down, Q = Q*2 + D.  Multiplying a whole vector by 2 in
+ * GF(2^8) is a byte add, with 0x1d xored into every byte whose top
+ * bit was set; that mask comes from a signed compare against zero.
+ * Two vectors are kept in flight per pass to hide the latency.
+ */
+__attribute__((target("sse2")))
+static void qsyndrome_sse2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	const __m128i poly = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	int d, z;
+
+	for (d = 0; d + 32 <= size; d += 32) {
+		__m128i wp0, wq0, wd0, w20;
+		__m128i wp1, wq1, wd1, w21;
+
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d + 16));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)(sources[z] + d));
+			wd1 = _mm_loadu_si128((__m128i *)(sources[z] + d + 16));
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			w20 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), poly);
+			w21 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), w20);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), w21);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)(p + d), wp0);
+		_mm_storeu_si128((__m128i *)(p + d + 16), wp1);
+		_mm_storeu_si128((__m128i *)(q + d), wq0);
+		_mm_storeu_si128((__m128i *)(q + d + 16), wq1);
+	}
+	qsyndrome_tail(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("avx2")))
+static void qsyndrome_avx2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	const __m256i poly = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	int d, z;
+
+	for (d = 0; d + 64 <= size; d += 64) {
+		__m256i wp0, wq0, wd0, w20;
+		__m256i wp1, wq1, wd1, w21;
+
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d + 32));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)(sources[z] + d));
+			wd1 = _mm256_loadu_si256((__m256i *)(sources[z] + d + 32));
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			w20 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0), poly);
+			w21 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), w20);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), w21);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)(p + d), wp0);
+		_mm256_storeu_si256((__m256i *)(p + d + 32), wp1);
+		_mm256_storeu_si256((__m256i *)(q + d), wq0);
+		_mm256_storeu_si256((__m256i *)(q + d + 32), wq1);
+	}
+	qsyndrome_tail(p, q, sources, disks, d, size);
+}
+
+/* With AVX-512 the top bits go straight into a mask register, which
+ * then selects 0x1d into the bytes that need the reduction.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void qsyndrome_avx512(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size)
+{
+	const __m512i poly = _mm512_set1_epi8(0x1d);
+	int d, z;
+
+	for (d = 0; d + 128 <= size; d += 128) {
+		__m512i wp0, wq0, wd0;
+		__m512i wp1, wq1, wd1;
+
+		wq0 = wp0 = _mm512_loadu_si512(sources[disks-1] + d);
+		wq1 = wp1 = _mm512_loadu_si512(sources[disks-1] + d + 64);
+		for (z = disks-2; z >= 0; z--) {
+			__mmask64 m0 = _mm512_movepi8_mask(wq0);
+			__mmask64 m1 = _mm512_movepi8_mask(wq1);
+
+			wd0 = _mm512_loadu_si512(sources[z] + d);
+			wd1 = _mm512_loadu_si512(sources[z] + d + 64);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			wq0 = _mm512_add_epi8(wq0, wq0);
+			wq1 = _mm512_add_epi8(wq1, wq1);
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+			wq0 = _mm512_xor_si512(wq0, _mm512_maskz_mov_epi8(m0, poly));
+			wq1 = _mm512_xor_si512(wq1, _mm512_maskz_mov_epi8(m1, poly));
+		}
+		_mm512_storeu_si512(p + d, wp0);
+		_mm512_storeu_si512(p + d + 64, wp1);
+		_mm512_storeu_si512(q + d, wq0);
+		_mm512_storeu_si512(q + d + 64, wq1);
+	}
+	qsyndrome_tail(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i gfmul_ssse3(__m128i x, __m128i lo, __m128i hi)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	return _mm_xor_si128(
+		_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+		_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(x, 4), mask)));
+}
+
+__attribute__((target("ssse3")))
+static void recov_2data_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dp, uint8_t *dq,
+			      uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pbt[32], qt[32];
+	__m128i pblo, pbhi, qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(pbmul, pbt);
+	gf_nibble_tables(qmul, qt);
+	pblo = _mm_loadu_si128((__m128i *)pbt);
+	pbhi = _mm_loadu_si128((__m128i *)(pbt + 16));
+	qlo = _mm_loadu_si128((__m128i *)qt);
+	qhi = _mm_loadu_si128((__m128i *)(qt + 16));
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i px, qx, db;
+
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i)),
+				   _mm_loadu_si128((__m128i *)(dp + i)));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i)),
+				   _mm_loadu_si128((__m128i *)(dq + i)));
+		qx = gfmul_ssse3(qx, qlo, qhi);
+		db = _mm_xor_si128(gfmul_ssse3(px, pblo, pbhi), qx);
+		_mm_storeu_si128((__m128i *)(dq + i), db);
+		_mm_storeu_si128((__m128i *)(dp + i), _mm_xor_si128(db, px));
+	}
+	recov_2data_scalar(bytes - i, p + i, q + i, dp + i, dq + i,
+			   pbmul, qmul);
+}
+
+__attribute__((target("ssse3")))
+static void recov_datap_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qt[32];
+	__m128i qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(qmul, qt);
+	qlo = _mm_loadu_si128((__m128i *)qt);
+	qhi = _mm_loadu_si128((__m128i *)(qt + 16));
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i qx;
+
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i)),
+				   _mm_loadu_si128((__m128i *)(dq + i)));
+		qx = gfmul_ssse3(qx, qlo, qhi);
+		_mm_storeu_si128((__m128i *)(dq + i), qx);
+		_mm_storeu_si128((__m128i *)(p + i),
+				 _mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i)), qx));
+	}
+	recov_datap_scalar(bytes - i, p + i, q + i, dq + i, qmul);
+}
+
+/* vpshufb only looks up within each 128 bit lane, so the nibble
+ * tables are broadcast into every lane.
+ */
+__attribute__((target("avx2")))
+static inline __m256i gfmul_avx2(__m256i x, __m256i lo, __m256i hi)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	return _mm256_xor_si256(
+		_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+		_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+}
+
+__attribute__((target("avx2")))
+static void recov_2data_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dp, uint8_t *dq,
+			     uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pbt[32], qt[32];
+	__m256i pblo, pbhi, qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(pbmul, pbt);
+	gf_nibble_tables(qmul, qt);
+	pblo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)pbt));
+	pbhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)(pbt + 16)));
+	qlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qt));
+	qhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)(qt + 16)));
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i px, qx, db;
+
+		px = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i)),
+				      _mm256_loadu_si256((__m256i *)(dp + i)));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i)),
+				      _mm256_loadu_si256((__m256i *)(dq + i)));
+		qx = gfmul_avx2(qx, qlo, qhi);
+		db = _mm256_xor_si256(gfmul_avx2(px, pblo, pbhi), qx);
+		_mm256_storeu_si256((__m256i *)(dq + i), db);
+		_mm256_storeu_si256((__m256i *)(dp + i), _mm256_xor_si256(db, px));
+	}
+	recov_2data_scalar(bytes - i, p + i, q + i, dp + i, dq + i,
+			   pbmul, qmul);
+}
+
+__attribute__((target("avx2")))
+static void recov_datap_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qt[32];
+	__m256i qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(qmul, qt);
+	qlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)qt));
+	qhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)(qt + 16)));
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i qx;
+
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i)),
+				      _mm256_loadu_si256((__m256i *)(dq + i)));
+		qx = gfmul_avx2(qx, qlo, qhi);
+		_mm256_storeu_si256((__m256i *)(dq + i), qx);
+		_mm256_storeu_si256((__m256i *)(p + i),
+				    _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i)), qx));
+	}
+	recov_datap_scalar(bytes - i, p + i, q + i, dq + i, qmul);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i gfmul_avx512(__m512i x, __m512i lo, __m512i hi)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+
+	return _mm512_xor_si512(
+		_mm512_shuffle_epi8(lo, _mm512_and_si512(x, mask)),
+		_mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(x, 4), mask)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void recov_2data_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dp, uint8_t *dq,
+			       uint8_t pbmul, uint8_t qmul)
+{
+	uint8_t pbt[32], qt[32];
+	__m512i pblo, pbhi, qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(pbmul, pbt);
+	gf_nibble_tables(qmul, qt);
+	pblo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)pbt));
+	pbhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)(pbt + 16)));
+	qlo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qt));
+	qhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)(qt + 16)));
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		__m512i px, qx, db;
+
+		px = _mm512_xor_si512(_mm512_loadu_si512(p + i),
+				      _mm512_loadu_si512(dp + i));
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		qx = gfmul_avx512(qx, qlo, qhi);
+		db = _mm512_xor_si512(gfmul_avx512(px, pblo, pbhi), qx);
+		_mm512_storeu_si512(dq + i, db);
+		_mm512_storeu_si512(dp + i, _mm512_xor_si512(db, px));
+	}
+	recov_2data_scalar(bytes - i, p + i, q + i, dp + i, dq + i,
+			   pbmul, qmul);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void recov_datap_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dq, uint8_t qmul)
+{
+	uint8_t qt[32];
+	__m512i qlo, qhi;
+	size_t i;
+
+	gf_nibble_tables(qmul, qt);
+	qlo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)qt));
+	qhi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i *)(qt + 16)));
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		__m512i qx;
+
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q + i),
+				      _mm512_loadu_si512(dq + i));
+		qx = gfmul_avx512(qx, qlo, qhi);
+		_mm512_storeu_si512(dq + i, qx);
+		_mm512_storeu_si512(p + i,
+				    _mm512_xor_si512(_mm512_loadu_si512(p + i), qx));
+	}
+	recov_datap_scalar(bytes - i, p + i, q + i, dq + i, qmul);
+}
+
+/* Comparing P and Q against the parity read from disk, for
+ * raid6_check_disks().  Almost everything compares equal, so whole
+ * blocks are or-ed together and tested at once; only the block that
+ * differs is looked at a byte at a time.
+ */
+__attribute__((target("sse2")))
+static size_t pq_diff_sse2(const uint8_t *p, const uint8_t *dp,
+			   const uint8_t *q, const uint8_t *dq, size_t bytes)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m128i x0, x1;
+
+		x0 = _mm_or_si128(
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i)),
+				      _mm_loadu_si128((__m128i *)(dp + i))),
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i)),
+				      _mm_loadu_si128((__m128i *)(dq + i))));
+		x1 = _mm_or_si128(
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(p + i + 16)),
+				      _mm_loadu_si128((__m128i *)(dp + i + 16))),
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(q + i + 16)),
+				      _mm_loadu_si128((__m128i *)(dq + i + 16))));
+		x0 = _mm_cmpeq_epi8(_mm_or_si128(x0, x1), _mm_setzero_si128());
+		if (_mm_movemask_epi8(x0) != 0xffff)
+			break;
+	}
+	return i + pq_diff_scalar(p + i, dp + i, q + i, dq + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static size_t pq_diff_avx2(const uint8_t *p, const uint8_t *dp,
+			   const uint8_t *q, const uint8_t *dq, size_t bytes)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		__m256i x0, x1;
+
+		x0 = _mm256_or_si256(
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i)),
+					 _mm256_loadu_si256((__m256i *)(dp + i))),
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i)),
+					 _mm256_loadu_si256((__m256i *)(dq + i))));
+		x1 = _mm256_or_si256(
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(p + i + 32)),
+					 _mm256_loadu_si256((__m256i *)(dp + i + 32))),
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(q + i + 32)),
+					 _mm256_loadu_si256((__m256i *)(dq + i + 32))));
+		x0 = _mm256_or_si256(x0, x1);
+		if (!_mm256_testz_si256(x0, x0))
+			break;
+	}
+	return i + pq_diff_scalar(p + i, dp + i, q + i, dq + i, bytes - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t pq_diff_avx512(const uint8_t *p, const uint8_t *dp,
+			     const uint8_t *q, const uint8_t *dq, size_t bytes)
+{
+	size_t i;
+
+	for (i = 0; i + 128 <= bytes; i += 128) {
+		__m512i x0, x1;
+
+		x0 = _mm512_ternarylogic_epi64(
+			_mm512_loadu_si512(p + i), _mm512_loadu_si512(dp + i),
+			_mm512_xor_si512(_mm512_loadu_si512(q + i),
+					 _mm512_loadu_si512(dq + i)),
+			0xbe);	/* (a ^ b) | c */
+		x1 = _mm512_ternarylogic_epi64(
+			_mm512_loadu_si512(p + i + 64),
+			_mm512_loadu_si512(dp + i + 64),
+			_mm512_xor_si512(_mm512_loadu_si512(q + i + 64),
+					 _mm512_loadu_si512(dq + i + 64)),
+			0xbe);
+		if (_mm512_test_epi64_mask(_mm512_or_si512(x0, x1),
+					   _mm512_or_si512(x0, x1)))
+			break;
+	}
+	return i + pq_diff_scalar(p + i, dp + i, q + i, dq + i, bytes - i);
+}
+
+const struct restripe_calls restripe_sse2 = {
+	xor_blocks_sse2,
+	qsyndrome_sse2,
+	recov_2data_scalar,
+	recov_datap_scalar,
+	pq_diff_sse2,
+	sse2_valid,
+	"sse2",
+};
+
+/* SSSE3 adds nothing for xor or Q, but gives us pshufb for recovery */
+const struct restripe_calls restripe_ssse3 = {
+	xor_blocks_sse2,
+	qsyndrome_sse2,
+	recov_2data_ssse3,
+	recov_datap_ssse3,
+	pq_diff_sse2,
+	ssse3_valid,
+	"ssse3",
+};
+
+const struct restripe_calls restripe_avx2 = {
+	xor_blocks_avx2,
+	qsyndrome_avx2,
+	recov_2data_avx2,
+	recov_datap_avx2,
+	pq_diff_avx2,
+	avx2_valid,
+	"avx2",
+};
+
+const struct restripe_calls restripe_avx512 = {
+	xor_blocks_avx512,
+	qsyndrome_avx512,
+	recov_2data_avx512,
+	recov_datap_avx512,
+	pq_diff_avx512,
+	avx512_valid,
+	"avx512",
+};
+
+#endif /* __x86_64__ || __i386__ */
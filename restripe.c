@@ -23,7 +23,9 @@
  */
 
 #include "mdadm.h"
+#include "restripe.h"
 #include <stdint.h>
+#include <sys/mman.h>
 
 /* To restripe, we read from old geometry to a buffer, and
  * read from buffer to new geometry.
@@ -194,6 +196,71 @@ int geo_map(int block, unsigned long long stripe, int raid_disks,
 	}
 	return -1;
 }
+/* Number of stripes after which the layout repeats */
+static int geo_period(int raid_disks, int level, int layout)
+{
+	if (level == 0 || level == 4)
+		return 1;
+	if (level == 6 && layout >= ALGORITHM_LEFT_ASYMMETRIC_6)
+		/* rotates over all but the Q disk */
+		return raid_disks > 1 ? raid_disks - 1 : 1;
+	return raid_disks;
+}
+
+/* Build the answers geo_map() would give for every block of every
+ * stripe in one period of the layout, so that the per-stripe loops can
+ * look them up rather than going through the switch each time.
+ * Returns NULL if memory is short.
+ */
+struct geo_table *geo_table_create(int raid_disks, int level, int layout)
+{
+	struct geo_table *gt;
+	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	int stripe, i;
+
+	if (data_disks < 1)
+		return NULL;
+	gt = calloc(1, sizeof(*gt));
+	if (!gt)
+		return NULL;
+	gt->raid_disks = raid_disks;
+	gt->data_disks = data_disks;
+	gt->period = geo_period(raid_disks, level, layout);
+	gt->disk = calloc((size_t)gt->period * (data_disks + 2), sizeof(int));
+	gt->block = calloc((size_t)gt->period * raid_disks, sizeof(int));
+	if (!gt->disk || !gt->block) {
+		geo_table_free(gt);
+		return NULL;
+	}
+
+	for (stripe = 0; stripe < gt->period; stripe++) {
+		int *disk = gt->disk + stripe * (data_disks + 2) + 2;
+		int *block = gt->block + stripe * raid_disks;
+
+		for (i = -2; i < data_disks; i++)
+			disk[i] = geo_map(i, stripe, raid_disks, level, layout);
+		for (i = 0; i < raid_disks; i++)
+			block[i] = GEO_NO_BLOCK;
+		if (level >= 4 && disk[-1] >= 0 && disk[-1] < raid_disks)
+			block[disk[-1]] = -1;
+		if (level == 6 && disk[-2] >= 0 && disk[-2] < raid_disks)
+			block[disk[-2]] = -2;
+		for (i = 0; i < data_disks; i++)
+			if (disk[i] >= 0 && disk[i] < raid_disks)
+				block[disk[i]] = i;
+	}
+	return gt;
+}
+
+void geo_table_free(struct geo_table *gt)
+{
+	if (!gt)
+		return;
+	free(gt->disk);
+	free(gt->block);
+	free(gt);
+}
+
 static int is_ddf(int layout)
 {
 	switch (layout)
@@ -207,7 +274,7 @@ static int is_ddf(int layout)
 	}
 }
 
-void xor_blocks(char *target, char **sources, int disks, int size)
+static void xor_blocks_scalar(char *target, char **sources, int disks, int size)
 {
 	int i, j;
 	/* Amazingly inefficient... */
@@ -219,7 +286,8 @@ void xor_blocks(char *target, char **sources, int disks, int size)
 	}
 }
 
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+static void qsyndrome_scalar(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size)
 {
 	int d, z;
 	uint8_t wq0, wp0, wd0, w10, w20;
@@ -239,106 +307,156 @@ void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 	}
 }
 
-/*
- * The following was taken from linux/drivers/md/mktables.c, and modified
- * to create in-memory tables rather than C code
+/* The per-byte part of raid6_2data_recov() and raid6_datap_recov(),
+ * after the syndrome of the surviving blocks has been left in dp/dq.
+ * 'pbmul' and 'qmul' are the GF(2^8) constants to multiply by.
  */
-static uint8_t gfmul(uint8_t a, uint8_t b)
+void recov_2data_scalar(size_t bytes, uint8_t *p, uint8_t *q,
+			uint8_t *dp, uint8_t *dq, uint8_t pbmul, uint8_t qmul)
 {
-	uint8_t v = 0;
+	const uint8_t *pbtbl = raid6_gfmul[pbmul];
+	const uint8_t *qtbl = raid6_gfmul[qmul];
+	uint8_t px, qx, db;
 
-	while (b) {
-		if (b & 1)
-			v ^= a;
-		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
-		b >>= 1;
+	while ( bytes-- ) {
+		px    = *p ^ *dp;
+		qx    = qtbl[*q ^ *dq];
+		*dq++ = db = pbtbl[px] ^ qx; /* Reconstructed B */
+		*dp++ = db ^ px; /* Reconstructed A */
+		p++; q++;
 	}
+}
+
+void recov_datap_scalar(size_t bytes, uint8_t *p, uint8_t *q,
+			uint8_t *dq, uint8_t qmul)
+{
+	const uint8_t *qtbl = raid6_gfmul[qmul];
 
-	return v;
+	while ( bytes-- ) {
+		*p++ ^= *dq = qtbl[*q ^ *dq];
+		q++; dq++;
+	}
 }
 
-static uint8_t gfpow(uint8_t a, int b)
+/* Return the offset of the first byte at which p differs from dp or
+ * q from dq, or 'bytes' if they all match.
+ */
+size_t pq_diff_scalar(const uint8_t *p, const uint8_t *dp,
+		      const uint8_t *q, const uint8_t *dq, size_t bytes)
 {
-	uint8_t v = 1;
+	size_t i;
 
-	b %= 255;
-	if (b < 0)
-		b += 255;
+	for (i = 0; i < bytes; i++)
+		if (p[i] != dp[i] || q[i] != dq[i])
+			break;
+	return i;
+}
 
-	while (b) {
-		if (b & 1)
-			v = gfmul(v, a);
-		a = gfmul(a, a);
-		b >>= 1;
-	}
+static int scalar_valid(void)
+{
+	return 1;
+}
+
+const struct restripe_calls restripe_scalar = {
+	xor_blocks_scalar,
+	qsyndrome_scalar,
+	recov_2data_scalar,
+	recov_datap_scalar,
+	pq_diff_scalar,
+	scalar_valid,
+	"scalar",
+};
+
+const struct restripe_calls *const restripe_calls_list[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	&restripe_avx512,
+	&restripe_avx2,
+	&restripe_ssse3,
+	&restripe_sse2,
+#endif
+	&restripe_scalar,
+	NULL
+};
+
+static const struct restripe_calls *raid_calls = &restripe_scalar;
+
+/* Pick the best routine set for this cpu.  This runs when the
+ * library is loaded so the choice is made exactly once, before
+ * anyone can call save_stripes() or restore_stripes().
+ */
+__attribute__((constructor))
+static void restripe_calls_init(void)
+{
+	const struct restripe_calls *const *c;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+#endif
+	for (c = restripe_calls_list; *c; c++)
+		if ((*c)->valid()) {
+			raid_calls = *c;
+			break;
+		}
+}
 
-	return v;
+const struct restripe_calls *restripe_calls_get(void)
+{
+	return raid_calls;
 }
 
-int tables_ready = 0;
-uint8_t raid6_gfmul[256][256];
-uint8_t raid6_gfexp[256];
-uint8_t raid6_gfinv[256];
-uint8_t raid6_gfexi[256];
-uint8_t raid6_gflog[256];
-uint8_t raid6_gfilog[256];
-void make_tables(void)
+/* Force a particular routine set, e.g. for benchmarking.
+ * Returns 0 on success, -1 if 'name' is unknown or the cpu
+ * cannot run it.
+ */
+int restripe_calls_select(const char *name)
 {
-	int i, j;
-	uint8_t v;
-	uint32_t b, log;
-
-	/* Compute multiplication table */
-	for (i = 0; i < 256; i++)
-		for (j = 0; j < 256; j++)
-				raid6_gfmul[i][j] = gfmul(i, j);
-
-	/* Compute power-of-2 table (exponent) */
-	v = 1;
-	for (i = 0; i < 256; i++) {
-		raid6_gfexp[i] = v;
-		v = gfmul(v, 2);
-		if (v == 1)
-			v = 0;	/* For entry 255, not a real entry */
-	}
-
-	/* Compute inverse table x^-1 == x^254 */
-	for (i = 0; i < 256; i++)
-		raid6_gfinv[i] = gfpow(i, 254);
-
-	/* Compute inv(2^x + 1) (exponent-xor-inverse) table */
-	for (i = 0; i < 256; i ++)
-		raid6_gfexi[i] = raid6_gfinv[raid6_gfexp[i] ^ 1];
-
-	/* Compute log and inverse log */
-	/* Modified code from:
-	 *    http://web.eecs.utk.edu/~plank/plank/papers/CS-96-332.html
-	 */
-	b = 1;
-	raid6_gflog[0] = 0;
-	raid6_gfilog[255] = 0;
+	const struct restripe_calls *const *c;
 
-	for (log = 0; log < 255; log++) {
-		raid6_gflog[b] = (uint8_t) log;
-		raid6_gfilog[log] = (uint8_t) b;
-		b = b << 1;
-		if (b & 256) b = b ^ 0435;
-	}
+	for (c = restripe_calls_list; *c; c++)
+		if (strcmp((*c)->name, name) == 0) {
+			if (!(*c)->valid())
+				return -1;
+			raid_calls = *c;
+			return 0;
+		}
+	return -1;
+}
+
+void xor_blocks(char *target, char **sources, int disks, int size)
+{
+	raid_calls->xor_blocks(target, sources, disks, size);
+}
 
-	tables_ready = 1;
+void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	raid_calls->qsyndrome(p, q, sources, disks, size);
 }
 
+/* A read-only block of zeros as large as any chunk.  It is mapped once
+ * and never moved or freed, so threads can share it freely, and until
+ * it is read it costs only address space.
+ */
+#define ZERO_MAX	(64 << 20)
 uint8_t *zero;
-int zero_size;
 
-void ensure_zero_has_size(int chunk_size)
+int ensure_zero_has_size(int chunk_size)
 {
-	if (zero == NULL || chunk_size > zero_size) {
-		if (zero)
-			free(zero);
-		zero = xcalloc(1, chunk_size);
-		zero_size = chunk_size;
-	}
+	uint8_t *z = __atomic_load_n(&zero, __ATOMIC_ACQUIRE);
+	uint8_t *none = NULL;
+
+	if (chunk_size > ZERO_MAX)
+		return -1;
+	if (z)
+		return 0;
+	z = mmap(NULL, ZERO_MAX, PROT_READ,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (z == MAP_FAILED)
+		return -1;
+	/* Another thread may have got there first */
+	if (!__atomic_compare_exchange_n(&zero, &none, z, 0, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE))
+		munmap(z, ZERO_MAX);
+	return 0;
 }
 
 /* Following was taken from linux/drivers/md/raid6recov.c */
@@ -348,9 +466,8 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 		       uint8_t **ptrs)
 {
 	uint8_t *p, *q, *dp, *dq;
-	uint8_t px, qx, db;
-	const uint8_t *pbmul;	/* P multiplier table for B data */
-	const uint8_t *qmul;		/* Q multiplier table (for both) */
+	uint8_t pbmul;		/* P multiplier for B data */
+	uint8_t qmul;		/* Q multiplier (for both) */
 
 	p = ptrs[disks-2];
 	q = ptrs[disks-1];
@@ -369,25 +486,19 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 	ptrs[faila]   = dp;
 	ptrs[failb]   = dq;
 
-	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[failb-faila]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
+	/* Now, pick the proper multipliers */
+	pbmul = raid6_gfexi[failb-faila];
+	qmul  = raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		px    = *p ^ *dp;
-		qx    = qmul[*q ^ *dq];
-		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
-		*dp++ = db ^ px; /* Reconstructed A */
-		p++; q++;
-	}
+	raid_calls->recov_2data(bytes, p, q, dp, dq, pbmul, qmul);
 }
 
 /* Recover failure of one data block plus the P block */
 void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
 {
 	uint8_t *p, *q, *dq;
-	const uint8_t *qmul;		/* Q multiplier table */
+	uint8_t qmul;		/* Q multiplier */
 
 	p = ptrs[disks-2];
 	q = ptrs[disks-1];
@@ -402,73 +513,316 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
 	/* Restore pointer table */
 	ptrs[faila]   = dq;
 
-	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+	/* Now, pick the proper multiplier */
+	qmul  = raid6_gfinv[raid6_gfexp[faila]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		*p++ ^= *dq = qmul[*q ^ *dq];
-		q++; dq++;
+	raid_calls->recov_datap(bytes, p, q, dq, qmul);
+}
+
+/* Map a position in the Q syndrome, as computed by the kernel, back to
+ * the device holding that block.  Returns raid_disks if there is no
+ * such data block.
+ */
+static int raid6_syndrome_disk(int data_id, int raid_disks, int layout,
+			       int diskP, int diskQ)
+{
+	int d;
+
+	if (is_ddf(layout)) {
+		if (data_id >= raid_disks || data_id == diskP ||
+		    data_id == diskQ)
+			return raid_disks;
+		return data_id;
 	}
+	for (d = (diskQ + 1) % raid_disks; d != diskQ;
+	     d = (d + 1) % raid_disks) {
+		if (d == diskP)
+			continue;
+		if (data_id-- == 0)
+			return d;
+	}
+	return raid_disks;
 }
 
-/* Try to find out if a specific disk has a problem */
-int raid6_check_disks(int data_disks, int start, int chunk_size,
-		      int level, int layout, int diskP, int diskQ,
+/* Bytes examined one at a time around each difference found by pq_diff */
+#define CHECK_BLOCK 64
+
+/* Try to find out if a specific disk has a problem.
+ * Stretches where both P and Q match cannot change the answer, so they
+ * are skipped with the vectorized pq_diff, and the per-byte analysis
+ * is only done on blocks which differ.
+ */
+int raid6_check_disks(int data_disks, unsigned long long start,
+		      int chunk_size, int level, int layout, int diskP, int diskQ,
 		      char *p, char *q, char **stripes)
 {
-	int i;
+	uint8_t *dp = (uint8_t*)stripes[diskP];
+	uint8_t *dq = (uint8_t*)stripes[diskQ];
+	int i, end;
 	int data_id, diskD;
 	uint8_t Px, Qx;
 	int curr_broken_disk = -1;
 	int prev_broken_disk = -1;
 	int broken_status = 0;
 
-	for(i = 0; i < chunk_size; i++) {
-		Px = (uint8_t)stripes[diskP][i] ^ (uint8_t)p[i];
-		Qx = (uint8_t)stripes[diskQ][i] ^ (uint8_t)q[i];
+	for (i = 0; i < chunk_size; i = end) {
+		i += raid_calls->pq_diff((uint8_t*)p + i, dp + i,
+					 (uint8_t*)q + i, dq + i,
+					 chunk_size - i);
+		end = i + CHECK_BLOCK;
+		if (end > chunk_size)
+			end = chunk_size;
+
+		for (; i < end; i++) {
+			Px = dp[i] ^ (uint8_t)p[i];
+			Qx = dq[i] ^ (uint8_t)q[i];
+
+			if((Px != 0) && (Qx == 0))
+				curr_broken_disk = diskP;
+
+			if((Px == 0) && (Qx != 0))
+				curr_broken_disk = diskQ;
+
+			if((Px != 0) && (Qx != 0)) {
+				data_id = (raid6_gflog[Qx] - raid6_gflog[Px]);
+				if(data_id < 0) data_id += 255;
+				diskD = raid6_syndrome_disk(data_id,
+							    data_disks + 2,
+							    layout,
+							    diskP, diskQ);
+				curr_broken_disk = diskD;
+			}
 
-		if((Px != 0) && (Qx == 0))
-			curr_broken_disk = diskP;
+			if(curr_broken_disk >= data_disks + 2)
+				broken_status = 2;
 
-		if((Px == 0) && (Qx != 0))
-			curr_broken_disk = diskQ;
+			switch(broken_status) {
+			case 0:
+				if(curr_broken_disk != -1) {
+					prev_broken_disk = curr_broken_disk;
+					broken_status = 1;
+				}
+				break;
 
-		if((Px != 0) && (Qx != 0)) {
-			data_id = (raid6_gflog[Qx] - raid6_gflog[Px]);
-			if(data_id < 0) data_id += 255;
-			diskD = geo_map(data_id, start/chunk_size,
-					data_disks + 2, level, layout);
-			curr_broken_disk = diskD;
+			case 1:
+				if(curr_broken_disk != prev_broken_disk)
+					broken_status = 2;
+				break;
+
+			case 2:
+			default:
+				/* Nothing later can change this */
+				return -2;
+			}
 		}
+	}
 
-		if((Px == 0) && (Qx == 0))
-			curr_broken_disk = curr_broken_disk;
+	return curr_broken_disk;
+}
+
+/* One stripe on its way through save_stripes() or restore_stripes().
+ * 'blocks' are in logical order: data blocks first, then P, then Q.
+ * While one slot is being reconstructed or having its parity computed,
+ * the I/O for the other slot is in flight.
+ */
+struct stripe_slot {
+	char **blocks;
+	int *dnum;		/* physical disk for each block */
+	struct stripe_io_req *reqs;
+	struct stripe_io_batch batch;
+	char *buf;		/* storage owned by this slot, or NULL */
+};
+
+static void free_stripe_slots(struct stripe_slot *slots, int nslots)
+{
+	int s;
 
-		if(curr_broken_disk >= data_disks + 2)
-			broken_status = 2;
+	for (s = 0; s < nslots; s++) {
+		free(slots[s].blocks);
+		free(slots[s].dnum);
+		free(slots[s].reqs);
+		free(slots[s].buf);
+	}
+}
 
-		switch(broken_status) {
-		case 0:
-			if(curr_broken_disk != -1) {
-				prev_broken_disk = curr_broken_disk;
-				broken_status = 1;
+/* Give each slot room for 'raid_disks' blocks and 'nbufs' chunks of
+ * its own storage.  Returns -1 on allocation failure.
+ */
+static int alloc_stripe_slots(struct stripe_slot *slots, int nslots,
+			      int raid_disks, int chunk_size, int nbufs)
+{
+	int s, i;
+
+	memset(slots, 0, nslots * sizeof(*slots));
+	for (s = 0; s < nslots; s++) {
+		struct stripe_slot *sl = &slots[s];
+		sl->blocks = calloc(raid_disks, sizeof(char*));
+		sl->dnum = calloc(raid_disks, sizeof(int));
+		sl->reqs = calloc(raid_disks, sizeof(struct stripe_io_req));
+		if (!sl->blocks || !sl->dnum || !sl->reqs)
+			return -1;
+		if (nbufs &&
+		    posix_memalign((void**)&sl->buf, 4096,
+				   (size_t)nbufs * chunk_size)) {
+			sl->buf = NULL;
+			return -1;
+		}
+		for (i = 0; i < nbufs && i < raid_disks; i++)
+			sl->blocks[raid_disks - nbufs + i] =
+				sl->buf + (size_t)i * chunk_size;
+		sl->batch.reqs = sl->reqs;
+	}
+	return 0;
+}
+
+/* Start reading every block of the stripe holding 'start' into the
+ * slot's blocks.
+ */
+static void save_stripe_submit(struct stripe_io *sio, struct stripe_slot *sl,
+			       int *source, unsigned long long *offsets,
+			       int raid_disks, int chunk_size,
+			       const struct geo_table *gt, int data_disks,
+			       unsigned long long start)
+{
+	unsigned long long stripe = start/chunk_size/data_disks;
+	unsigned long long offset = stripe * chunk_size;
+	const int *map = geo_table_disks(gt, stripe);
+	int disk;
+
+	for (disk = 0; disk < raid_disks ; disk++) {
+		struct stripe_io_req *req = &sl->reqs[disk];
+		int dnum;
+
+		dnum = map[disk < data_disks ? disk : data_disks - disk - 1];
+		if (dnum < 0) abort();
+		sl->dnum[disk] = dnum;
+		req->fd = source[dnum];
+		req->op = STRIPE_IO_READ;
+		req->buf = sl->blocks[disk];
+		req->len = chunk_size;
+		req->offset = offsets[dnum] + offset;
+	}
+	sl->batch.nreqs = raid_disks;
+	stripe_io_submit(sio, &sl->batch);
+}
+
+/* Rebuild any data blocks of a stripe which could not be read.
+ * Returns 0 on success, -1 if too many blocks are missing.
+ */
+static int save_stripe_recover(struct stripe_slot *sl,
+			       int raid_disks, int chunk_size,
+			       int level, int layout, int data_disks,
+			       const struct geo_table *gt,
+			       unsigned long long start)
+{
+	unsigned long long stripe = start/chunk_size/data_disks;
+	char **blocks = sl->blocks;
+	int failed = 0;
+	int fdisk[3], fblock[3];
+	int disk;
+	int i;
+
+	for (disk = 0; disk < raid_disks ; disk++)
+		if (sl->reqs[disk].err)
+			if (failed <= 2) {
+				fdisk[failed] = sl->dnum[disk];
+				fblock[failed] = disk;
+				failed++;
 			}
-			break;
 
-		case 1:
-			if(curr_broken_disk != prev_broken_disk)
-				broken_status = 2;
-			break;
+	if (failed == 0 || fblock[0] >= data_disks)
+		/* all data disks are good */
+		;
+	else if (failed == 1 || fblock[1] >= data_disks+1) {
+		/* one failed data disk and good parity */
+		char *bufs[data_disks];
+		for (i=0; i < data_disks; i++)
+			if (fblock[0] == i)
+				bufs[i] = blocks[data_disks];
+			else
+				bufs[i] = blocks[i];
+
+		xor_blocks(blocks[fblock[0]],
+			   bufs, data_disks, chunk_size);
+	} else if (failed > 2 || level != 6)
+		/* too much failure */
+		return -1;
+	else {
+		/* RAID6 computations needed. */
+		uint8_t *bufs[data_disks+4];
+		int qdisk;
+		int syndrome_disks;
+		const int *map = geo_table_disks(gt, stripe);
+		disk = map[-1];
+		qdisk = map[-2];
+		if (is_ddf(layout)) {
+			/* q over 'raid_disks' blocks, in device order.
+			 * 'p' and 'q' get to be all zero
+			 */
+			for (i = 0; i < raid_disks; i++)
+				bufs[i] = zero;
+			for (i = 0; i < data_disks; i++) {
+				int dnum = map[i];
+				int snum;
+				/* i is the logical block number, so is index to 'blocks'.
+				 * dnum is physical disk number
+				 * and thus the syndrome number.
+				 */
+				snum = dnum;
+				bufs[snum] = (uint8_t*)blocks[i];
+			}
+			syndrome_disks = raid_disks;
+		} else {
+			/* for md, q is over 'data_disks' blocks,
+			 * starting immediately after 'q'
+			 * Note that for the '_6' variety, the p block
+			 * makes a hole that we need to be careful of.
+			 */
+			const int *dblock = geo_table_blocks(gt, stripe);
+			int j;
+			int snum = 0;
+			for (j = 0; j < raid_disks; j++) {
+				int dnum = (qdisk + 1 + j) % raid_disks;
+				if (dnum == disk || dnum == qdisk)
+					continue;
+				i = dblock[dnum];
+				/* i is the logical block number, so is index to 'blocks'.
+				 * dnum is physical disk number
+				 * snum is syndrome disk for which 0 is immediately after Q
+				 */
+				bufs[snum] = (uint8_t*)blocks[i];
 
-		case 2:
-		default:
-			curr_broken_disk = prev_broken_disk = -2;
-			break;
+				if (fblock[0] == i)
+					fdisk[0] = snum;
+				if (fblock[1] == i)
+					fdisk[1] = snum;
+				snum++;
+			}
+
+			syndrome_disks = data_disks;
 		}
-	}
 
-	return curr_broken_disk;
+		/* Place P and Q blocks at end of bufs */
+		bufs[syndrome_disks] = (uint8_t*)blocks[data_disks];
+		bufs[syndrome_disks+1] = (uint8_t*)blocks[data_disks+1];
+
+		if (fblock[1] == data_disks)
+			/* One data failed, and parity failed */
+			raid6_datap_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], bufs);
+		else {
+			if (fdisk[0] > fdisk[1]) {
+				int t = fdisk[0];
+				fdisk[0] = fdisk[1];
+				fdisk[1] = t;
+			}
+			/* Two data blocks failed, P,Q OK */
+			raid6_2data_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], fdisk[1], bufs);
+		}
+	}
+	return 0;
 }
 
 /*******************************************************************************
@@ -476,6 +830,9 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
  * Description:
  *	Function reads data (only data without P and Q) from array and writes
  * it to buf and opcjonaly to backup files
+ *	The blocks of each stripe are read from all devices in parallel,
+ * and the next stripe is read while the current one is reconstructed
+ * and written out.
  * Parameters:
  *	source		: A list of 'fds' of the active disks.
  *			  Some may be absent
@@ -508,13 +865,21 @@ int save_stripes(int *source, unsigned long long *offsets,
 {
 	int len;
 	int data_disks = raid_disks - (level == 0 ? 0 : level <=5 ? 1 : 2);
-	int disk;
 	int i;
 	unsigned long long length_test;
-
-	if (!tables_ready)
-		make_tables();
-	ensure_zero_has_size(chunk_size);
+	unsigned long long nstripes, s;
+	struct stripe_slot slots[2];
+	struct stripe_io *sio;
+	struct geo_table *gt;
+	/* backup writes, one batch per slot */
+	struct stripe_io_req *wreqs[2] = { NULL, NULL };
+	struct stripe_io_batch wbatch[2];
+	unsigned long long *dpos = NULL;
+	int rv = 0;
+
+	if (ensure_zero_has_size(chunk_size))
+		return -1;
+	memset(wbatch, 0, sizeof(wbatch));
 
 	len = data_disks * chunk_size;
 	length_test = length / len;
@@ -528,137 +893,184 @@ int save_stripes(int *source, unsigned long long *offsets,
 			length_test);
 		abort();
 	}
+	nstripes = length / len;
+	if (nstripes == 0)
+		return 0;
 
-	while (length > 0) {
-		int failed = 0;
-		int fdisk[3], fblock[3];
-		for (disk = 0; disk < raid_disks ; disk++) {
-			unsigned long long offset;
-			int dnum;
-
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
-			if (source[dnum] < 0 ||
-			    lseek64(source[dnum], offsets[dnum]+offset, 0) < 0 ||
-			    read(source[dnum], buf+disk * chunk_size, chunk_size)
-			    != chunk_size)
-				if (failed <= 2) {
-					fdisk[failed] = dnum;
-					fblock[failed] = disk;
-					failed++;
-				}
+	/* The backups are written with positioned writes, so note where
+	 * each one is now and leave it just past what we wrote.
+	 */
+	if (dest) {
+		dpos = xcalloc(nwrites, sizeof(*dpos));
+		for (i = 0; i < nwrites; i++) {
+			off64_t pos = lseek64(dest[i], 0, SEEK_CUR);
+			if (pos < 0) {
+				free(dpos);
+				return -1;
+			}
+			dpos[i] = pos;
 		}
-		if (failed == 0 || fblock[0] >= data_disks)
-			/* all data disks are good */
-			;
-		else if (failed == 1 || fblock[1] >= data_disks+1) {
-			/* one failed data disk and good parity */
-			char *bufs[data_disks];
-			for (i=0; i < data_disks; i++)
-				if (fblock[0] == i)
-					bufs[i] = buf + data_disks*chunk_size;
-				else
-					bufs[i] = buf + i*chunk_size;
+	}
 
-			xor_blocks(buf + fblock[0]*chunk_size,
-				   bufs, data_disks, chunk_size);
-		} else if (failed > 2 || level != 6)
-			/* too much failure */
-			return -1;
-		else {
-			/* RAID6 computations needed. */
-			uint8_t *bufs[data_disks+4];
-			int qdisk;
-			int syndrome_disks;
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					bufs[i] = zero;
-				for (i = 0; i < data_disks; i++) {
-					int dnum = geo_map(i,
-							   start/chunk_size/data_disks,
-							   raid_disks, level, layout);
-					int snum;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * and thus the syndrome number.
-					 */
-					snum = dnum;
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-				}
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 * Note that for the '_6' variety, the p block
-				 * makes a hole that we need to be careful of.
-				 */
-				int j;
-				int snum = 0;
-				for (j = 0; j < raid_disks; j++) {
-					int dnum = (qdisk + 1 + j) % raid_disks;
-					if (dnum == disk || dnum == qdisk)
-						continue;
-					for (i = 0; i < data_disks; i++)
-						if (geo_map(i,
-							    start/chunk_size/data_disks,
-							    raid_disks, level, layout) == dnum)
-							break;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * snum is syndrome disk for which 0 is immediately after Q
-					 */
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-
-					if (fblock[0] == i)
-						fdisk[0] = snum;
-					if (fblock[1] == i)
-						fdisk[1] = snum;
-					snum++;
-				}
+	/* When writing to 'dest' each slot needs its own copy of the
+	 * data, else the data goes straight to its place in 'buf'.
+	 * P and Q always live in the slot.
+	 */
+	gt = geo_table_create(raid_disks, level, layout);
+	if (!gt ||
+	    alloc_stripe_slots(slots, 2, raid_disks, chunk_size,
+			       dest ? raid_disks : raid_disks - data_disks)) {
+		free_stripe_slots(slots, 2);
+		geo_table_free(gt);
+		free(dpos);
+		return -1;
+	}
+	for (i = 0; dest && i < 2; i++) {
+		wreqs[i] = xcalloc(nwrites, sizeof(struct stripe_io_req));
+		wbatch[i].reqs = wreqs[i];
+	}
+	sio = stripe_io_create(raid_disks > nwrites ? raid_disks : nwrites);
 
-				syndrome_disks = data_disks;
+	for (s = 0; s < nstripes; s++) {
+		struct stripe_slot *sl = &slots[s % 2];
+		if (!dest)
+			for (i = 0; i < data_disks; i++)
+				sl->blocks[i] = buf + s * len + i * chunk_size;
+		if (s == 0)
+			save_stripe_submit(sio, sl, source, offsets,
+					   raid_disks, chunk_size,
+					   gt, data_disks, start);
+		stripe_io_wait(sio, &sl->batch);
+
+		/* Start on the next stripe before working on this one,
+		 * once the previous stripe has been written out of the
+		 * slot it will use.
+		 */
+		if (s + 1 < nstripes) {
+			struct stripe_slot *next = &slots[(s + 1) % 2];
+			if (dest && stripe_io_wait(sio, &wbatch[(s + 1) % 2])) {
+				rv = -1;
+				break;
 			}
+			if (!dest)
+				for (i = 0; i < data_disks; i++)
+					next->blocks[i] = buf + (s + 1) * len +
+						i * chunk_size;
+			save_stripe_submit(sio, next, source, offsets,
+					   raid_disks, chunk_size,
+					   gt, data_disks, start + len);
+		}
 
-			/* Place P and Q blocks at end of bufs */
-			bufs[syndrome_disks] = (uint8_t*)buf + chunk_size * data_disks;
-			bufs[syndrome_disks+1] = (uint8_t*)buf + chunk_size * (data_disks+1);
-
-			if (fblock[1] == data_disks)
-				/* One data failed, and parity failed */
-				raid6_datap_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], bufs);
-			else {
-				if (fdisk[0] > fdisk[1]) {
-					int t = fdisk[0];
-					fdisk[0] = fdisk[1];
-					fdisk[1] = t;
-				}
-				/* Two data blocks failed, P,Q OK */
-				raid6_2data_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], fdisk[1], bufs);
+		rv = save_stripe_recover(sl, raid_disks, chunk_size,
+					 level, layout, data_disks, gt, start);
+		if (rv == 0 && dest) {
+			struct stripe_io_batch *wb = &wbatch[s % 2];
+			for (i = 0; i < nwrites; i++) {
+				struct stripe_io_req *req = &wb->reqs[i];
+				req->fd = dest[i];
+				req->op = STRIPE_IO_WRITE;
+				req->buf = sl->buf;
+				req->len = len;
+				req->offset = dpos[i] + s * len;
 			}
+			wb->nreqs = nwrites;
+			stripe_io_submit(sio, wb);
 		}
-		if (dest) {
-			for (i = 0; i < nwrites; i++)
-				if (write(dest[i], buf, len) != len)
-					return -1;
-		} else {
-			/* build next stripe in buffer */
-			buf += len;
+		if (rv) {
+			if (s + 1 < nstripes)
+				stripe_io_wait(sio, &slots[(s + 1) % 2].batch);
+			break;
 		}
-		length -= len;
 		start += len;
 	}
+	for (i = 0; dest && i < 2; i++) {
+		if (stripe_io_wait(sio, &wbatch[i]))
+			rv = -1;
+		free(wreqs[i]);
+	}
+	if (dest && rv == 0)
+		for (i = 0; i < nwrites; i++)
+			lseek64(dest[i], dpos[i] + nstripes * len, 0);
+	stripe_io_destroy(sio);
+	free_stripe_slots(slots, 2);
+	geo_table_free(gt);
+	free(dpos);
+	return rv;
+}
+
+/* Read the data blocks of the stripe at 'start' from the backup
+ * and compute its parity into the slot.
+ */
+static int restore_stripe_fill(struct stripe_slot *sl,
+			       int raid_disks, int chunk_size,
+			       int level, int layout, int data_disks,
+			       const struct geo_table *gt,
+			       int source, unsigned long long *read_offset,
+			       char *src_buf, char **blocks,
+			       unsigned long long start)
+{
+	const int *map = geo_table_disks(gt, start/chunk_size/data_disks);
+	char **stripes = sl->blocks;
+	int disk, qdisk;
+	int syndrome_disks;
+	int i;
+
+	for (i = 0; i < data_disks; i++) {
+		int disk = map[i];
+		if (src_buf == NULL) {
+			/* read from file */
+			if (lseek64(source, *read_offset, 0) !=
+				 (off64_t)*read_offset)
+				return -1;
+			if (read(source,
+				 stripes[disk],
+				 chunk_size) != chunk_size)
+				return -1;
+		} else {
+			/* read from input buffer */
+			memcpy(stripes[disk],
+			       src_buf + *read_offset,
+			       chunk_size);
+		}
+		*read_offset += chunk_size;
+	}
+	/* We have the data, now do the parity */
+	switch (level) {
+	case 4:
+	case 5:
+		disk = map[-1];
+		for (i = 0; i < data_disks; i++)
+			blocks[i] = stripes[(disk+1+i) % raid_disks];
+		xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
+		break;
+	case 6:
+		disk = map[-1];
+		qdisk = map[-2];
+		if (is_ddf(layout)) {
+			/* q over 'raid_disks' blocks, in device order.
+			 * 'p' and 'q' get to be all zero
+			 */
+			for (i = 0; i < raid_disks; i++)
+				if (i == disk || i == qdisk)
+					blocks[i] = (char*)zero;
+				else
+					blocks[i] = stripes[i];
+			syndrome_disks = raid_disks;
+		} else {
+			/* for md, q is over 'data_disks' blocks,
+			 * starting immediately after 'q'
+			 */
+			for (i = 0; i < data_disks; i++)
+				blocks[i] = stripes[(qdisk+1+i) % raid_disks];
+
+			syndrome_disks = data_disks;
+		}
+		qsyndrome((uint8_t*)stripes[disk],
+			  (uint8_t*)stripes[qdisk],
+			  (uint8_t**)blocks,
+			  syndrome_disks, chunk_size);
+		break;
+	}
 	return 0;
 }
 
@@ -670,7 +1082,8 @@ int save_stripes(int *source, unsigned long long *offsets,
  *  A start and length.
  * The length must be a multiple of the stripe size.
  *
- * We build a full stripe in memory and then write it out.
+ * We build a full stripe in memory and then write it out, to all
+ * devices in parallel, while the next stripe is being built.
  * We assume that there are enough working devices.
  */
 int restore_stripes(int *dest, unsigned long long *offsets,
@@ -679,196 +1092,659 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 		    unsigned long long start, unsigned long long length,
 		    char *src_buf)
 {
-	char *stripe_buf;
-	char **stripes = xmalloc(raid_disks * sizeof(char*));
+	struct stripe_slot slots[2];
+	struct stripe_io *sio = NULL;
+	struct geo_table *gt = geo_table_create(raid_disks, level, layout);
 	char **blocks = xmalloc(raid_disks * sizeof(char*));
+	unsigned long long s;
 	int i;
 	int rv;
 
 	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	unsigned int len = data_disks * chunk_size;
 
-	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * chunk_size))
-		stripe_buf = NULL;
-
-	if (zero == NULL || chunk_size > zero_size) {
-		if (zero)
-			free(zero);
-		zero = xcalloc(1, chunk_size);
-		zero_size = chunk_size;
-	}
-
-	if (stripe_buf == NULL || stripes == NULL || blocks == NULL
-	    || zero == NULL) {
+	if (alloc_stripe_slots(slots, 2, raid_disks, chunk_size, raid_disks)
+	    || blocks == NULL || ensure_zero_has_size(chunk_size)
+	    || gt == NULL) {
 		rv = -2;
 		goto abort;
 	}
-	for (i = 0; i < raid_disks; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
-	while (length > 0) {
-		unsigned int len = data_disks * chunk_size;
+	sio = stripe_io_create(raid_disks);
+
+	for (s = 0; length > 0; s++) {
+		struct stripe_slot *sl = &slots[s % 2];
 		unsigned long long offset;
-		int disk, qdisk;
-		int syndrome_disks;
+		int n = 0;
+
 		if (length < len) {
 			rv = -3;
 			goto abort;
 		}
-		for (i = 0; i < data_disks; i++) {
-			int disk = geo_map(i, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			if (src_buf == NULL) {
-				/* read from file */
-				if (lseek64(source, read_offset, 0) !=
-					 (off64_t)read_offset) {
-					rv = -1;
-					goto abort;
-				}
-				if (read(source,
-					 stripes[disk],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
-				}
-			} else {
-				/* read from input buffer */
-				memcpy(stripes[disk],
-				       src_buf + read_offset,
-				       chunk_size);
-			}
-			read_offset += chunk_size;
+		/* The writes from two stripes ago used this slot */
+		if (s >= 2 && stripe_io_wait(sio, &sl->batch)) {
+			rv = -1;
+			goto abort;
 		}
-		/* We have the data, now do the parity */
-		offset = (start/chunk_size/data_disks) * chunk_size;
-		switch (level) {
-		case 4:
-		case 5:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			for (i = 0; i < data_disks; i++)
-				blocks[i] = stripes[(disk+1+i) % raid_disks];
-			xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
-			break;
-		case 6:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					if (i == disk || i == qdisk)
-						blocks[i] = (char*)zero;
-					else
-						blocks[i] = stripes[i];
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 */
-				for (i = 0; i < data_disks; i++)
-					blocks[i] = stripes[(qdisk+1+i) % raid_disks];
+		sl->batch.nreqs = 0;
+		rv = restore_stripe_fill(sl, raid_disks, chunk_size,
+					 level, layout, data_disks, gt,
+					 source, &read_offset, src_buf,
+					 blocks, start);
+		if (rv)
+			goto abort;
 
-				syndrome_disks = data_disks;
-			}
-			qsyndrome((uint8_t*)stripes[disk],
-				  (uint8_t*)stripes[qdisk],
-				  (uint8_t**)blocks,
-				  syndrome_disks, chunk_size);
-			break;
-		}
+		offset = (start/chunk_size/data_disks) * chunk_size;
 		for (i=0; i < raid_disks ; i++)
 			if (dest[i] >= 0) {
-				if (lseek64(dest[i],
-					 offsets[i]+offset, 0) < 0) {
-					rv = -1;
-					goto abort;
-				}
-				if (write(dest[i], stripes[i],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
-				}
+				struct stripe_io_req *req = &sl->reqs[n++];
+				req->fd = dest[i];
+				req->op = STRIPE_IO_WRITE;
+				req->buf = sl->blocks[i];
+				req->len = chunk_size;
+				req->offset = offsets[i]+offset;
 			}
+		sl->batch.nreqs = n;
+		stripe_io_submit(sio, &sl->batch);
 		length -= len;
 		start += len;
 	}
 	rv = 0;
 
 abort:
-	free(stripe_buf);
-	free(stripes);
+	/* Never free a buffer that a worker might still be writing from */
+	for (i = 0; i < 2 && slots[i].reqs; i++)
+		if (stripe_io_wait(sio, &slots[i].batch) && rv == 0)
+			rv = -1;
+	stripe_io_destroy(sio);
+	free_stripe_slots(slots, 2);
+	geo_table_free(gt);
 	free(blocks);
 	return rv;
 }
 
-#ifdef MAIN
+/* Arrange the blocks of a RAID6 stripe in the order the Q syndrome is
+ * computed over, as save_stripes() does: for DDF layouts every device
+ * in device order with P and Q read as zero, otherwise the data
+ * devices in device order starting just after Q.
+ * Returns the number of syndrome blocks.
+ */
+static int raid6_syndrome_sources(char **stripes, uint8_t **blocks,
+				  int raid_disks, int layout,
+				  int pdisk, int qdisk)
+{
+	int i, n = 0;
+
+	if (is_ddf(layout)) {
+		for (i = 0; i < raid_disks; i++)
+			if (i == pdisk || i == qdisk)
+				blocks[i] = zero;
+			else
+				blocks[i] = (uint8_t*)stripes[i];
+		return raid_disks;
+	}
+	for (i = 0; i < raid_disks; i++) {
+		int d = (qdisk + 1 + i) % raid_disks;
+		if (d == pdisk || d == qdisk)
+			continue;
+		blocks[n++] = (uint8_t*)stripes[d];
+	}
+	return n;
+}
 
-int test_stripes(int *source, unsigned long long *offsets,
-		 int raid_disks, int chunk_size, int level, int layout,
-		 unsigned long long start, unsigned long long length)
+static void scrub_report_add(struct scrub_report *rep,
+			     unsigned long long stripe, int disk,
+			     unsigned long long offset, unsigned int len,
+			     int err)
 {
-	/* ready the data and p (and q) blocks, and check we got them right */
-	char *stripe_buf = xmalloc(raid_disks * chunk_size);
-	char **stripes = xmalloc(raid_disks * sizeof(char*));
-	char **blocks = xmalloc(raid_disks * sizeof(char*));
-	char *p = xmalloc(chunk_size);
-	char *q = xmalloc(chunk_size);
+	struct scrub_mismatch *m;
 
-	int i;
-	int diskP, diskQ;
-	int data_disks = raid_disks - (level == 5 ? 1: 2);
+	if (rep->nmismatches == rep->alloc) {
+		rep->alloc = rep->alloc ? rep->alloc * 2 : 16;
+		rep->mismatches = xrealloc(rep->mismatches,
+					   rep->alloc * sizeof(*m));
+	}
+	m = &rep->mismatches[rep->nmismatches++];
+	m->stripe = stripe;
+	m->disk = disk;
+	m->offset = offset;
+	m->len = len;
+	m->err = err;
+}
 
-	if (!tables_ready)
-		make_tables();
+/* Find the first and last bytes at which 'a' and 'b' differ,
+ * widening [*first, *last).  Returns 1 if they differ at all.
+ */
+static int diff_range(char *a, char *b, int size,
+		      unsigned int *first, unsigned int *last)
+{
+	int i, j;
 
-	for ( i = 0 ; i < raid_disks ; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
+	if (memcmp(a, b, size) == 0)
+		return 0;
+	for (i = 0; i < size && a[i] == b[i]; i++)
+		;
+	for (j = size; j > i && a[j-1] == b[j-1]; j--)
+		;
+	if ((unsigned int)i < *first)
+		*first = i;
+	if ((unsigned int)j > *last)
+		*last = j;
+	return 1;
+}
 
-	while (length > 0) {
-		int disk;
+/* Check the parity of one stripe, whose blocks are 'stripes' in
+ * device order.  Any mismatch is added to the report.
+ */
+static void scrub_one_stripe(struct scrub_report *rep, char **stripes,
+			     uint8_t **blocks, char *p, char *q,
+			     unsigned long long stripe, unsigned long long offset,
+			     int raid_disks, int chunk_size,
+			     int level, int layout, int data_disks,
+			     const struct geo_table *gt)
+{
+	const int *map = geo_table_disks(gt, stripe);
+	unsigned int first = chunk_size, last = 0;
+	int pdisk, qdisk;
+	int disk = -1;
+	int i, n;
+
+	pdisk = map[-1];
+	if (level != 6) {
+		for (i = 0; i < data_disks; i++)
+			blocks[i] = (uint8_t*)stripes[map[i]];
+		xor_blocks(p, (char**)blocks, data_disks, chunk_size);
+		if (!diff_range(p, stripes[pdisk], chunk_size, &first, &last))
+			return;
+		/* RAID5 cannot say which device is wrong */
+	} else {
+		int bad;
+
+		qdisk = map[-2];
+		n = raid6_syndrome_sources(stripes, blocks, raid_disks, layout,
+					   pdisk, qdisk);
+		qsyndrome((uint8_t*)p, (uint8_t*)q, blocks, n, chunk_size);
+		bad = diff_range(p, stripes[pdisk], chunk_size, &first, &last);
+		bad |= diff_range(q, stripes[qdisk], chunk_size, &first, &last);
+		if (!bad)
+			return;
+		disk = raid6_check_disks(data_disks, stripe * chunk_size,
+					 chunk_size, level, layout,
+					 pdisk, qdisk, p, q, stripes);
+		if (disk < 0)
+			disk = -1;
+	}
+	scrub_report_add(rep, stripe, disk, offset + first, last - first, 0);
+}
 
-		for (i = 0 ; i < raid_disks ; i++) {
-			lseek64(source[i], offsets[i]+start, 0);
-			read(source[i], stripes[i], chunk_size);
-		}
-		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start/chunk_size, raid_disks,
-					   level, layout);
-			blocks[i] = stripes[disk];
-			printf("%d->%d\n", i, disk);
+/* Each member is read this much at a time */
+#define SCRUB_IO_SIZE (1024 * 1024)
+
+/*******************************************************************************
+ * Function:	scrub_stripes
+ * Description:
+ *	Verify the parity (P, and Q for RAID6) of a range of a RAID4/5/6
+ * member set without assembling it, and report every stripe which does
+ * not match.  For RAID6 the member holding bad data is located where
+ * possible.
+ *	Each member is read in large sequential requests, all members at
+ * once, with the next window being read while the current one is
+ * checked.
+ * Parameters:
+ *	source		: A list of 'fds' of all the member devices or images
+ *	offsets		: A list of offsets on disk belonging
+ *			  to the array [bytes]
+ *	raid_disks	: geometry: number of disks in the array
+ *	chunk_size	: geometry: chunk size [bytes]
+ *	level		: geometry: RAID level
+ *	layout		: geometry: layout
+ *	start		: address on each member to start at (must be
+ *			  chunk-aligned) [bytes]
+ *	length		: length to check on each member (must be
+ *			  chunk-aligned) [bytes]
+ *	report		: filled in with the results.  Free with
+ *			  free_scrub_report().
+ * Returns:
+ *	 0 : the scan completed; 'report' says what was found
+ *	-1 : bad geometry
+ *	-2 : out of memory
+ ******************************************************************************/
+int scrub_stripes(int *source, unsigned long long *offsets,
+		  int raid_disks, int chunk_size, int level, int layout,
+		  unsigned long long start, unsigned long long length,
+		  struct scrub_report *report)
+{
+	int data_disks = raid_disks - (level == 6 ? 2 : 1);
+	struct stripe_slot slots[2];
+	struct stripe_io *sio = NULL;
+	struct geo_table *gt = NULL;
+	char **stripes = NULL;
+	uint8_t **blocks = NULL;
+	char *p = NULL, *q = NULL;
+	unsigned long long nchunks, per, w, nwindows;
+	int s, d;
+	int rv = 0;
+
+	memset(report, 0, sizeof(*report));
+	memset(slots, 0, sizeof(slots));
+	if ((level != 4 && level != 5 && level != 6) ||
+	    data_disks < 1 || chunk_size <= 0 ||
+	    start % chunk_size || length % chunk_size)
+		return -1;
+
+	nchunks = length / chunk_size;
+	per = SCRUB_IO_SIZE / chunk_size;
+	if (per < 1)
+		per = 1;
+	if (per > nchunks)
+		per = nchunks;
+	if (nchunks == 0)
+		return 0;
+	nwindows = (nchunks + per - 1) / per;
+
+	stripes = calloc(raid_disks, sizeof(char*));
+	blocks = calloc(raid_disks, sizeof(uint8_t*));
+	gt = geo_table_create(raid_disks, level, layout);
+	if (!stripes || !blocks || !gt || ensure_zero_has_size(chunk_size) ||
+	    posix_memalign((void**)&p, 4096, chunk_size) ||
+	    posix_memalign((void**)&q, 4096, chunk_size) ||
+	    alloc_stripe_slots(slots, 2, raid_disks,
+			       (int)per * chunk_size, raid_disks)) {
+		rv = -2;
+		goto out;
+	}
+	sio = stripe_io_create(raid_disks);
+
+	for (w = 0; w < nwindows; w++) {
+		struct stripe_slot *sl = &slots[w % 2];
+		unsigned long long wstart = start + w * per * chunk_size;
+		unsigned long long c, n;
+
+		for (s = (w == 0 ? 0 : 1); s < 2 && w + s < nwindows; s++) {
+			/* read this window first time round, then always
+			 * the next one
+			 */
+			struct stripe_slot *rs = &slots[(w + s) % 2];
+			unsigned long long rstart = start +
+				(w + s) * per * chunk_size;
+			unsigned long long rlen = per * chunk_size;
+
+			if (rstart + rlen > start + length)
+				rlen = start + length - rstart;
+			for (d = 0; d < raid_disks; d++) {
+				struct stripe_io_req *req = &rs->reqs[d];
+				req->fd = source[d];
+				req->op = STRIPE_IO_READ;
+				req->buf = rs->blocks[d];
+				req->len = rlen;
+				req->offset = offsets[d] + rstart;
+			}
+			rs->batch.nreqs = raid_disks;
+			stripe_io_submit(sio, &rs->batch);
+			if (w == 0 && s == 0)
+				stripe_io_wait(sio, &rs->batch);
 		}
-		switch(level) {
-		case 6:
-			qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-			diskP = geo_map(-1, start/chunk_size, raid_disks,
-				       level, layout);
-			if (memcmp(p, stripes[diskP], chunk_size) != 0) {
-				printf("P(%d) wrong at %llu\n", diskP,
-				       start / chunk_size);
+		if (w)
+			stripe_io_wait(sio, &sl->batch);
+
+		n = per;
+		if (w == nwindows - 1)
+			n = nchunks - w * per;
+		for (c = 0; c < n; c++) {
+			unsigned long long offset = wstart + c * chunk_size;
+			unsigned long long stripe = offset / chunk_size;
+			int unreadable = 0;
+
+			for (d = 0; d < raid_disks; d++) {
+				struct stripe_io_req *req = &sl->reqs[d];
+				if (req->done < (c + 1) * chunk_size) {
+					/* Report each failed read once */
+					if (req->done >= c * chunk_size)
+						scrub_report_add(report, stripe,
+								 d, offset,
+								 (n - c) * chunk_size,
+								 req->err ? req->err
+								 : EIO);
+					unreadable = 1;
+				}
+				stripes[d] = sl->blocks[d] + c * chunk_size;
 			}
-			diskQ = geo_map(-2, start/chunk_size, raid_disks,
-				       level, layout);
-			if (memcmp(q, stripes[diskQ], chunk_size) != 0) {
-				printf("Q(%d) wrong at %llu\n", diskQ,
-				       start / chunk_size);
+			if (unreadable)
+				report->unreadable++;
+			else
+				scrub_one_stripe(report, stripes, blocks, p, q,
+						 stripe, offset,
+						 raid_disks, chunk_size,
+						 level, layout, data_disks, gt);
+			report->stripes++;
+		}
+	}
+
+out:
+	for (s = 0; s < 2 && slots[s].reqs; s++)
+		stripe_io_wait(sio, &slots[s].batch);
+	stripe_io_destroy(sio);
+	free_stripe_slots(slots, 2);
+	geo_table_free(gt);
+	free(stripes);
+	free(blocks);
+	free(p);
+	free(q);
+	return rv;
+}
+
+void free_scrub_report(struct scrub_report *report)
+{
+	free(report->mismatches);
+	memset(report, 0, sizeof(*report));
+}
+
+/* Rebuild the blocks on the 'failed' devices of one stripe, whose
+ * blocks are 'stripes' in device order, from the blocks on the others.
+ * 'scratch' is a spare chunk.
+ * Returns 0, or -1 if too many devices are missing or a failed device
+ * is not among the syndrome sources of this layout.
+ */
+static int rebuild_one_stripe(char **stripes, const int *failed, int nfailed,
+			      const int *map, int raid_disks, int data_disks,
+			      int level, int layout, int chunk_size,
+			      uint8_t **bufs, char *scratch)
+{
+	int pdisk = map[-1];
+	int qdisk = level == 6 ? map[-2] : -1;
+	int fdata[2];
+	int nfdata = 0, pfailed = 0, qfailed = 0;
+	int i, n;
+
+	for (i = 0; i < nfailed; i++)
+		if (failed[i] == pdisk)
+			pfailed = 1;
+		else if (failed[i] == qdisk)
+			qfailed = 1;
+		else if (nfdata < 2)
+			fdata[nfdata++] = failed[i];
+		else
+			return -1;
+
+	if (nfdata == 0 && pfailed && !qfailed) {
+		/* just P to compute */
+		for (i = 0; i < data_disks; i++)
+			bufs[i] = (uint8_t*)stripes[map[i]];
+		xor_blocks(stripes[pdisk], (char**)bufs, data_disks,
+			   chunk_size);
+	} else if (nfdata == 1 && !pfailed) {
+		/* P is good, so the data can come from the xor of the rest */
+		n = 0;
+		for (i = 0; i < raid_disks; i++)
+			if (i != fdata[0] && i != qdisk)
+				bufs[n++] = (uint8_t*)stripes[i];
+		xor_blocks(stripes[fdata[0]], (char**)bufs, n, chunk_size);
+	} else if (nfdata > 0) {
+		/* RAID6 computations needed, in syndrome order */
+		int fidx[2] = { -1, -1 };
+
+		n = raid6_syndrome_sources(stripes, bufs, raid_disks, layout,
+					   pdisk, qdisk);
+		for (i = 0; i < n; i++) {
+			if (bufs[i] == (uint8_t*)stripes[fdata[0]])
+				fidx[0] = i;
+			if (nfdata > 1 && bufs[i] == (uint8_t*)stripes[fdata[1]])
+				fidx[1] = i;
+		}
+		if (fidx[0] < 0 || (nfdata > 1 && fidx[1] < 0))
+			/* a failed slot is not a data slot of this layout */
+			return -1;
+		bufs[n] = (uint8_t*)stripes[pdisk];
+		bufs[n+1] = (uint8_t*)stripes[qdisk];
+		if (nfdata == 1)
+			/* One data failed, and parity failed */
+			raid6_datap_recov(n + 2, chunk_size, fidx[0], bufs);
+		else if (fidx[0] < fidx[1])
+			raid6_2data_recov(n + 2, chunk_size, fidx[0], fidx[1],
+					  bufs);
+		else
+			raid6_2data_recov(n + 2, chunk_size, fidx[1], fidx[0],
+					  bufs);
+	}
+
+	if (qfailed) {
+		/* All the data is here now, so Q (and P) can be computed */
+		n = raid6_syndrome_sources(stripes, bufs, raid_disks, layout,
+					   pdisk, qdisk);
+		qsyndrome((uint8_t*)(pfailed && nfdata == 0 ?
+				     stripes[pdisk] : scratch),
+			  (uint8_t*)stripes[qdisk], bufs, n, chunk_size);
+	}
+	return 0;
+}
+
+/* Each member is read, and each rebuilt member written, this much at
+ * a time
+ */
+#define REBUILD_IO_SIZE (4 * 1024 * 1024)
+
+/*******************************************************************************
+ * Function:	rebuild_members
+ * Description:
+ *	Reconstruct the contents of missing members of a RAID4/5/6 array
+ * from the remaining ones, without assembling it, and write them out.
+ * This can fill a replacement device ahead of adding it, or produce an
+ * image of a lost member for inspection.
+ *	All present members are read at once in large requests, and the
+ * next window is read while the current one is rebuilt and written.
+ * Parameters:
+ *	source		: A list of 'fds' of the member devices, with -1
+ *			  for each missing member (one for RAID4/5, at
+ *			  most two for RAID6)
+ *	offsets		: A list of offsets on disk belonging to the array
+ *			  [bytes].  For a missing member, where its data
+ *			  starts in the output.
+ *	raid_disks	: geometry: number of disks in the array
+ *	chunk_size	: geometry: chunk size [bytes]
+ *	level		: geometry: RAID level
+ *	layout		: geometry: layout
+ *	start		: address on each member to start at (must be
+ *			  chunk-aligned) [bytes]
+ *	length		: length to rebuild on each member (must be
+ *			  chunk-aligned) [bytes]
+ *	dest		: for each missing member, the 'fd' to write its
+ *			  rebuilt contents to, or -1 to not write it.
+ *			  Ignored for members which are present.
+ * Returns:
+ *	 0 : success
+ *	-1 : too many members missing, bad geometry, or an I/O error
+ *	-2 : out of memory
+ ******************************************************************************/
+int rebuild_members(int *source, unsigned long long *offsets,
+		    int raid_disks, int chunk_size, int level, int layout,
+		    unsigned long long start, unsigned long long length,
+		    int *dest)
+{
+	int data_disks = raid_disks - (level == 6 ? 2 : 1);
+	struct stripe_slot slots[2];
+	/* output writes, one batch per slot */
+	struct stripe_io_req *wreqs[2] = { NULL, NULL };
+	struct stripe_io_batch wbatch[2];
+	struct stripe_io *sio = NULL;
+	struct geo_table *gt = NULL;
+	char **stripes = NULL;
+	uint8_t **bufs = NULL;
+	char *scratch = NULL;
+	int failed[2];
+	int nfailed = 0;
+	unsigned long long nchunks, per, w, nwindows;
+	int s, d;
+	int rv = 0;
+
+	memset(slots, 0, sizeof(slots));
+	memset(wbatch, 0, sizeof(wbatch));
+	if ((level != 4 && level != 5 && level != 6) ||
+	    data_disks < 1 || chunk_size <= 0 ||
+	    start % chunk_size || length % chunk_size)
+		return -1;
+	for (d = 0; d < raid_disks; d++)
+		if (source[d] < 0) {
+			if (nfailed == raid_disks - data_disks)
+				return -1;
+			failed[nfailed++] = d;
+		}
+
+	nchunks = length / chunk_size;
+	if (nchunks == 0 || nfailed == 0)
+		return 0;
+	per = REBUILD_IO_SIZE / chunk_size;
+	if (per < 1)
+		per = 1;
+	if (per > nchunks)
+		per = nchunks;
+	nwindows = (nchunks + per - 1) / per;
+
+	stripes = calloc(raid_disks, sizeof(char*));
+	bufs = calloc(raid_disks + 2, sizeof(uint8_t*));
+	gt = geo_table_create(raid_disks, level, layout);
+	if (!stripes || !bufs || !gt || ensure_zero_has_size(chunk_size) ||
+	    posix_memalign((void**)&scratch, 4096, chunk_size) ||
+	    alloc_stripe_slots(slots, 2, raid_disks,
+			       (int)per * chunk_size, raid_disks)) {
+		rv = -2;
+		goto out;
+	}
+	for (s = 0; s < 2; s++) {
+		wreqs[s] = xcalloc(nfailed, sizeof(struct stripe_io_req));
+		wbatch[s].reqs = wreqs[s];
+	}
+	sio = stripe_io_create(raid_disks);
+
+	for (w = 0; w < nwindows && rv == 0; w++) {
+		struct stripe_slot *sl = &slots[w % 2];
+		unsigned long long wstart = start + w * per * chunk_size;
+		unsigned long long wlen = per * chunk_size;
+		unsigned long long c;
+		int n;
+
+		if (wstart + wlen > start + length)
+			wlen = start + length - wstart;
+
+		for (s = (w == 0 ? 0 : 1); s < 2 && w + s < nwindows; s++) {
+			/* read this window first time round, then always
+			 * the next one, once the slot's last output is out
+			 */
+			struct stripe_slot *rs = &slots[(w + s) % 2];
+			unsigned long long rstart = wstart + s * per * chunk_size;
+			unsigned long long rlen = per * chunk_size;
+
+			if (rstart + rlen > start + length)
+				rlen = start + length - rstart;
+			if (stripe_io_wait(sio, &wbatch[(w + s) % 2])) {
+				rv = -1;
+				break;
 			}
-			disk = raid6_check_disks(data_disks, start, chunk_size,
-						 level, layout, diskP, diskQ,
-						 p, q, stripes);
-			if(disk >= 0) {
-			  printf("Possible failed disk: %d\n", disk);
+			n = 0;
+			for (d = 0; d < raid_disks; d++) {
+				struct stripe_io_req *req;
+
+				if (source[d] < 0)
+					continue;
+				req = &rs->reqs[n++];
+				req->fd = source[d];
+				req->op = STRIPE_IO_READ;
+				req->buf = rs->blocks[d];
+				req->len = rlen;
+				req->offset = offsets[d] + rstart;
 			}
-			if(disk == -2) {
-			  printf("Failure detected, but disk unknown\n");
+			rs->batch.nreqs = n;
+			stripe_io_submit(sio, &rs->batch);
+			if (w == 0 && s == 0 &&
+			    stripe_io_wait(sio, &rs->batch))
+				rv = -1;
+		}
+		if (rv || (w && stripe_io_wait(sio, &sl->batch))) {
+			rv = -1;
+			break;
+		}
+
+		for (c = 0; c * chunk_size < wlen; c++) {
+			unsigned long long stripe = wstart / chunk_size + c;
+
+			for (d = 0; d < raid_disks; d++)
+				stripes[d] = sl->blocks[d] + c * chunk_size;
+			if (rebuild_one_stripe(stripes, failed, nfailed,
+					       geo_table_disks(gt, stripe),
+					       raid_disks, data_disks,
+					       level, layout, chunk_size,
+					       bufs, scratch)) {
+				rv = -1;
+				break;
 			}
+		}
+		if (rv)
 			break;
+
+		n = 0;
+		for (d = 0; d < nfailed; d++) {
+			struct stripe_io_req *req;
+
+			if (dest[failed[d]] < 0)
+				continue;
+			req = &wbatch[w % 2].reqs[n++];
+			req->fd = dest[failed[d]];
+			req->op = STRIPE_IO_WRITE;
+			req->buf = sl->blocks[failed[d]];
+			req->len = wlen;
+			req->offset = offsets[failed[d]] + wstart;
 		}
-		length -= chunk_size;
-		start += chunk_size;
+		wbatch[w % 2].nreqs = n;
+		stripe_io_submit(sio, &wbatch[w % 2]);
 	}
-	return 0;
+
+out:
+	/* Never free a buffer that I/O might still be using */
+	for (s = 0; s < 2 && slots[s].reqs; s++) {
+		stripe_io_wait(sio, &slots[s].batch);
+		if (stripe_io_wait(sio, &wbatch[s]) && rv == 0)
+			rv = -1;
+		free(wreqs[s]);
+	}
+	stripe_io_destroy(sio);
+	free_stripe_slots(slots, 2);
+	geo_table_free(gt);
+	free(stripes);
+	free(bufs);
+	free(scratch);
+	return rv;
+}
+
+#ifdef MAIN
+
+int test_stripes(int *source, unsigned long long *offsets,
+		 int raid_disks, int chunk_size, int level, int layout,
+		 unsigned long long start, unsigned long long length)
+{
+	struct scrub_report report;
+	int i;
+	int rv;
+
+	rv = scrub_stripes(source, offsets, raid_disks, chunk_size,
+			   level, layout, start, length, &report);
+	if (rv)
+		return rv;
+	for (i = 0; i < report.nmismatches; i++) {
+		struct scrub_mismatch *m = &report.mismatches[i];
+
+		if (m->err)
+			printf("Read error on disk %d at %llu+%u: %s\n",
+			       m->disk, m->offset, m->len, strerror(m->err));
+		else if (m->disk >= 0)
+			printf("Stripe %llu wrong at %llu+%u, failed disk: %d\n",
+			       m->stripe, m->offset, m->len, m->disk);
+		else
+			printf("Stripe %llu wrong at %llu+%u, disk unknown\n",
+			       m->stripe, m->offset, m->len);
+	}
+	printf("%llu stripes checked, %llu unreadable, %d problems\n",
+	       report.stripes, report.unreadable, report.nmismatches);
+	rv = report.nmismatches ? 1 : 0;
+	free_scrub_report(&report);
+	return rv;
 }
 
 unsigned long long getnum(char *str, char **err)
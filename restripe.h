@@ -0,0 +1,171 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* GF(2^8) tables, generated at build time by mktables.c */
+extern const uint8_t raid6_gfmul[256][256];
+extern const uint8_t raid6_gfexp[256];
+extern const uint8_t raid6_gfinv[256];
+extern const uint8_t raid6_gfexi[256];
+extern const uint8_t raid6_gflog[256];
+extern const uint8_t raid6_gfilog[256];
+
+/* Parity kernels used by restripe.c.
+ * There is one set per instruction set we know how to use, modelled
+ * on linux/include/linux/raid/pq.h.  The best set for which 'valid'
+ * returns true is chosen once when the library is loaded; the scalar
+ * set is always valid and is the fallback.
+ */
+struct restripe_calls {
+	void (*xor_blocks)(char *target, char **sources, int disks, int size);
+	void (*qsyndrome)(uint8_t *p, uint8_t *q, uint8_t **sources,
+			  int disks, int size);
+	void (*recov_2data)(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dp, uint8_t *dq,
+			    uint8_t pbmul, uint8_t qmul);
+	void (*recov_datap)(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dq, uint8_t qmul);
+	size_t (*pq_diff)(const uint8_t *p, const uint8_t *dp,
+			  const uint8_t *q, const uint8_t *dq, size_t bytes);
+	int (*valid)(void);	/* Returns 1 if this routine set is usable */
+	const char *name;	/* Name of this routine set */
+};
+
+extern const struct restripe_calls restripe_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+extern const struct restripe_calls restripe_sse2;
+extern const struct restripe_calls restripe_ssse3;
+extern const struct restripe_calls restripe_avx2;
+extern const struct restripe_calls restripe_avx512;
+#endif
+
+/* All known routine sets, best first, NULL terminated */
+extern const struct restripe_calls *const restripe_calls_list[];
+extern const struct restripe_calls *restripe_calls_get(void);
+extern int restripe_calls_select(const char *name);
+
+/* The scalar recovery loops, for routine sets without a byte shuffle */
+extern void recov_2data_scalar(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dp, uint8_t *dq,
+			       uint8_t pbmul, uint8_t qmul);
+extern void recov_datap_scalar(size_t bytes, uint8_t *p, uint8_t *q,
+			       uint8_t *dq, uint8_t qmul);
+extern size_t pq_diff_scalar(const uint8_t *p, const uint8_t *dp,
+			     const uint8_t *q, const uint8_t *dq, size_t bytes);
+
+extern int ensure_zero_has_size(int chunk_size);
+extern void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+			      uint8_t **ptrs);
+extern void raid6_datap_recov(int disks, size_t bytes, int faila,
+			      uint8_t **ptrs);
+extern int raid6_check_disks(int data_disks, unsigned long long start,
+			     int chunk_size, int level, int layout,
+			     int diskP, int diskQ,
+			     char *p, char *q, char **stripes);
+
+extern int geo_map(int block, unsigned long long stripe, int raid_disks,
+		   int level, int layout);
+
+/* geo_map() for every stripe of one period of a layout, see
+ * geo_table_create().
+ */
+struct geo_table {
+	int raid_disks;
+	int data_disks;
+	int period;	/* the layout repeats after this many stripes */
+	int *disk;	/* [period][data_disks + 2]: disk of Q, P, data blocks */
+	int *block;	/* [period][raid_disks]: block on each disk */
+};
+
+#define GEO_NO_BLOCK	-3	/* disk holds nothing in this stripe */
+
+extern struct geo_table *geo_table_create(int raid_disks, int level,
+					  int layout);
+extern void geo_table_free(struct geo_table *gt);
+
+/* The disks for 'stripe', indexed like the 'block' argument to
+ * geo_map(): [-2] is Q, [-1] is P and [0..data_disks-1] the data.
+ */
+static inline const int *geo_table_disks(const struct geo_table *gt,
+					 unsigned long long stripe)
+{
+	return gt->disk + (stripe % gt->period) * (gt->data_disks + 2) + 2;
+}
+
+/* The block held by each disk for 'stripe': -1 for P, -2 for Q */
+static inline const int *geo_table_blocks(const struct geo_table *gt,
+					  unsigned long long stripe)
+{
+	return gt->block + (stripe % gt->period) * gt->raid_disks;
+}
+
+extern void xor_blocks(char *target, char **sources, int disks, int size);
+extern void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size);
+
+/* Parallel per-device I/O for stripes, see stripe-io.c */
+enum {
+	STRIPE_IO_READ,
+	STRIPE_IO_WRITE,
+	STRIPE_IO_FSYNC,	/* linked to the request just before, if on the same fd */
+};
+
+enum {
+	STRIPE_IO_ENGINE_AUTO,		/* io_uring if possible, else threads */
+	STRIPE_IO_ENGINE_THREADS,
+	STRIPE_IO_ENGINE_URING,
+};
+
+struct stripe_io_batch;
+
+struct stripe_io_req {
+	int fd;
+	int op;			/* STRIPE_IO_READ, _WRITE or _FSYNC */
+	char *buf;
+	size_t len;
+	unsigned long long offset;	/* bytes */
+	/* filled in on completion */
+	int err;		/* 0, or errno of the failure */
+	size_t done;		/* bytes transferred */
+	/* private to stripe-io.c */
+	struct stripe_io_batch *batch;
+	struct stripe_io_req *next;
+	struct stripe_io_req *link;
+	int flags;
+	struct iovec iov;
+};
+
+struct stripe_io_batch {
+	struct stripe_io_req *reqs;
+	int nreqs;
+	int pending;		/* private to stripe-io.c */
+};
+
+struct stripe_io;
+extern struct stripe_io *stripe_io_create(int nworkers);
+extern void stripe_io_destroy(struct stripe_io *sio);
+extern void stripe_io_submit(struct stripe_io *sio, struct stripe_io_batch *b);
+extern int stripe_io_wait(struct stripe_io *sio, struct stripe_io_batch *b);
+extern int stripe_io_set_engine(int engine);
+extern const char *stripe_io_engine_name(struct stripe_io *sio);
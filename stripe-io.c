@@ -0,0 +1,616 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2006-2009 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A small engine for doing the per-device I/O of a stripe in parallel.
+ *
+ * A caller fills in a batch of requests (typically one per member
+ * device), submits it, carries on with other work and later waits
+ * for the batch to complete.
+ *
+ * There are two ways the requests get done.  If the kernel supports
+ * io_uring, the whole batch is queued on a ring and handed to the
+ * kernel with a single system call.  Otherwise requests are handed to
+ * a pool of worker threads which use pread/pwrite.  Either way the
+ * reads of one stripe all run at once and overlap with parity work on
+ * the previous stripe.  If neither can be set up, requests are simply
+ * done inline by stripe_io_submit(), so callers never need a separate
+ * path.
+ *
+ * An FSYNC request which immediately follows a request on the same fd
+ * in a batch is linked to it: it is only started once that request
+ * has completed, and fails with ECANCELED if that request failed.
+ * It is not ordered against any earlier request on that fd, so to
+ * sync several writes, wait for them and then submit the FSYNC.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#define REQ_LINKED	1	/* started by the request before it */
+#define REQ_SYNC_DONE	2	/* completed by hand, ignore the cqe */
+
+#ifdef HAVE_IO_URING
+struct stripe_io_ring {
+	int fd;
+	unsigned entries;	/* of the submission queue */
+	unsigned cq_entries;
+	unsigned inflight;	/* submitted but not yet reaped */
+	unsigned queued;	/* in the sq but not yet submitted */
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct stripe_io {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when 'queue' gains requests */
+	pthread_cond_t done;	/* signalled when a batch completes */
+	struct stripe_io_req *queue, **queue_tail;
+	int nworkers;
+	int stopping;
+	pthread_t *workers;
+#ifdef HAVE_IO_URING
+	struct stripe_io_ring *ring;
+#endif
+};
+
+static int stripe_io_engine = STRIPE_IO_ENGINE_AUTO;
+
+/* Choose how stripe_io_create() does I/O.  Returns -1 if 'engine'
+ * is not available in this build.
+ */
+int stripe_io_set_engine(int engine)
+{
+#ifndef HAVE_IO_URING
+	if (engine == STRIPE_IO_ENGINE_URING)
+		return -1;
+#endif
+	stripe_io_engine = engine;
+	return 0;
+}
+
+/* Perform (the rest of) a single request, retrying short transfers. */
+static void stripe_io_do(struct stripe_io_req *req)
+{
+	size_t done = req->done;
+	ssize_t n;
+
+	req->err = 0;
+	if (req->fd < 0) {
+		req->err = EBADF;
+		return;
+	}
+	if (req->op == STRIPE_IO_FSYNC) {
+		if (fsync(req->fd) != 0)
+			req->err = errno;
+		return;
+	}
+	while (done < req->len) {
+		if (req->op == STRIPE_IO_READ)
+			n = pread(req->fd, req->buf + done, req->len - done,
+				  req->offset + done);
+		else
+			n = pwrite(req->fd, req->buf + done, req->len - done,
+				   req->offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			req->err = errno;
+			break;
+		}
+		if (n == 0) {
+			req->err = EIO;
+			break;
+		}
+		done += n;
+	}
+	req->done = done;
+}
+
+/* Do a request and anything linked after it, in order. */
+static int stripe_io_do_chain(struct stripe_io_req *req)
+{
+	int n = 0;
+	int err = 0;
+
+	for (; req; req = req->link) {
+		if (err)
+			req->err = ECANCELED;
+		else
+			stripe_io_do(req);
+		err = req->err;
+		n++;
+	}
+	return n;
+}
+
+static void *stripe_io_worker(void *arg)
+{
+	struct stripe_io *sio = arg;
+	struct stripe_io_req *req;
+	int n;
+
+	pthread_mutex_lock(&sio->lock);
+	while (1) {
+		while (!sio->queue && !sio->stopping)
+			pthread_cond_wait(&sio->work, &sio->lock);
+		if (!sio->queue)
+			break;
+		req = sio->queue;
+		sio->queue = req->next;
+		if (!sio->queue)
+			sio->queue_tail = &sio->queue;
+		pthread_mutex_unlock(&sio->lock);
+
+		n = stripe_io_do_chain(req);
+
+		pthread_mutex_lock(&sio->lock);
+		req->batch->pending -= n;
+		if (req->batch->pending == 0)
+			pthread_cond_broadcast(&sio->done);
+	}
+	pthread_mutex_unlock(&sio->lock);
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+static int ring_enter(struct stripe_io_ring *r, unsigned submit,
+		      unsigned min_complete)
+{
+	int rv;
+
+	do
+		rv = syscall(__NR_io_uring_enter, r->fd, submit, min_complete,
+			     min_complete ? IORING_ENTER_GETEVENTS : 0,
+			     NULL, 0);
+	while (rv < 0 && errno == EINTR);
+	return rv;
+}
+
+static void ring_free(struct stripe_io_ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+}
+
+static struct stripe_io_ring *ring_setup(unsigned entries)
+{
+	struct io_uring_params p;
+	struct stripe_io_ring *r;
+	void *ptr;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) {
+		free(r);
+		return NULL;
+	}
+	r->entries = p.sq_entries;
+	r->cq_entries = p.cq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	r->sq_ptr = ptr;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = ptr;
+	else {
+		ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		r->cq_ptr = ptr;
+	}
+	ptr = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		   r->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	r->sqes = ptr;
+
+	r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+	return r;
+fail:
+	ring_free(r);
+	return NULL;
+}
+
+/* Hand everything queued so far to the kernel. */
+static int ring_flush(struct stripe_io_ring *r)
+{
+	int rv;
+
+	while (r->queued) {
+		rv = ring_enter(r, r->queued, 0);
+		if (rv < 0)
+			return -1;
+		r->queued -= rv;
+		r->inflight += rv;
+	}
+	return 0;
+}
+
+static void ring_complete(struct stripe_io_req *req, int res)
+{
+	if (req->flags & REQ_SYNC_DONE)
+		;
+	else if (res < 0)
+		req->err = -res;
+	else if (req->op != STRIPE_IO_FSYNC) {
+		req->done += res;
+		if (req->done < req->len && res > 0) {
+			/* Short transfer: finish it by hand, along with
+			 * anything linked after it which the kernel will
+			 * have cancelled.
+			 */
+			stripe_io_do_chain(req);
+			if (req->link)
+				req->link->flags |= REQ_SYNC_DONE;
+		} else if (req->done < req->len)
+			req->err = EIO;
+	}
+	req->batch->pending--;
+}
+
+/* Reap completions, waiting for at least 'min' of them. */
+static int ring_reap(struct stripe_io_ring *r, unsigned min)
+{
+	unsigned head, tail;
+
+	if (min && ring_enter(r, 0, min) < 0)
+		return -1;
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		ring_complete((struct stripe_io_req *)(unsigned long)cqe->user_data,
+			      cqe->res);
+		head++;
+		r->inflight--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Make sure 'need' more requests can be queued: the submission queue
+ * must have room, and we never have more requests outstanding than
+ * the completion queue can hold.
+ */
+static int ring_make_room(struct stripe_io_ring *r, unsigned need)
+{
+	while (r->inflight + r->queued + need > r->cq_entries ||
+	       r->queued + need > r->entries) {
+		if (ring_flush(r) < 0)
+			return -1;
+		if (r->inflight + need > r->cq_entries &&
+		    ring_reap(r, 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void ring_queue(struct stripe_io_ring *r, struct stripe_io_req *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *r->sq_tail;
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = req->fd;
+	sqe->user_data = (unsigned long)req;
+	switch (req->op) {
+	case STRIPE_IO_READ:
+	case STRIPE_IO_WRITE:
+		sqe->opcode = req->op == STRIPE_IO_READ ?
+			IORING_OP_READV : IORING_OP_WRITEV;
+		req->iov.iov_base = req->buf;
+		req->iov.iov_len = req->len;
+		sqe->addr = (unsigned long)&req->iov;
+		sqe->len = 1;
+		sqe->off = req->offset;
+		break;
+	case STRIPE_IO_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	}
+	if (req->link)
+		sqe->flags |= IOSQE_IO_LINK;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* The ring has stopped working.  Do by hand anything the kernel never
+ * saw, and collect whatever it still has.
+ */
+static void ring_abandon(struct stripe_io_ring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned first = head;
+	unsigned tail = *r->sq_tail;
+
+	for (; head != tail; head++) {
+		unsigned idx = r->sq_array[head & *r->sq_mask];
+		struct stripe_io_req *req =
+			(struct stripe_io_req *)(unsigned long)r->sqes[idx].user_data;
+
+		if ((req->flags & REQ_LINKED) && head != first)
+			/* done along with the request before it */
+			continue;
+		req->batch->pending -= stripe_io_do_chain(req);
+	}
+	r->queued = 0;
+	while (r->inflight && ring_reap(r, 1) == 0)
+		;
+}
+
+/* Queue a batch on the ring and submit it.  A linked pair is always
+ * queued together so that the kernel sees the whole chain at once.
+ * Returns the number of requests queued, which is less than
+ * b->nreqs if the ring failed.
+ */
+static int ring_submit(struct stripe_io_ring *r, struct stripe_io_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->nreqs; i++) {
+		struct stripe_io_req *req = &b->reqs[i];
+		if (req->fd < 0) {
+			/* Don't bother the kernel, but keep the link
+			 * semantics for anything chained after it.
+			 */
+			int n = stripe_io_do_chain(req);
+			b->pending -= n;
+			i += n - 1;
+			continue;
+		}
+		if (ring_make_room(r, req->link ? 2 : 1) < 0)
+			return i;
+		ring_queue(r, req);
+		if (req->link) {
+			ring_queue(r, req->link);
+			i++;
+		}
+	}
+	if (ring_flush(r) < 0)
+		return i;
+	return b->nreqs;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* Create an engine for up to 'nworkers' concurrent requests, normally
+ * one per member device.  Returns NULL only if memory cannot be
+ * allocated.
+ */
+struct stripe_io *stripe_io_create(int nworkers)
+{
+	struct stripe_io *sio = calloc(1, sizeof(*sio));
+	int i;
+
+	if (!sio)
+		return NULL;
+	pthread_mutex_init(&sio->lock, NULL);
+	pthread_cond_init(&sio->work, NULL);
+	pthread_cond_init(&sio->done, NULL);
+	sio->queue_tail = &sio->queue;
+
+#ifdef HAVE_IO_URING
+	if (stripe_io_engine != STRIPE_IO_ENGINE_THREADS) {
+		unsigned entries = 64;
+		while (entries < 4 * (unsigned)nworkers && entries < 4096)
+			entries <<= 1;
+		sio->ring = ring_setup(entries);
+		if (sio->ring)
+			return sio;
+	}
+#endif
+	if (nworkers > 0)
+		sio->workers = calloc(nworkers, sizeof(pthread_t));
+	if (!sio->workers)
+		return sio;
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&sio->workers[i], NULL,
+				   stripe_io_worker, sio) != 0)
+			break;
+		sio->nworkers++;
+	}
+	return sio;
+}
+
+void stripe_io_destroy(struct stripe_io *sio)
+{
+	int i;
+
+	if (!sio)
+		return;
+#ifdef HAVE_IO_URING
+	if (sio->ring) {
+		/* Nothing may still be using our buffers */
+		while (sio->ring->inflight &&
+		       ring_reap(sio->ring, 1) == 0)
+			;
+		ring_free(sio->ring);
+	}
+#endif
+	pthread_mutex_lock(&sio->lock);
+	sio->stopping = 1;
+	pthread_cond_broadcast(&sio->work);
+	pthread_mutex_unlock(&sio->lock);
+	for (i = 0; i < sio->nworkers; i++)
+		pthread_join(sio->workers[i], NULL);
+	free(sio->workers);
+	pthread_cond_destroy(&sio->done);
+	pthread_cond_destroy(&sio->work);
+	pthread_mutex_destroy(&sio->lock);
+	free(sio);
+}
+
+/* Name of the engine doing the work, for reporting */
+const char *stripe_io_engine_name(struct stripe_io *sio)
+{
+#ifdef HAVE_IO_URING
+	if (sio && sio->ring)
+		return "io_uring";
+#endif
+	if (sio && sio->nworkers)
+		return "threads";
+	return "sync";
+}
+
+/* Queue every request in 'b'.  The caller must not touch the
+ * requests or their buffers until stripe_io_wait() returns.
+ */
+void stripe_io_submit(struct stripe_io *sio, struct stripe_io_batch *b)
+{
+	int i;
+
+	b->pending = b->nreqs;
+	for (i = 0; i < b->nreqs; i++) {
+		struct stripe_io_req *req = &b->reqs[i];
+		req->batch = b;
+		req->next = NULL;
+		req->link = NULL;
+		req->flags = 0;
+		req->err = 0;
+		req->done = 0;
+		if (i && req->op == STRIPE_IO_FSYNC &&
+		    req->fd == b->reqs[i-1].fd) {
+			b->reqs[i-1].link = req;
+			req->flags |= REQ_LINKED;
+		}
+	}
+	if (b->nreqs == 0)
+		return;
+
+#ifdef HAVE_IO_URING
+	if (sio && sio->ring) {
+		int queued;
+
+		pthread_mutex_lock(&sio->lock);
+		queued = ring_submit(sio->ring, b);
+		if (queued < b->nreqs) {
+			/* The ring has failed us; carry on with plain
+			 * system calls from here on.
+			 */
+			ring_abandon(sio->ring);
+			ring_free(sio->ring);
+			sio->ring = NULL;
+			for (i = queued; i < b->nreqs; i++)
+				if (!(b->reqs[i].flags & REQ_LINKED) ||
+				    i == queued)
+					b->pending -= stripe_io_do_chain(&b->reqs[i]);
+		}
+		pthread_mutex_unlock(&sio->lock);
+		return;
+	}
+#endif
+	if (!sio || sio->nworkers == 0) {
+		for (i = 0; i < b->nreqs; i++)
+			if (!(b->reqs[i].flags & REQ_LINKED))
+				stripe_io_do_chain(&b->reqs[i]);
+		b->pending = 0;
+		return;
+	}
+	pthread_mutex_lock(&sio->lock);
+	for (i = 0; i < b->nreqs; i++) {
+		struct stripe_io_req *req = &b->reqs[i];
+		if (req->flags & REQ_LINKED)
+			continue;
+		*sio->queue_tail = req;
+		sio->queue_tail = &req->next;
+	}
+	pthread_cond_broadcast(&sio->work);
+	pthread_mutex_unlock(&sio->lock);
+}
+
+/* Wait for a submitted batch.  Returns the number of requests
+ * which failed; each request's 'err' says why.
+ */
+int stripe_io_wait(struct stripe_io *sio, struct stripe_io_batch *b)
+{
+	int i, failed = 0;
+
+#ifdef HAVE_IO_URING
+	if (sio && sio->ring) {
+		pthread_mutex_lock(&sio->lock);
+		while (b->pending)
+			if (ring_reap(sio->ring, 1) < 0)
+				break;
+		pthread_mutex_unlock(&sio->lock);
+		/* If the ring broke, whatever is left never completed */
+		for (i = 0; b->pending && i < b->nreqs; i++)
+			if (!b->reqs[i].err &&
+			    b->reqs[i].done < b->reqs[i].len)
+				b->reqs[i].err = EIO;
+		b->pending = 0;
+	} else
+#endif
+	if (sio && sio->nworkers) {
+		pthread_mutex_lock(&sio->lock);
+		while (b->pending)
+			pthread_cond_wait(&sio->done, &sio->lock);
+		pthread_mutex_unlock(&sio->lock);
+	}
+	for (i = 0; i < b->nreqs; i++)
+		if (b->reqs[i].err)
+			failed++;
+	return failed;
+}
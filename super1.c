@@ -925,8 +925,17 @@ static void getinfo_super1(struct supertype *st, struct mdinfo *info, char *map)
 				end = bboffset;
 		}
 
-		if (super_offset + info->bitmap_offset < end)
-			end = super_offset + info->bitmap_offset;
+		if (info->bitmap_offset < 0 &&
+		    super_offset + info->bitmap_offset < end) {
+			unsigned long long bmstart;
+			bmstart = super_offset + info->bitmap_offset;
+			if (info->data_offset + data_size < bmstart)
+				info->bitmap_space_after = end - bmstart;
+			else if (info->data_offset + data_size < end)
+				info->bitmap_space_after =
+					end - data_size - info->data_offset;
+			end = bmstart;
+		}
 
 		if (info->data_offset + data_size < end)
 			info->space_after = end - data_size - info->data_offset;
@@ -935,8 +944,15 @@ static void getinfo_super1(struct supertype *st, struct mdinfo *info, char *map)
 	} else {
 		unsigned long long earliest;
 		earliest = super_offset + (32+4)*2; /* match kernel */
+		if (sb->bblog_offset && sb->bblog_size) {
+			unsigned long long bbend = super_offset;
+			bbend += (int32_t)__le32_to_cpu(sb->bblog_offset);
+			bbend += __le32_to_cpu(sb->bblog_size);
+			if (bbend > earliest)
+				earliest = bbend;
+		}
 		if (info->bitmap_offset > 0) {
-			unsigned long long bmend = info->bitmap_offset;
+			unsigned long long bmend = super_offset + info->bitmap_offset;
 			unsigned long long size = __le64_to_cpu(bsb->sync_size);
 			size /= __le32_to_cpu(bsb->chunksize) >> 9;
 			size = (size + 7) >> 3;
@@ -944,15 +960,12 @@ static void getinfo_super1(struct supertype *st, struct mdinfo *info, char *map)
 			size = ROUND_UP(size, 4096);
 			size /= 512;
 			bmend += size;
-			if (bmend > earliest)
-				bmend = earliest;
-		}
-		if (sb->bblog_offset && sb->bblog_size) {
-			unsigned long long bbend = super_offset;
-			bbend += (int32_t)__le32_to_cpu(sb->bblog_offset);
-			bbend += __le32_to_cpu(sb->bblog_size);
-			if (bbend > earliest)
-				earliest = bbend;
+			if (bmend > earliest) {
+				if (earliest < info->data_offset)
+					info->bitmap_space_before =
+						min(bmend, info->data_offset) - earliest;
+				earliest = bmend;
+			}
 		}
 		if (earliest < info->data_offset)
 			info->space_before = info->data_offset - earliest;
@@ -2184,32 +2197,42 @@ static int write_bitmap1(struct supertype *st, int fd)
 	int rv = 0;
 	void *buf;
 	int towrite, n;
+	size_t iosize;
 	struct align_fd afd;
 
 	init_afd(&afd, fd);
 
 	locate_bitmap1(st, fd);
 
-	if (posix_memalign(&buf, 4096, 4096))
-		return -ENOMEM;
-
-	memset(buf, 0xff, 4096);
-	memcpy(buf, (char *)bms, sizeof(bitmap_super_t));
-
 	towrite = __le64_to_cpu(bms->sync_size) / (__le32_to_cpu(bms->chunksize)>>9);
 	towrite = (towrite+7) >> 3; /* bits to bytes */
 	towrite += sizeof(bitmap_super_t);
 	towrite = ROUND_UP(towrite, 512);
+
+	/* Write in large transfers, only the last partial sector
+	 * needs awrite()
+	 */
+	iosize = bitmap_io_size(fd, towrite);
+	if (posix_memalign(&buf, 4096, iosize))
+		return -ENOMEM;
+
+	memset(buf, 0xff, iosize);
+	memcpy(buf, (char *)bms, sizeof(bitmap_super_t));
+
 	while (towrite > 0) {
 		n = towrite;
-		if (n > 4096)
-			n = 4096;
-		n = awrite(&afd, buf, n);
+		if ((size_t)n > iosize)
+			n = iosize;
+		if (n >= afd.blk_sz) {
+			n -= n % afd.blk_sz;
+			n = write(fd, buf, n);
+		} else
+			n = awrite(&afd, buf, n);
 		if (n > 0)
 			towrite -= n;
 		else
 			break;
-		memset(buf, 0xff, 4096);
+		memset(buf, 0xff, sizeof(bitmap_super_t));
 	}
 	fsync(fd);
 	if (towrite)
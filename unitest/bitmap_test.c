@@ -0,0 +1,309 @@
+/*
+ * Check the buckets and longest runs from bitmap_heat_map() against a
+ * naive loop over the bits.  Bitmap files are written with runs that
+ * cross the 64 and 512 bit steps of the scanner, a partial last byte,
+ * a dirty tail, and truncated.
+ * Finally bitmap_advise() replays a small trace with known counts.
+ */
+
+#include "mdadm.h"
+
+#define CHUNK_SECTORS	128
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int test_bit(const unsigned char *bits, unsigned long long b)
+{
+	return (bits[b / 8] >> (b % 8)) & 1;
+}
+
+static void set_bits(unsigned char *bits, unsigned long long start,
+		     unsigned long long end)
+{
+	for (; start < end; start++)
+		bits[start / 8] |= 1 << (start % 8);
+}
+
+/* Write a bitmap file covering 'nbits' bits, of which 'bytes' bytes of
+ * 'bits' are actually written.  The last bit covers a partial chunk.
+ */
+static unsigned long long write_bitmap(char *name, unsigned char *bits,
+				       unsigned long long nbits,
+				       unsigned long long bytes)
+{
+	bitmap_super_t sb;
+	unsigned long long sync_size;
+	int fd;
+
+	sync_size = nbits * CHUNK_SECTORS - (nbits > 1 ? rnd() % CHUNK_SECTORS : 0);
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = __cpu_to_le32(BITMAP_MAGIC);
+	sb.version = __cpu_to_le32(BITMAP_MAJOR_HI);
+	sb.sync_size = __cpu_to_le64(sync_size);
+	sb.chunksize = __cpu_to_le32(CHUNK_SECTORS * 512);
+	sb.daemon_sleep = __cpu_to_le32(5);
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 ||
+	    write(fd, &sb, sizeof(sb)) != sizeof(sb) ||
+	    write(fd, bits, bytes) != (ssize_t)bytes) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+	return sync_size;
+}
+
+/* 'nbits' bits of which 'bytes' bytes are in the file; the rest count
+ * as dirty for the runs, but not for the dirty count.
+ */
+static int check_file(char *name, const char *what, unsigned char *bits,
+		      unsigned long long nbits, unsigned long long bytes)
+{
+	unsigned long long sync_size = write_bitmap(name, bits, nbits, bytes);
+	unsigned long long avail = min(nbits, bytes * 8);
+	unsigned long long b, start, dirty = 0;
+	unsigned long long max_run[2] = { 0, 0 };
+	unsigned long long *bucket;
+	unsigned long long bucket_bits;
+	struct bitmap_heat *heat = xmalloc(sizeof(*heat));
+	int errors = 0;
+
+	bucket_bits = ROUND_UP((nbits + BITMAP_HEAT_BUCKETS - 1) /
+			       BITMAP_HEAT_BUCKETS, 8ULL) ?: 8;
+	bucket = xcalloc(BITMAP_HEAT_BUCKETS, sizeof(*bucket));
+
+	if (bitmap_heat_map(name, NULL, heat) < 0) {
+		printf("%s: cannot scan %s\n", what, name);
+		free(heat);
+		free(bucket);
+		return 1;
+	}
+
+	for (b = 0; b < nbits; b = start) {
+		int d = b >= avail || test_bit(bits, b);
+
+		for (start = b; start < nbits; start++)
+			if ((start >= avail || test_bit(bits, start)) != d)
+				break;
+		if (start - b > max_run[d])
+			max_run[d] = start - b;
+	}
+
+	for (b = 0; b < avail; b++)
+		if (test_bit(bits, b)) {
+			dirty++;
+			bucket[b / bucket_bits]++;
+		}
+	if (heat->total_bits != avail || heat->dirty_bits != dirty) {
+		printf("%s: %llu of %llu bits dirty, expected %llu of %llu\n",
+		       what, heat->dirty_bits, heat->total_bits, dirty, avail);
+		errors++;
+	}
+	if (heat->bucket_bits != bucket_bits ||
+	    heat->buckets != (int)((nbits + bucket_bits - 1) / bucket_bits)) {
+		printf("%s: %d buckets of %llu bits, expected %d of %llu\n",
+		       what, heat->buckets, heat->bucket_bits,
+		       (int)((nbits + bucket_bits - 1) / bucket_bits),
+		       bucket_bits);
+		errors++;
+	}
+	for (b = 0; b < BITMAP_HEAT_BUCKETS; b++)
+		if (heat->dirty[b] != bucket[b]) {
+			printf("%s: bucket %llu has %llu, expected %llu\n",
+			       what, b, heat->dirty[b], bucket[b]);
+			errors++;
+			break;
+		}
+	if (heat->max_clean != min(max_run[0] * CHUNK_SECTORS, sync_size) ||
+	    heat->max_dirty != min(max_run[1] * CHUNK_SECTORS, sync_size)) {
+		printf("%s: longest runs %llu clean %llu dirty, expected %llu %llu\n",
+		       what, heat->max_clean, heat->max_dirty,
+		       min(max_run[0] * CHUNK_SECTORS, sync_size),
+		       min(max_run[1] * CHUNK_SECTORS, sync_size));
+		errors++;
+	}
+	free(heat);
+	free(bucket);
+	return errors;
+}
+
+/* A trace whose bitmap updates can be counted by hand, with a 5 second
+ * daemon and one data disk.  With 64K chunks: chunks 0 and 1 are set
+ * (one update, page 0), then chunk 0 again; at 12s both are cleared
+ * (one update) and chunks 32768-32769 set (one update, page 1); those
+ * are cleared after the trace (one update).  With 128K chunks all of
+ * this is in page 0 and chunks 0 and 16384: two sets and two clears.
+ */
+static const char advise_trace[] =
+	"# seconds sector sectors\n"
+	"0.0 0 8 W\n"
+	"9,0 1 2 1.000000000 697 Q W 128 + 8 [kjournald]\n"
+	"1.5 0 8\n"
+	"3.0 0 8 R\n"
+	"12.0 4194304 256 W\n";
+
+static int check_advise(char *name)
+{
+	struct bitmap_advice adv[2];
+	FILE *f = fopen(name, "w");
+	int errors = 0;
+	int best;
+
+	if (!f || fputs(advise_trace, f) < 0 || fclose(f) != 0) {
+		perror(name);
+		exit(1);
+	}
+	memset(adv, 0, sizeof(adv));
+	adv[0].chunksize = 64 * 1024;
+	adv[1].chunksize = 128 * 1024;
+	best = bitmap_advise(name, 1ULL << 30, 1, 1, 0, 5, 0.35, adv, 2);
+	if (best != 1) {
+		printf("bitmap_advise: chose %d, expected 1\n", best);
+		errors++;
+	}
+	if (adv[0].set_writes != 3 || adv[0].clear_writes != 2 ||
+	    adv[0].max_resync != 256 || adv[0].mean_resync != 245) {
+		printf("bitmap_advise: 64K: %llu sets %llu clears resync %llu max %llu mean, expected 3 2 256 245\n",
+		       adv[0].set_writes, adv[0].clear_writes,
+		       adv[0].max_resync, adv[0].mean_resync);
+		errors++;
+	}
+	if (adv[1].set_writes != 2 || adv[1].clear_writes != 2 ||
+	    adv[1].max_resync != 256) {
+		printf("bitmap_advise: 128K: %llu sets %llu clears resync %llu max, expected 2 2 256\n",
+		       adv[1].set_writes, adv[1].clear_writes,
+		       adv[1].max_resync);
+		errors++;
+	}
+
+	/* RAID5 with three data disks and 64K RAID chunks: a 128K write
+	 * at the start is two RAID chunks, both at the start of their
+	 * devices, so 16 4K bitmap chunks are dirty.  (Not 11, which
+	 * spreading the write evenly over the disks would give.)
+	 */
+	f = fopen(name, "w");
+	if (!f || fputs("0.0 0 256 W\n", f) < 0 || fclose(f) != 0) {
+		perror(name);
+		exit(1);
+	}
+	memset(adv, 0, sizeof(adv));
+	adv[0].chunksize = 4096;
+	bitmap_advise(name, 1ULL << 30, 5, 3, 64 * 1024, 5, 0.35, adv, 1);
+	if (adv[0].set_writes != 1 || adv[0].clear_writes != 1 ||
+	    adv[0].max_resync != 128) {
+		printf("bitmap_advise: RAID5: %llu sets %llu clears resync %llu max, expected 1 1 128\n",
+		       adv[0].set_writes, adv[0].clear_writes,
+		       adv[0].max_resync);
+		errors++;
+	}
+	return errors;
+}
+
+/* Runs of random length, most short, some long enough to cover whole
+ * 64 and 512 bit steps.
+ */
+static void random_runs(unsigned char *bits, unsigned long long nbits)
+{
+	unsigned long long b = 0;
+	int d = rnd() & 1;
+
+	memset(bits, 0, (nbits + 7) / 8);
+	while (b < nbits) {
+		unsigned long long len = rnd() % 4 ? 1 + rnd() % 70 :
+			1 + rnd() % 3000;
+
+		len = min(len, nbits - b);
+		if (d)
+			set_bits(bits, b, b + len);
+		b += len;
+		d = !d;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned long long edges[] = { 63, 64, 511, 512 };
+	unsigned long long nbits, bytes;
+	unsigned char *bits;
+	char dir[] = "bitmap_test.XXXXXX";
+	char name[sizeof(dir) + 16];
+	char what[80];
+	unsigned int i, j;
+	int errors = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(name, sizeof(name), "%s/bitmap", dir);
+	bits = xmalloc(1 << 20);
+
+	/* a single run starting or ending either side of each step */
+	for (i = 0; i < ARRAY_SIZE(edges); i++)
+		for (j = 0; j < ARRAY_SIZE(edges); j++) {
+			unsigned long long s = edges[i], e = edges[j] + 600;
+
+			nbits = 2000 + i;
+			memset(bits, 0, nbits / 8 + 1);
+			set_bits(bits, s, e);
+			snprintf(what, sizeof(what), "run %llu-%llu", s, e);
+			errors += check_file(name, what, bits, nbits,
+					     (nbits + 7) / 8);
+		}
+
+	/* empty, full, and dirty to the end */
+	for (nbits = 1; nbits < 3000; nbits += 1 + nbits / 3) {
+		bytes = (nbits + 7) / 8;
+		memset(bits, 0, bytes);
+		snprintf(what, sizeof(what), "clean %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		memset(bits, 0xff, bytes);
+		snprintf(what, sizeof(what), "dirty %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		memset(bits, 0, bytes);
+		set_bits(bits, nbits / 2, nbits);
+		snprintf(what, sizeof(what), "dirty tail %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+	}
+
+	/* random runs, with junk in the unused bits of the last byte,
+	 * and truncated
+	 */
+	for (i = 0; i < 300; i++) {
+		nbits = 1 + rnd() % (i < 250 ? 20000 : 8000000);
+		bytes = (nbits + 7) / 8;
+		random_runs(bits, nbits);
+		if (nbits % 8)
+			bits[nbits / 8] |= 0xff << (nbits % 8);
+		snprintf(what, sizeof(what), "random %u, %llu bits", i, nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		if (nbits % 8)
+			bits[nbits / 8] &= (1 << (nbits % 8)) - 1;
+		bytes = rnd() % bytes;
+		snprintf(what, sizeof(what), "random %u, %llu bits, %llu bytes",
+			 i, nbits, bytes);
+		errors += check_file(name, what, bits, nbits, bytes);
+	}
+
+	errors += check_advise(name);
+
+	unlink(name);
+	rmdir(dir);
+	free(bits);
+	if (errors) {
+		printf("bitmap: %d errors\n", errors);
+		return 1;
+	}
+	printf("bitmap: scans match the bits\n");
+	return 0;
+}
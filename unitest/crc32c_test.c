@@ -0,0 +1,125 @@
+/*
+ * Check crc32c() against known answers, and that continuing a crc over
+ * several calls gives what one call over all the data does, for each
+ * implementation this CPU can run.
+ */
+
+#include "mdadm.h"
+
+static const char *const impls[] = { "sw", "sse4.2" };
+
+#define BUF_SIZE	(4096 + 13)
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int check_known(const char *name)
+{
+	/* "123456789" is the usual check value, the others are
+	 * from RFC 3720, B.4
+	 */
+	unsigned char buf[32];
+	int errors = 0;
+	unsigned int crc;
+	int i;
+
+	crc = crc32c(0, "123456789", 9);
+	if (crc != 0xe3069283) {
+		printf("%s: crc32c(\"123456789\") is %08x, expected e3069283\n",
+		       name, crc);
+		errors++;
+	}
+	memset(buf, 0, sizeof(buf));
+	crc = crc32c(0, buf, sizeof(buf));
+	if (crc != 0x8a9136aa) {
+		printf("%s: crc32c of 32 zeros is %08x, expected 8a9136aa\n",
+		       name, crc);
+		errors++;
+	}
+	for (i = 0; i < 32; i++)
+		buf[i] = i;
+	crc = crc32c(0, buf, sizeof(buf));
+	if (crc != 0x46dd794e) {
+		printf("%s: crc32c of 0..31 is %08x, expected 46dd794e\n",
+		       name, crc);
+		errors++;
+	}
+	return errors;
+}
+
+/* Split each of many unaligned pieces of 'buf' in two at every few
+ * bytes, and compare with a single call and with 'want', the crcs
+ * from the first implementation.
+ */
+static int check_chained(const char *name, unsigned char *buf,
+			 unsigned int *want, int first)
+{
+	int errors = 0;
+	int t;
+
+	for (t = 0; t < 200; t++) {
+		int start = rnd() % 16;
+		int len = rnd() % (BUF_SIZE - start);
+		unsigned int whole = crc32c(0, buf + start, len);
+		int split;
+
+		if (first)
+			want[t] = whole;
+		if (whole != want[t]) {
+			printf("%s: crc32c at %d length %d is %08x, expected %08x\n",
+			       name, start, len, whole, want[t]);
+			errors++;
+		}
+		for (split = 0; split <= len; split += 1 + rnd() % 61) {
+			unsigned int crc = crc32c(0, buf + start, split);
+
+			crc = crc32c(crc, buf + start + split, len - split);
+			if (crc != whole) {
+				printf("%s: crc32c at %d length %d split at %d is %08x, expected %08x\n",
+				       name, start, len, split, crc, whole);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *buf = xmalloc(BUF_SIZE);
+	unsigned int want[200];
+	unsigned int i;
+	int errors = 0;
+	int tested = 0;
+
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = rnd();
+
+	for (i = 0; i < ARRAY_SIZE(impls); i++) {
+		if (crc32c_select(impls[i]) != 0) {
+			printf("%s: not supported by this cpu, skipped\n",
+			       impls[i]);
+			continue;
+		}
+		tested++;
+		errors += check_known(impls[i]);
+		seed = 2;
+		errors += check_chained(impls[i], buf, want, tested == 1);
+	}
+	free(buf);
+
+	if (errors) {
+		printf("crc32c: %d errors\n", errors);
+		return 1;
+	}
+	printf("crc32c: %d implementations match\n", tested);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Check count_dirty_bits() against a naive loop over the bits, for
+ * odd lengths and alignments that cross its 64 and 512 bit steps,
+ * with bitmaps that are mostly clean or mostly dirty.
+ */
+
+#include "mdadm.h"
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int test_bit(const unsigned char *bits, unsigned long long b)
+{
+	return (bits[b / 8] >> (b % 8)) & 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char buf[4096];
+	int errors = 0;
+	int i, n, want;
+
+	for (i = 0; i < 2000; i++) {
+		/* odd lengths and alignments, mostly clean or mostly dirty */
+		unsigned int off = rnd() % 8;
+		int nbits = rnd() % ((sizeof(buf) - off) * 8 + 1);
+		unsigned int density = rnd() % 9;
+
+		for (n = 0; n < (int)sizeof(buf); n++)
+			buf[n] = rnd() % 8 < density ? rnd() | rnd() :
+				rnd() & rnd();
+		want = 0;
+		for (n = 0; n < nbits; n++)
+			want += test_bit(buf + off, n);
+		n = count_dirty_bits((char *)buf + off, nbits);
+		if (n != want) {
+			printf("count_dirty_bits: %d bits at +%u: %d, expected %d\n",
+			       nbits, off, n, want);
+			errors++;
+		}
+	}
+
+	if (errors) {
+		printf("dirty_bits: %d errors\n", errors);
+		return 1;
+	}
+	printf("dirty_bits: counts match the bits\n");
+	return 0;
+}
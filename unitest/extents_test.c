@@ -0,0 +1,206 @@
+/*
+ * Check the extents from bitmap_dirty_extents() against a naive loop
+ * over the bits.  Bitmap files are written with runs that cross the
+ * 64 and 512 bit steps of the scanner, a partial last byte, a dirty
+ * tail, and truncated; bits past the end of the file count as dirty.
+ */
+
+#include "mdadm.h"
+
+#define CHUNK_SECTORS	128
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int test_bit(const unsigned char *bits, unsigned long long b)
+{
+	return (bits[b / 8] >> (b % 8)) & 1;
+}
+
+static void set_bits(unsigned char *bits, unsigned long long start,
+		     unsigned long long end)
+{
+	for (; start < end; start++)
+		bits[start / 8] |= 1 << (start % 8);
+}
+
+/* Write a bitmap file covering 'nbits' bits, of which 'bytes' bytes of
+ * 'bits' are actually written.  The last bit covers a partial chunk.
+ */
+static unsigned long long write_bitmap(char *name, unsigned char *bits,
+				       unsigned long long nbits,
+				       unsigned long long bytes)
+{
+	bitmap_super_t sb;
+	unsigned long long sync_size;
+	int fd;
+
+	sync_size = nbits * CHUNK_SECTORS - (nbits > 1 ? rnd() % CHUNK_SECTORS : 0);
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = __cpu_to_le32(BITMAP_MAGIC);
+	sb.version = __cpu_to_le32(BITMAP_MAJOR_HI);
+	sb.sync_size = __cpu_to_le64(sync_size);
+	sb.chunksize = __cpu_to_le32(CHUNK_SECTORS * 512);
+	sb.daemon_sleep = __cpu_to_le32(5);
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 ||
+	    write(fd, &sb, sizeof(sb)) != sizeof(sb) ||
+	    write(fd, bits, bytes) != (ssize_t)bytes) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+	return sync_size;
+}
+
+/* 'nbits' bits of which 'bytes' bytes are in the file */
+static int check_file(char *name, const char *what, unsigned char *bits,
+		      unsigned long long nbits, unsigned long long bytes)
+{
+	unsigned long long sync_size = write_bitmap(name, bits, nbits, bytes);
+	unsigned long long avail = min(nbits, bytes * 8);
+	unsigned long long b, start;
+	struct bitmap_extent *ext = NULL;
+	int nr, e = 0;
+	int errors = 0;
+
+	nr = bitmap_dirty_extents(name, NULL, &ext);
+	if (nr < 0) {
+		printf("%s: cannot scan %s\n", what, name);
+		return 1;
+	}
+
+	for (b = 0; b < nbits; b = start) {
+		int d = b >= avail || test_bit(bits, b);
+
+		for (start = b; start < nbits; start++)
+			if ((start >= avail || test_bit(bits, start)) != d)
+				break;
+		if (!d)
+			continue;
+		if (e >= nr ||
+		    ext[e].start != b * CHUNK_SECTORS ||
+		    ext[e].sectors != min(start * CHUNK_SECTORS, sync_size) -
+		    b * CHUNK_SECTORS) {
+			printf("%s: extent %d is %llu+%llu, expected %llu+%llu\n",
+			       what, e, e < nr ? ext[e].start : 0,
+			       e < nr ? ext[e].sectors : 0, b * CHUNK_SECTORS,
+			       min(start * CHUNK_SECTORS, sync_size) -
+			       b * CHUNK_SECTORS);
+			errors++;
+		}
+		e++;
+	}
+	if (e != nr) {
+		printf("%s: %d extents, expected %d\n", what, nr, e);
+		errors++;
+	}
+	free(ext);
+	return errors;
+}
+
+/* Runs of random length, most short, some long enough to cover whole
+ * 64 and 512 bit steps.
+ */
+static void random_runs(unsigned char *bits, unsigned long long nbits)
+{
+	unsigned long long b = 0;
+	int d = rnd() & 1;
+
+	memset(bits, 0, (nbits + 7) / 8);
+	while (b < nbits) {
+		unsigned long long len = rnd() % 4 ? 1 + rnd() % 70 :
+			1 + rnd() % 3000;
+
+		len = min(len, nbits - b);
+		if (d)
+			set_bits(bits, b, b + len);
+		b += len;
+		d = !d;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned long long edges[] = { 63, 64, 511, 512 };
+	unsigned long long nbits, bytes;
+	unsigned char *bits;
+	char dir[] = "extents_test.XXXXXX";
+	char name[sizeof(dir) + 16];
+	char what[80];
+	unsigned int i, j;
+	int errors = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(name, sizeof(name), "%s/bitmap", dir);
+	bits = xmalloc(1 << 20);
+
+	/* a single run starting or ending either side of each step */
+	for (i = 0; i < ARRAY_SIZE(edges); i++)
+		for (j = 0; j < ARRAY_SIZE(edges); j++) {
+			unsigned long long s = edges[i], e = edges[j] + 600;
+
+			nbits = 2000 + i;
+			memset(bits, 0, nbits / 8 + 1);
+			set_bits(bits, s, e);
+			snprintf(what, sizeof(what), "run %llu-%llu", s, e);
+			errors += check_file(name, what, bits, nbits,
+					     (nbits + 7) / 8);
+		}
+
+	/* empty, full, and dirty to the end */
+	for (nbits = 1; nbits < 3000; nbits += 1 + nbits / 3) {
+		bytes = (nbits + 7) / 8;
+		memset(bits, 0, bytes);
+		snprintf(what, sizeof(what), "clean %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		memset(bits, 0xff, bytes);
+		snprintf(what, sizeof(what), "dirty %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		memset(bits, 0, bytes);
+		set_bits(bits, nbits / 2, nbits);
+		snprintf(what, sizeof(what), "dirty tail %llu", nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+	}
+
+	/* random runs, with junk in the unused bits of the last byte,
+	 * and truncated
+	 */
+	for (i = 0; i < 300; i++) {
+		nbits = 1 + rnd() % (i < 250 ? 20000 : 8000000);
+		bytes = (nbits + 7) / 8;
+		random_runs(bits, nbits);
+		if (nbits % 8)
+			bits[nbits / 8] |= 0xff << (nbits % 8);
+		snprintf(what, sizeof(what), "random %u, %llu bits", i, nbits);
+		errors += check_file(name, what, bits, nbits, bytes);
+		if (nbits % 8)
+			bits[nbits / 8] &= (1 << (nbits % 8)) - 1;
+		bytes = rnd() % bytes;
+		snprintf(what, sizeof(what), "random %u, %llu bits, %llu bytes",
+			 i, nbits, bytes);
+		errors += check_file(name, what, bits, nbits, bytes);
+	}
+
+	unlink(name);
+	rmdir(dir);
+	free(bits);
+	if (errors) {
+		printf("extents: %d errors\n", errors);
+		return 1;
+	}
+	printf("extents: extents match the bits\n");
+	return 0;
+}
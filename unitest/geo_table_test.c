@@ -0,0 +1,104 @@
+/*
+ * Check that the precomputed layout tables from geo_table_create()
+ * agree with geo_map() for every RAID4/5/6 layout.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+
+static const int raid5_layouts[] = {
+	ALGORITHM_LEFT_ASYMMETRIC,
+	ALGORITHM_RIGHT_ASYMMETRIC,
+	ALGORITHM_LEFT_SYMMETRIC,
+	ALGORITHM_RIGHT_SYMMETRIC,
+	ALGORITHM_PARITY_0,
+	ALGORITHM_PARITY_N,
+};
+
+static const int raid6_layouts[] = {
+	ALGORITHM_LEFT_ASYMMETRIC,
+	ALGORITHM_RIGHT_ASYMMETRIC,
+	ALGORITHM_LEFT_SYMMETRIC,
+	ALGORITHM_RIGHT_SYMMETRIC,
+	ALGORITHM_PARITY_0,
+	ALGORITHM_PARITY_N,
+	ALGORITHM_ROTATING_ZERO_RESTART,
+	ALGORITHM_ROTATING_N_RESTART,
+	ALGORITHM_ROTATING_N_CONTINUE,
+	ALGORITHM_LEFT_ASYMMETRIC_6,
+	ALGORITHM_RIGHT_ASYMMETRIC_6,
+	ALGORITHM_LEFT_SYMMETRIC_6,
+	ALGORITHM_RIGHT_SYMMETRIC_6,
+	ALGORITHM_PARITY_0_6,
+};
+
+static int check_layout(int raid_disks, int level, int layout)
+{
+	struct geo_table *gt = geo_table_create(raid_disks, level, layout);
+	int data_disks = raid_disks - (level == 6 ? 2 : 1);
+	unsigned long long stripe;
+	int errors = 0;
+	int b;
+
+	if (!gt) {
+		printf("level %d layout %d disks %d: no table\n",
+		       level, layout, raid_disks);
+		return 1;
+	}
+	/* several periods, and some stripes far into the device */
+	for (stripe = 0; stripe < 1000; stripe++) {
+		unsigned long long s = stripe < 500 ? stripe :
+			(1ULL << 40) + stripe * 7919;
+		const int *map = geo_table_disks(gt, s);
+		const int *blocks = geo_table_blocks(gt, s);
+		int first = level == 6 ? -2 : -1;
+
+		for (b = first; b < data_disks; b++) {
+			int disk = geo_map(b, s, raid_disks, level, layout);
+
+			if (map[b] != disk) {
+				printf("level %d layout %d disks %d stripe %llu"
+				       " block %d: table %d geo_map %d\n",
+				       level, layout, raid_disks, s, b,
+				       map[b], disk);
+				errors++;
+			}
+			if (disk < 0 || disk >= raid_disks ||
+			    blocks[disk] != b) {
+				printf("level %d layout %d disks %d stripe %llu"
+				       " disk %d: holds %d, expected %d\n",
+				       level, layout, raid_disks, s, disk,
+				       disk >= 0 && disk < raid_disks ?
+				       blocks[disk] : GEO_NO_BLOCK, b);
+				errors++;
+			}
+		}
+	}
+	geo_table_free(gt);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int raid_disks;
+	int errors = 0;
+
+	for (raid_disks = 2; raid_disks <= 16; raid_disks++) {
+		errors += check_layout(raid_disks, 4, 0);
+		for (i = 0; i < ARRAY_SIZE(raid5_layouts); i++)
+			errors += check_layout(raid_disks, 5,
+					       raid5_layouts[i]);
+	}
+	for (raid_disks = 4; raid_disks <= 16; raid_disks++)
+		for (i = 0; i < ARRAY_SIZE(raid6_layouts); i++)
+			errors += check_layout(raid_disks, 6,
+					       raid6_layouts[i]);
+
+	if (errors) {
+		printf("geo_table: %d errors\n", errors);
+		return 1;
+	}
+	printf("geo_table: all layouts match geo_map\n");
+	return 0;
+}
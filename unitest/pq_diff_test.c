@@ -0,0 +1,116 @@
+/*
+ * Check pq_diff, which raid6_check_disks() uses to find the first byte
+ * where P or Q differ, from every routine set in restripe_calls_list[]
+ * that this CPU can run against the scalar one.  Each size is tried
+ * with no difference, then one at either end and one in between, on
+ * sizes including ones with a tail the vector loops do not cover.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+
+static const int test_sizes[] = {
+	1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+	255, 256, 257, 511, 1000, 4096, 4096 + 13, 65536 + 63,
+};
+
+#define TEST_MAX_SIZE	(65536 + 64)
+#define ROUNDS		16
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fill(uint8_t *buf, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = rnd();
+}
+
+static uint8_t *alloc_block(void)
+{
+	uint8_t *buf;
+
+	if (posix_memalign((void**)&buf, 4096, TEST_MAX_SIZE)) {
+		fprintf(stderr, "pq_diff_test: out of memory\n");
+		exit(1);
+	}
+	return buf;
+}
+
+static uint8_t *p, *q, *p2, *q2;
+
+static int check_pq_diff(const struct restripe_calls *c, int size)
+{
+	int errors = 0;
+	size_t at;
+	int i;
+
+	fill(p, size);
+	fill(q, size);
+	memcpy(p2, p, size);
+	memcpy(q2, q, size);
+	if (c->pq_diff(p, p2, q, q2, size) != (size_t)size) {
+		printf("%s: pq_diff found a change, size %d\n", c->name, size);
+		errors++;
+	}
+	for (i = 0; i < 6; i++) {
+		uint8_t *b = i & 1 ? q2 : p2;
+		size_t want;
+
+		at = i < 2 ? 0 : i < 4 ? (size_t)size - 1 : rnd() % size;
+		b[at] ^= 1 << (rnd() % 8);
+		want = pq_diff_scalar(p, p2, q, q2, size);
+		if (want != at ||
+		    c->pq_diff(p, p2, q, q2, size) != want) {
+			printf("%s: pq_diff differs from scalar, size %d change at %zu\n",
+			       c->name, size, at);
+			errors++;
+		}
+		memcpy(p2, p, size);
+		memcpy(q2, q, size);
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct restripe_calls *const *c;
+	unsigned int i;
+	int r;
+	int errors = 0;
+	int sets = 0;
+
+	p = alloc_block();
+	q = alloc_block();
+	p2 = alloc_block();
+	q2 = alloc_block();
+
+	for (c = restripe_calls_list; *c; c++) {
+		if (restripe_calls_select((*c)->name) != 0) {
+			printf("%s: not supported by this cpu, skipped\n",
+			       (*c)->name);
+			continue;
+		}
+		sets++;
+		for (i = 0; i < ARRAY_SIZE(test_sizes); i++)
+			for (r = 0; r < ROUNDS; r++)
+				errors += check_pq_diff(*c, test_sizes[i]);
+	}
+
+	if (errors) {
+		printf("pq_diff: %d errors\n", errors);
+		return 1;
+	}
+	printf("pq_diff: %d routine sets match scalar\n", sets);
+	return 0;
+}
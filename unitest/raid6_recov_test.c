@@ -0,0 +1,179 @@
+/*
+ * Check the two RAID6 recovery loops from every routine set in
+ * restripe_calls_list[] that this CPU can run against the scalar
+ * ones, on random data of many sizes including ones with a tail the
+ * vector loops do not cover.  Then rebuild every pair of failed data
+ * blocks, and every data block with P, through raid6_2data_recov()
+ * and raid6_datap_recov() with each set selected.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+
+static const int test_sizes[] = {
+	1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+	255, 256, 257, 511, 1000, 4096, 4096 + 13, 65536 + 63,
+};
+
+#define TEST_MAX_SIZE	(65536 + 64)
+#define MAX_DATA	16
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fill(uint8_t *buf, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = rnd();
+}
+
+static uint8_t *alloc_block(void)
+{
+	uint8_t *buf;
+
+	if (posix_memalign((void**)&buf, 4096, TEST_MAX_SIZE)) {
+		fprintf(stderr, "raid6_recov_test: out of memory\n");
+		exit(1);
+	}
+	return buf;
+}
+
+static uint8_t *data[MAX_DATA + 2];
+static uint8_t *p, *q, *p2, *dp, *dq, *dp2, *dq2;
+
+/* The recovery loops are just arithmetic on whatever they get */
+static int check_loops(const struct restripe_calls *c, int size)
+{
+	int errors = 0;
+	int i;
+
+	fill(p, size);
+	fill(q, size);
+	fill(dp, size);
+	fill(dq, size);
+	memcpy(dp2, dp, size);
+	memcpy(dq2, dq, size);
+	i = rnd();
+	restripe_scalar.recov_2data(size, p, q, dp, dq, i, i >> 8);
+	c->recov_2data(size, p, q, dp2, dq2, i, i >> 8);
+	if (memcmp(dp, dp2, size) != 0 || memcmp(dq, dq2, size) != 0) {
+		printf("%s: recov_2data differs from scalar, size %d\n",
+		       c->name, size);
+		errors++;
+	}
+
+	memcpy(p2, p, size);
+	memcpy(dq2, dq, size);
+	restripe_scalar.recov_datap(size, p, q, dq, i);
+	c->recov_datap(size, p2, q, dq2, i);
+	if (memcmp(p, p2, size) != 0 || memcmp(dq, dq2, size) != 0) {
+		printf("%s: recov_datap differs from scalar, size %d\n",
+		       c->name, size);
+		errors++;
+	}
+	return errors;
+}
+
+/* Lose each pair of data blocks, and each data block with P, of a
+ * stripe of 'disks' data blocks, and check that they come back.
+ */
+static int check_recovery(const struct restripe_calls *c, int disks, int size)
+{
+	uint8_t *save[2];
+	int errors = 0;
+	int a, b;
+
+	for (a = 0; a < disks; a++)
+		fill(data[a], size);
+	restripe_scalar.qsyndrome(data[disks], data[disks+1], data,
+				  disks, size);
+	save[0] = dp2;
+	save[1] = dq2;
+	if (ensure_zero_has_size(size)) {
+		printf("%s: no zero block of size %d\n", c->name, size);
+		return 1;
+	}
+
+	for (a = 0; a < disks; a++) {
+		for (b = a + 1; b < disks; b++) {
+			memcpy(save[0], data[a], size);
+			memcpy(save[1], data[b], size);
+			fill(data[a], size);
+			fill(data[b], size);
+			raid6_2data_recov(disks + 2, size, a, b, data);
+			if (memcmp(save[0], data[a], size) != 0 ||
+			    memcmp(save[1], data[b], size) != 0) {
+				printf("%s: raid6_2data_recov failed, disks %d size %d failed %d,%d\n",
+				       c->name, disks, size, a, b);
+				errors++;
+				memcpy(data[a], save[0], size);
+				memcpy(data[b], save[1], size);
+			}
+		}
+		memcpy(save[0], data[a], size);
+		memcpy(save[1], data[disks], size);
+		fill(data[a], size);
+		fill(data[disks], size);
+		raid6_datap_recov(disks + 2, size, a, data);
+		if (memcmp(save[0], data[a], size) != 0 ||
+		    memcmp(save[1], data[disks], size) != 0) {
+			printf("%s: raid6_datap_recov failed, disks %d size %d failed %d,P\n",
+			       c->name, disks, size, a);
+			errors++;
+			memcpy(data[a], save[0], size);
+			memcpy(data[disks], save[1], size);
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct restripe_calls *const *c;
+	unsigned int i;
+	int disks;
+	int errors = 0;
+	int sets = 0;
+
+	for (i = 0; i < ARRAY_SIZE(data); i++)
+		data[i] = alloc_block();
+	p = alloc_block();
+	q = alloc_block();
+	p2 = alloc_block();
+	dp = alloc_block();
+	dq = alloc_block();
+	dp2 = alloc_block();
+	dq2 = alloc_block();
+
+	for (c = restripe_calls_list; *c; c++) {
+		if (restripe_calls_select((*c)->name) != 0) {
+			printf("%s: not supported by this cpu, skipped\n",
+			       (*c)->name);
+			continue;
+		}
+		sets++;
+		for (i = 0; i < ARRAY_SIZE(test_sizes); i++)
+			errors += check_loops(*c, test_sizes[i]);
+		for (i = 0; i < ARRAY_SIZE(test_sizes); i++)
+			for (disks = 2; disks <= MAX_DATA; disks += 3)
+				errors += check_recovery(*c, disks,
+							 test_sizes[i]);
+	}
+
+	if (errors) {
+		printf("raid6_recov: %d errors\n", errors);
+		return 1;
+	}
+	printf("raid6_recov: %d routine sets recover what was lost\n", sets);
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Throughput of the restripe.c parity kernels, for every routine set
+ * the CPU supports, over a range of disk counts and chunk sizes.
+ *
+ * Usage: restripe_bench [-q]
+ *	-q	quick run: shorter timings and fewer geometries
+ *
+ * Results are written to stdout as JSON.  Rates are in GB/s of data
+ * blocks in the stripe (data_disks * chunk_size bytes per call), so
+ * the numbers for the different functions can be compared directly.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+#include <time.h>
+
+enum {
+	BENCH_XOR,
+	BENCH_QSYNDROME,
+	BENCH_2DATA_RECOV,
+	BENCH_DATAP_RECOV,
+	BENCH_CHECK_DISKS,
+};
+
+static const char *bench_names[] = {
+	[BENCH_XOR]		= "xor_blocks",
+	[BENCH_QSYNDROME]	= "qsyndrome",
+	[BENCH_2DATA_RECOV]	= "raid6_2data_recov",
+	[BENCH_DATAP_RECOV]	= "raid6_datap_recov",
+	[BENCH_CHECK_DISKS]	= "raid6_check_disks",
+};
+
+static const int bench_disks[] = { 4, 6, 8, 12, 16 };
+static const int bench_chunks[] = { 4096, 65536, 524288 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 'disks' blocks of 'chunk_size': the data, then P and Q */
+static uint8_t **alloc_stripe(int disks, int chunk_size)
+{
+	uint8_t **blocks = xcalloc(disks, sizeof(uint8_t*));
+	int i, j;
+
+	for (i = 0; i < disks; i++) {
+		if (posix_memalign((void**)&blocks[i], 4096, chunk_size)) {
+			fprintf(stderr, "restripe_bench: out of memory\n");
+			exit(1);
+		}
+		for (j = 0; j < chunk_size; j++)
+			blocks[i][j] = rand();
+	}
+	return blocks;
+}
+
+static void free_stripe(uint8_t **blocks, int disks)
+{
+	int i;
+
+	for (i = 0; i < disks; i++)
+		free(blocks[i]);
+	free(blocks);
+}
+
+static void run_once(int which, uint8_t **blocks, int disks, int chunk_size)
+{
+	int data_disks = disks - 2;
+	char *stripes[disks];
+	int i;
+
+	switch (which) {
+	case BENCH_XOR:
+		xor_blocks((char*)blocks[data_disks], (char**)blocks,
+			   data_disks, chunk_size);
+		break;
+	case BENCH_QSYNDROME:
+		qsyndrome(blocks[data_disks], blocks[data_disks+1],
+			  blocks, data_disks, chunk_size);
+		break;
+	case BENCH_2DATA_RECOV:
+		raid6_2data_recov(disks, chunk_size, 0, data_disks / 2,
+				  blocks);
+		break;
+	case BENCH_DATAP_RECOV:
+		raid6_datap_recov(disks, chunk_size, data_disks / 2, blocks);
+		break;
+	case BENCH_CHECK_DISKS:
+		/* A clean stripe, which is what a scrub almost always sees.
+		 * Stored parity is in blocks[data_disks..], computed in the
+		 * two spare blocks after it.
+		 */
+		for (i = 0; i < disks; i++)
+			stripes[i] = (char*)blocks[i];
+		raid6_check_disks(data_disks, 0, chunk_size, 6,
+				  ALGORITHM_PARITY_N,
+				  data_disks, data_disks + 1,
+				  (char*)blocks[disks], (char*)blocks[disks+1],
+				  stripes);
+		break;
+	}
+}
+
+/* Returns GB/s for one function on one geometry */
+static double bench(int which, int disks, int chunk_size, double min_time)
+{
+	/* two spare blocks for raid6_check_disks() */
+	uint8_t **blocks = alloc_stripe(disks + 2, chunk_size);
+	unsigned long long iters = 1, n, i;
+	double start, elapsed;
+
+	qsyndrome(blocks[disks-2], blocks[disks-1], blocks, disks-2,
+		  chunk_size);
+	memcpy(blocks[disks], blocks[disks-2], chunk_size);
+	memcpy(blocks[disks+1], blocks[disks-1], chunk_size);
+
+	/* warm up, then keep doubling until the run is long enough */
+	run_once(which, blocks, disks, chunk_size);
+	for (n = 0; ; iters *= 2) {
+		start = now();
+		for (i = 0; i < iters; i++)
+			run_once(which, blocks, disks, chunk_size);
+		elapsed = now() - start;
+		n = iters;
+		if (elapsed >= min_time)
+			break;
+	}
+	free_stripe(blocks, disks + 2);
+	return (double)n * (disks - 2) * chunk_size / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct restripe_calls *const *calls;
+	const struct restripe_calls *def = restripe_calls_get();
+	double min_time = 0.2;
+	int ndisks = ARRAY_SIZE(bench_disks);
+	int nchunks = ARRAY_SIZE(bench_chunks);
+	unsigned int d, c, w;
+	int first = 1;
+
+	if (argc > 1 && strcmp(argv[1], "-q") == 0) {
+		min_time = 0.01;
+		ndisks = 2;
+		nchunks = 2;
+	} else if (argc > 1) {
+		fprintf(stderr, "Usage: restripe_bench [-q]\n");
+		exit(2);
+	}
+
+	ensure_zero_has_size(bench_chunks[ARRAY_SIZE(bench_chunks) - 1]);
+
+	printf("{\n  \"default\": \"%s\",\n  \"units\": \"GB/s\",\n"
+	       "  \"results\": [", def->name);
+	for (calls = restripe_calls_list; *calls; calls++) {
+		if (!(*calls)->valid())
+			continue;
+		restripe_calls_select((*calls)->name);
+		for (w = 0; w < ARRAY_SIZE(bench_names); w++)
+			for (d = 0; d < (unsigned)ndisks; d++)
+				for (c = 0; c < (unsigned)nchunks; c++) {
+					double rate = bench(w, bench_disks[d],
+							    bench_chunks[c],
+							    min_time);
+					printf("%s\n    { \"kernel\": \"%s\","
+					       " \"function\": \"%s\","
+					       " \"disks\": %d,"
+					       " \"chunk_size\": %d,"
+					       " \"rate\": %.3f }",
+					       first ? "" : ",",
+					       (*calls)->name, bench_names[w],
+					       bench_disks[d], bench_chunks[c],
+					       rate);
+					first = 0;
+					fflush(stdout);
+				}
+	}
+	printf("\n  ]\n}\n");
+	return 0;
+}
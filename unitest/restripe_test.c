@@ -0,0 +1,101 @@
+/*
+ * Check xor_blocks from every routine set in restripe_calls_list[]
+ * that this CPU can run against the scalar one, on random data of
+ * many sizes including ones with a tail the vector loops do not cover.
+ */
+
+#include "mdadm.h"
+#include "restripe.h"
+
+static const int test_sizes[] = {
+	1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+	255, 256, 257, 511, 1000, 4096, 4096 + 13, 65536 + 63,
+};
+
+#define TEST_MAX_SIZE	(65536 + 64)
+#define MAX_DATA	16
+
+static unsigned int seed = 1;
+
+/* xorshift, so that a failure can be reproduced */
+static unsigned int rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fill(uint8_t *buf, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = rnd();
+}
+
+static uint8_t *alloc_block(void)
+{
+	uint8_t *buf;
+
+	if (posix_memalign((void**)&buf, 4096, TEST_MAX_SIZE)) {
+		fprintf(stderr, "restripe_test: out of memory\n");
+		exit(1);
+	}
+	return buf;
+}
+
+static uint8_t *data[MAX_DATA];
+static uint8_t *p, *p2;
+
+static int check_xor(const struct restripe_calls *c, int disks, int size)
+{
+	int i;
+
+	for (i = 0; i < disks; i++)
+		fill(data[i], size);
+
+	restripe_scalar.xor_blocks((char*)p, (char**)data, disks, size);
+	/* a canary after the end catches writes past 'size' */
+	p2[size] = 0xa5;
+	c->xor_blocks((char*)p2, (char**)data, disks, size);
+	if (memcmp(p, p2, size) != 0 || p2[size] != 0xa5) {
+		printf("%s: xor_blocks differs from scalar, disks %d size %d\n",
+		       c->name, disks, size);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct restripe_calls *const *c;
+	unsigned int i;
+	int disks;
+	int errors = 0;
+	int sets = 0;
+
+	for (i = 0; i < ARRAY_SIZE(data); i++)
+		data[i] = alloc_block();
+	p = alloc_block();
+	p2 = alloc_block();
+
+	for (c = restripe_calls_list; *c; c++) {
+		if (restripe_calls_select((*c)->name) != 0) {
+			printf("%s: not supported by this cpu, skipped\n",
+			       (*c)->name);
+			continue;
+		}
+		sets++;
+		for (i = 0; i < ARRAY_SIZE(test_sizes); i++)
+			for (disks = 1; disks <= MAX_DATA; disks++)
+				errors += check_xor(*c, disks, test_sizes[i]);
+	}
+
+	if (errors) {
+		printf("restripe: %d errors\n", errors);
+		return 1;
+	}
+	printf("restripe: %d routine sets match scalar\n", sets);
+	return 0;
+}